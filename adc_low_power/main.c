@@ -17,13 +17,26 @@
  * @brief ADC Example Application main file.
  *
  * This file contains the source code for a sample application using the ADC driver.
+ *
+ * With WINDOW_DETECT_ENABLED set to 1, each sample is compared with a lower and an upper
+ * threshold of its channel in the ADC interrupt handler, and the main loop only processes and logs
+ * a sample when it crossed one of the thresholds. With WINDOW_LPCOMP_WAKE_ENABLED set to 1, the
+ * ADC is not sampled periodically. LPCOMP wakes the chip when channel 0 crosses its reference,
+ * and a single ADC sample of channel 0 is then evaluated against the window.
+ *
+ * With ENERGY_ACCOUNTING_ENABLED set to 1, the time spent with HFCLK crystal running, ADC
+ * converting, CPU awake and UART transmitting is accumulated, and converted into an estimated
+ * average current using the ENERGY_I_* current table. The estimate is logged every
+ * ENERGY_REPORT_INTERVAL_MS.
  */
 
 #include "nrf.h"
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include "nrf_drv_adc.h"
+#include "nrf_drv_lpcomp.h"
 #include "nordic_common.h"
 #include "boards.h"
 #define NRF_LOG_MODULE_NAME "APP"
@@ -39,17 +52,298 @@
 #define HIGH_ACCURACY_ADC_ENABLE        0               //Set to 1 to enable high accuracy ADC sampling (use HFCLK crystal while sampling). Set to 0 for lowest current consumption.
 #define NRF_LOGGING_ENABLED             0               //Set as 1 to enable logging on UART, otherwise set as 0. Comment out to enable low current consumption
 #define ADC_BUFFER_SIZE                 6               //Size of buffer for ADC samples. Buffer size should be multiple of number of adc channels located.
+#define WINDOW_DETECT_ENABLED           0               //Set to 1 to only process and log samples that cross a threshold of their channel. Set to 0 to log all samples.
+#define WINDOW_LPCOMP_WAKE_ENABLED      0               //Set to 1 to sample channel 0 only when LPCOMP detects a crossing of LPCOMP_REFERENCE, instead of sampling all channels periodically. Requires WINDOW_DETECT_ENABLED.
+#define WINDOW_DETECT_INTERVAL_MS       100             //Interval between background samples in window detect mode (ms).
+#define WINDOW_HYSTERESIS               8               //A channel outside its window is back inside when it is this far inside the threshold (ADC counts).
+#define WINDOW_CH0_LOWER                200             //Lower threshold of channel 0 (ADC counts, 10 bit, 1/3 input scaling).
+#define WINDOW_CH0_UPPER                800             //Upper threshold of channel 0.
+#define WINDOW_CH1_LOWER                200             //Lower threshold of channel 1.
+#define WINDOW_CH1_UPPER                800             //Upper threshold of channel 1.
+#define WINDOW_CH2_LOWER                200             //Lower threshold of channel 2.
+#define WINDOW_CH2_UPPER                800             //Upper threshold of channel 2.
+#define ENERGY_ACCOUNTING_ENABLED       0               //Set to 1 to estimate the average current consumption from the time spent in each activity.
+#define ENERGY_REPORT_INTERVAL_MS       10000           //Interval between energy reports on the log (ms).
+#define ENERGY_I_SLEEP_NA               3000            //System ON sleep current with RTC and LFCLK crystal running (nA). nRF51 datasheet typical values at 3 V.
+#define ENERGY_I_CPU_NA                 4400000         //CPU running from flash at 16 MHz (nA).
+#define ENERGY_I_HFXO_NA                470000          //HFCLK 16 MHz crystal oscillator running (nA).
+#define ENERGY_I_ADC_NA                 260000          //ADC converting (nA).
+#define ENERGY_I_UART_NA                230000          //UART transmitting (nA).
+#define ENERGY_CPU_WAKE_US              15              //CPU time of a wakeup too short to be measured with the RTC, e.g. a timer or ADC interrupt (us).
+#define ENERGY_ADC_CONVERSION_US        68              //Conversion time of a 10 bit ADC sample (us).
+#define LPCOMP_REFERENCE                NRF_LPCOMP_REF_SUPPLY_4_8  //LPCOMP reference for the wake on channel 0 (AIN2), as fraction of VDD. Should be close to one of the channel 0 thresholds.
+
+#if (WINDOW_LPCOMP_WAKE_ENABLED == 1) && (WINDOW_DETECT_ENABLED == 0)
+#error "WINDOW_LPCOMP_WAKE_ENABLED requires WINDOW_DETECT_ENABLED set to 1."
+#endif
+#if (WINDOW_LPCOMP_WAKE_ENABLED == 1) && (ENERGY_ACCOUNTING_ENABLED == 1)
+#error "ENERGY_ACCOUNTING_ENABLED measures time with the RTC1 of app_timer, which is stopped when WINDOW_LPCOMP_WAKE_ENABLED leaves no timer running."
+#endif
 
 #define APP_TIMER_PRESCALER             0                                           /**< Value of the RTC1 PRESCALER register. */
 #define APP_TIMER_OP_QUEUE_SIZE         4                                           /**< Size of timer operation queues. */
+#if (WINDOW_DETECT_ENABLED == 1)
+#define TIMER1_INTERVAL                 APP_TIMER_TICKS(WINDOW_DETECT_INTERVAL_MS, APP_TIMER_PRESCALER) /**< Defines the interval between consecutive app timer interrupts in milliseconds. */
+#else
 #define TIMER1_INTERVAL                 APP_TIMER_TICKS(10, APP_TIMER_PRESCALER)    /**< Defines the interval between consecutive app timer interrupts in milliseconds. */
+#endif
 
 static nrf_adc_value_t                  adc_buffer[ADC_BUFFER_SIZE];                /**< ADC buffer. */
-static uint8_t                          adc_event_counter = 0;
+static uint32_t                         adc_event_counter = 0;
 static uint8_t                          number_of_adc_channels;
+static nrf_drv_adc_channel_t            m_channel_0_config = NRF_DRV_ADC_DEFAULT_CHANNEL(NRF_ADC_CONFIG_INPUT_2); /**< Channel 0, also sampled on LPCOMP wake. */
+
+/**@brief Position of a sample relative to the window of its channel. */
+typedef enum
+{
+    WINDOW_INSIDE,                                                                  /**< Between the lower and the upper threshold. */
+    WINDOW_BELOW,                                                                   /**< Below the lower threshold. */
+    WINDOW_ABOVE                                                                    /**< Above the upper threshold. */
+} window_state_t;
+
+/**@brief Thresholds of a channel. */
+typedef struct
+{
+    nrf_adc_value_t lower;                                                          /**< Lower threshold. */
+    nrf_adc_value_t upper;                                                          /**< Upper threshold. */
+} window_t;
+
+static const window_t                   m_window[] =                                /**< Thresholds per ADC channel. */
+{
+    {WINDOW_CH0_LOWER, WINDOW_CH0_UPPER},
+    {WINDOW_CH1_LOWER, WINDOW_CH1_UPPER},
+    {WINDOW_CH2_LOWER, WINDOW_CH2_UPPER}
+};
+#define WINDOW_CHANNEL_COUNT            ARRAY_SIZE(m_window)
+
+static window_state_t                   m_window_state[WINDOW_CHANNEL_COUNT];       /**< Window state per channel, updated in the ADC interrupt handler. */
+static nrf_adc_value_t                  m_window_value[WINDOW_CHANNEL_COUNT];       /**< Sample that changed the window state, per channel. */
+static volatile uint8_t                 m_window_crossed_mask;                      /**< Channels that crossed a threshold since the main loop last looked. */
+
+#define ENERGY_TICKS_TO_US(TICKS)       (((uint64_t)(TICKS) * 1000000 * (APP_TIMER_PRESCALER + 1)) / 32768)  /**< Converts RTC1 ticks to microseconds. */
+#define ENERGY_REPORT_INTERVAL          APP_TIMER_TICKS(ENERGY_REPORT_INTERVAL_MS, APP_TIMER_PRESCALER)
+
+/**@brief Activity counters of one energy report interval. */
+typedef struct
+{
+    uint32_t window_start;                                                          /**< RTC1 counter at the start of the interval. */
+    uint32_t wakeups;                                                               /**< Number of wakeups from WFE. */
+    uint32_t cpu_awake_ticks;                                                       /**< RTC1 ticks from wakeup to the next WFE. */
+    uint32_t hfxo_ticks;                                                            /**< RTC1 ticks with HFCLK crystal requested. */
+    uint32_t adc_conversions;                                                       /**< Number of ADC conversions. */
+    uint32_t uart_ticks;                                                            /**< RTC1 ticks spent flushing the log to UART. */
+} energy_counters_t;
+
+static energy_counters_t                m_energy;                                   /**< Counters of the current report interval. Updated from interrupt and main context. */
+static uint32_t                         m_energy_hfxo_start;                        /**< RTC1 counter when HFCLK crystal was requested. */
+static bool                             m_energy_hfxo_running;                      /**< True while HFCLK crystal is requested. */
 
 APP_TIMER_DEF(m_timer1_id); 
 
+/**
+ * @brief Function for getting the window state of a sample.
+ * A channel outside its window stays outside until it is WINDOW_HYSTERESIS inside the threshold.
+ */
+static window_state_t window_state_get(uint8_t channel, nrf_adc_value_t value)
+{
+    window_state_t state = m_window_state[channel];
+
+    if (value > m_window[channel].upper)
+    {
+        return WINDOW_ABOVE;
+    }
+    if (value < m_window[channel].lower)
+    {
+        return WINDOW_BELOW;
+    }
+    if ((state == WINDOW_ABOVE) && (value > m_window[channel].upper - WINDOW_HYSTERESIS))
+    {
+        return WINDOW_ABOVE;
+    }
+    if ((state == WINDOW_BELOW) && (value < m_window[channel].lower + WINDOW_HYSTERESIS))
+    {
+        return WINDOW_BELOW;
+    }
+    return WINDOW_INSIDE;
+}
+
+/**
+ * @brief Function for evaluating samples against the channel windows in interrupt context.
+ * Only flags the channels that crossed a threshold, the main loop does the rest.
+ */
+static void window_detect(nrf_adc_value_t const * p_buffer, uint16_t size)
+{
+    for (uint32_t i = 0; i < size; i++)
+    {
+        uint8_t        channel = i % number_of_adc_channels;
+        window_state_t state   = window_state_get(channel, p_buffer[i]);
+
+        if (state != m_window_state[channel])
+        {
+            m_window_state[channel] = state;
+            m_window_value[channel] = p_buffer[i];
+            m_window_crossed_mask  |= (1 << channel);
+        }
+    }
+}
+
+/**
+ * @brief Function for processing threshold crossings in the main loop.
+ */
+static void window_crossing_process(void)
+{
+    static const char * const log_formats[] =                        //Indexed by window_state_t
+    {
+        "ADC channel %d inside window: %d\r\n",
+        "ADC channel %d below window: %d\r\n",
+        "ADC channel %d above window: %d\r\n"
+    };
+    uint8_t                   crossed_mask;
+    bool                      outside = false;
+    window_state_t            state[WINDOW_CHANNEL_COUNT];
+    nrf_adc_value_t           value[WINDOW_CHANNEL_COUNT];
+
+    if (m_window_crossed_mask == 0)
+    {
+        return;
+    }
+
+    CRITICAL_REGION_ENTER();
+    crossed_mask          = m_window_crossed_mask;
+    m_window_crossed_mask = 0;
+    memcpy(state, m_window_state, sizeof(state));
+    memcpy(value, m_window_value, sizeof(value));
+    CRITICAL_REGION_EXIT();
+
+    for (uint32_t channel = 0; channel < WINDOW_CHANNEL_COUNT; channel++)
+    {
+        if (crossed_mask & (1 << channel))
+        {
+            if(NRF_LOGGING_ENABLED)
+            {
+                NRF_LOG_INFO(log_formats[state[channel]], channel, value[channel]);
+            }
+        }
+        if (state[channel] != WINDOW_INSIDE)
+        {
+            outside = true;
+        }
+    }
+
+    if (outside)
+    {
+        LEDS_ON(BSP_LED_2_MASK);
+    }
+    else
+    {
+        LEDS_OFF(BSP_LED_2_MASK);
+    }
+}
+
+/**
+ * @brief Function for adding the RTC1 ticks since a start value to an energy counter.
+ */
+static void energy_ticks_add(uint32_t * p_counter, uint32_t start)
+{
+    uint32_t now;
+    uint32_t ticks;
+
+    APP_ERROR_CHECK(app_timer_cnt_get(&now));
+    APP_ERROR_CHECK(app_timer_cnt_diff_compute(now, start, &ticks));
+    CRITICAL_REGION_ENTER();
+    *p_counter += ticks;
+    CRITICAL_REGION_EXIT();
+}
+
+/**
+ * @brief Function for recording that HFCLK crystal was requested or released.
+ */
+static void energy_hfxo_set(bool running)
+{
+    if(!ENERGY_ACCOUNTING_ENABLED || (running == m_energy_hfxo_running))
+    {
+        return;
+    }
+    if (running)
+    {
+        APP_ERROR_CHECK(app_timer_cnt_get(&m_energy_hfxo_start));
+    }
+    else
+    {
+        energy_ticks_add(&m_energy.hfxo_ticks, m_energy_hfxo_start);
+    }
+    m_energy_hfxo_running = running;
+}
+
+/**
+ * @brief Function for recording ADC conversions.
+ */
+static void energy_adc_conversions_add(uint32_t count)
+{
+    if(!ENERGY_ACCOUNTING_ENABLED)
+    {
+        return;
+    }
+    CRITICAL_REGION_ENTER();
+    m_energy.adc_conversions += count;
+    CRITICAL_REGION_EXIT();
+}
+
+/**
+ * @brief Function for logging the estimated average current of the report interval and starting a new interval.
+ *
+ * @details The charge of each activity is its time multiplied by its current from the ENERGY_I_*
+ *          table, on top of the sleep current for the whole interval. Wakeups shorter than one RTC
+ *          tick are counted with ENERGY_CPU_WAKE_US each. The UART time is the time spent in
+ *          NRF_LOG_FLUSH, which includes formatting the log on the CPU, so its charge is an estimate.
+ */
+static void energy_report(void)
+{
+    energy_counters_t counters;
+    uint32_t          now;
+    uint32_t          window_ticks;
+    uint64_t          window_us;
+    uint64_t          cpu_us;
+    uint64_t          hfxo_us;
+    uint64_t          adc_us;
+    uint64_t          uart_us;
+    uint64_t          charge;                                       //nA * us
+    uint32_t          average_na;
+
+    APP_ERROR_CHECK(app_timer_cnt_get(&now));
+    APP_ERROR_CHECK(app_timer_cnt_diff_compute(now, m_energy.window_start, &window_ticks));
+    if (window_ticks < ENERGY_REPORT_INTERVAL)
+    {
+        return;
+    }
+
+    CRITICAL_REGION_ENTER();
+    counters = m_energy;
+    memset(&m_energy, 0, sizeof(m_energy));
+    m_energy.window_start = now;
+    CRITICAL_REGION_EXIT();
+
+    window_us = ENERGY_TICKS_TO_US(window_ticks);
+    cpu_us    = ENERGY_TICKS_TO_US(counters.cpu_awake_ticks) + (uint64_t)counters.wakeups * ENERGY_CPU_WAKE_US;
+    hfxo_us   = ENERGY_TICKS_TO_US(counters.hfxo_ticks);
+    adc_us    = (uint64_t)counters.adc_conversions * ENERGY_ADC_CONVERSION_US;
+    uart_us   = ENERGY_TICKS_TO_US(counters.uart_ticks);
+
+    charge  = window_us * ENERGY_I_SLEEP_NA;
+    charge += cpu_us    * ENERGY_I_CPU_NA;
+    charge += hfxo_us   * ENERGY_I_HFXO_NA;
+    charge += adc_us    * ENERGY_I_ADC_NA;
+    charge += uart_us   * ENERGY_I_UART_NA;
+    average_na = (uint32_t)(charge / window_us);
+
+    if(NRF_LOGGING_ENABLED)
+    {
+        NRF_LOG_INFO("Energy: %d.%03d uA average over %d ms\r\n", average_na / 1000, average_na % 1000, (uint32_t)(window_us / 1000));
+        NRF_LOG_INFO("  cpu %d us (%d wakeups), hfxo %d us, adc %d us\r\n", (uint32_t)cpu_us, counters.wakeups, (uint32_t)hfxo_us, (uint32_t)adc_us);
+        NRF_LOG_INFO("  uart %d us\r\n", (uint32_t)uart_us);
+    }
+}
+
 /**
  * @brief ADC interrupt handler.
  */
@@ -58,14 +352,20 @@ static void adc_event_handler(nrf_drv_adc_evt_t const * p_event)
     if(HIGH_ACCURACY_ADC_ENABLE)
     {
         nrf_drv_clock_hfclk_release();
+        energy_hfxo_set(false);
     }
 	
     if (p_event->type == NRF_DRV_ADC_EVT_DONE)
     {
-        if(NRF_LOGGING_ENABLED)
+        energy_adc_conversions_add(p_event->data.done.size);
+        if(WINDOW_DETECT_ENABLED)
+        {
+            window_detect(p_event->data.done.p_buffer, p_event->data.done.size);
+        }
+        else if(NRF_LOGGING_ENABLED)
         {					
             uint32_t i;
-            NRF_LOG_INFO("  adc event counter: %d\r\n", adc_event_counter);
+            NRF_LOG_INFO("  adc event counter: %u\r\n", adc_event_counter);
             for (i = 0; i < p_event->data.done.size; i++)
             {
                 NRF_LOG_INFO("ADC value channel %d: %d\r\n", (i % number_of_adc_channels), p_event->data.done.p_buffer[i]);
@@ -91,7 +391,6 @@ static void adc_config(void)
     APP_ERROR_CHECK(ret_code);
 	
     //Configure and enable ADC channel 0
-    static nrf_drv_adc_channel_t m_channel_0_config = NRF_DRV_ADC_DEFAULT_CHANNEL(NRF_ADC_CONFIG_INPUT_2); 
     m_channel_0_config.config.config.input = NRF_ADC_CONFIG_SCALING_INPUT_ONE_THIRD;
     nrf_drv_adc_channel_enable(&m_channel_0_config);
 	
@@ -108,11 +407,49 @@ static void adc_config(void)
     number_of_adc_channels = 3;    //Set equal to the number of configured ADC channels, for the sake of UART output.
 }
 
+/**
+ * @brief LPCOMP event handler.
+ * Samples channel 0 when it crosses the LPCOMP reference. LPCOMP is stopped during the conversion.
+ */
+static void lpcomp_event_handler(nrf_lpcomp_event_t event)
+{
+    nrf_adc_value_t value;
+
+    if (event == NRF_LPCOMP_EVENT_CROSS)
+    {
+        LEDS_INVERT(BSP_LED_0_MASK);
+        nrf_drv_lpcomp_disable();
+        APP_ERROR_CHECK(nrf_drv_adc_sample_convert(&m_channel_0_config, &value));
+        nrf_drv_lpcomp_enable();
+        energy_adc_conversions_add(1);
+        window_detect(&value, 1);
+    }
+}
+
+/**
+ * @brief LPCOMP initialization.
+ * Wakes on both crossing directions of LPCOMP_REFERENCE on the channel 0 input (AIN2).
+ */
+static void lpcomp_init(void)
+{
+    uint32_t                err_code;
+    nrf_drv_lpcomp_config_t config = NRF_DRV_LPCOMP_DEFAULT_CONFIG;
+
+    config.hal.reference = LPCOMP_REFERENCE;
+    config.hal.detection = NRF_LPCOMP_DETECT_CROSS;
+    config.input         = NRF_LPCOMP_INPUT_2;
+    err_code = nrf_drv_lpcomp_init(&config, lpcomp_event_handler);
+    APP_ERROR_CHECK(err_code);
+
+    nrf_drv_lpcomp_enable();
+}
+
 static void timer1_handler(void * p_context)
 {
     LEDS_INVERT(BSP_LED_0_MASK);                               //Indicate execution of timer1 interrupt handler on LED1
     if(HIGH_ACCURACY_ADC_ENABLE)
     {
+        energy_hfxo_set(true);
         nrf_drv_clock_hfclk_request(NULL);
         while(!nrf_drv_clock_hfclk_is_running());
     }
@@ -164,7 +501,14 @@ int main(void)
     adc_config();
     clock_init();
     timers_init();
-    application_timers_start();
+    if(WINDOW_LPCOMP_WAKE_ENABLED)
+    {
+        lpcomp_init();
+    }
+    else
+    {
+        application_timers_start();
+    }
 	
     if(NRF_LOGGING_ENABLED)
     {
@@ -172,16 +516,50 @@ int main(void)
         NRF_LOG_INFO("    ADC example\r\n");
     }
 	
-    APP_ERROR_CHECK(nrf_drv_adc_buffer_convert(adc_buffer,ADC_BUFFER_SIZE));
+    if(!WINDOW_LPCOMP_WAKE_ENABLED)
+    {
+        APP_ERROR_CHECK(nrf_drv_adc_buffer_convert(adc_buffer,ADC_BUFFER_SIZE));
+    }
+	
+    if(ENERGY_ACCOUNTING_ENABLED)
+    {
+        APP_ERROR_CHECK(app_timer_cnt_get(&m_energy.window_start));
+    }
 	
     while (true)
     {
+        uint32_t wakeup_time = 0;
+        uint32_t flush_start = 0;
+
         __WFE();    
         __SEV();
         __WFE();
+        if(ENERGY_ACCOUNTING_ENABLED)
+        {
+            APP_ERROR_CHECK(app_timer_cnt_get(&wakeup_time));
+            m_energy.wakeups++;
+        }
+
+        window_crossing_process();
+        if(ENERGY_ACCOUNTING_ENABLED)
+        {
+            energy_report();
+        }
         if(NRF_LOGGING_ENABLED)
         {
+            if(ENERGY_ACCOUNTING_ENABLED)
+            {
+                APP_ERROR_CHECK(app_timer_cnt_get(&flush_start));
+            }
             NRF_LOG_FLUSH();
+            if(ENERGY_ACCOUNTING_ENABLED)
+            {
+                energy_ticks_add(&m_energy.uart_ticks, flush_start);
+            }
+        }
+        if(ENERGY_ACCOUNTING_ENABLED)
+        {
+            energy_ticks_add(&m_energy.cpu_awake_ticks, wakeup_time);
         }
     }
 }
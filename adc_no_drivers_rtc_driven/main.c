@@ -20,8 +20,57 @@
 #include "app_util_platform.h"
 
 #define LFCLK_FREQUENCY           (32768UL)                             /*!< LFCLK frequency in Hertz, constant */
-#define RTC_FREQUENCY             (8UL)                                 /*!< required RTC working clock RTC_FREQUENCY Hertz. Changable */
-#define COUNTER_PRESCALER         ((LFCLK_FREQUENCY/RTC_FREQUENCY) - 1) /* f = LFCLK/(prescaler + 1) */
+#define SAMPLE_RATE_MILLIHZ       (8000UL)                              /*!< Sample rate in millihertz. Any rate is possible, the sample clock spreads the rounding error over the periods. */
+#define SAMPLE_CLOCK_MAX_JITTER_NS (50000UL)                            /*!< Largest acceptable deviation of a sample from the ideal sample time. RTC0 (about 0.1 uA) is used if its 30.5 us step meets it, TIMER0 at 1 MHz (HFCLK running, about 0.5 mA) otherwise. */
+#define SAMPLE_CLOCK_REPORT_SAMPLES (64UL)                              /*!< Number of samples between two sample clock reports. */
+
+#if (SAMPLE_CLOCK_MAX_JITTER_NS >= (1000000000UL / LFCLK_FREQUENCY))
+#define SAMPLE_CLOCK_USE_TIMER    0
+#define SAMPLE_CLOCK_FREQUENCY    LFCLK_FREQUENCY                       /*!< RTC0 without prescaler. */
+#define SAMPLE_CLOCK_MASK         (0xFFFFFFUL)                          /*!< 24 bit RTC counter. */
+#else
+#define SAMPLE_CLOCK_USE_TIMER    1
+#define SAMPLE_CLOCK_FREQUENCY    (1000000UL)                           /*!< TIMER0 at 16 MHz / 2^4. */
+#define SAMPLE_CLOCK_MASK         (0xFFFFFFFFUL)                        /*!< 32 bit timer. */
+#endif
+#define SAMPLE_PERIOD_TICKS       ((uint32_t)((SAMPLE_CLOCK_FREQUENCY * 1000ULL) / SAMPLE_RATE_MILLIHZ))  /*!< Whole clock ticks per sample period. */
+#define SAMPLE_PERIOD_REMAINDER   ((uint32_t)((SAMPLE_CLOCK_FREQUENCY * 1000ULL) % SAMPLE_RATE_MILLIHZ))  /*!< Fraction of a tick per sample period, in 1/SAMPLE_RATE_MILLIHZ ticks. */
+#define SAMPLE_CLOCK_MIN_LEAD     (2UL)                                 /*!< A compare value must be at least 2 ticks ahead of the counter to generate an event. */
+
+STATIC_ASSERT(SAMPLE_PERIOD_TICKS > SAMPLE_CLOCK_MIN_LEAD);
+STATIC_ASSERT(SAMPLE_PERIOD_TICKS < SAMPLE_CLOCK_MASK);
+#define ADC_AUTO_RANGE_ENABLED    0                                     /*!< Set to 1 to select input scaling and resolution from the previous sample. Set to 0 for fixed 10 bit resolution without prescaling. */
+#define ADC_AUTO_RANGE_MAX_LSB_UV 4000                                  /*!< Largest acceptable step between ADC codes in microvolts. The lowest resolution below it is used, as it converts faster (8 bit 20 us, 9 bit 36 us, 10 bit 68 us). */
+
+/** ADC input ranges, from the smallest to the largest */
+typedef enum
+{
+    ADC_RANGE_1200MV,                                               /*!< No prescaling. */
+    ADC_RANGE_1800MV,                                               /*!< 2/3 prescaling. */
+    ADC_RANGE_3600MV,                                               /*!< 1/3 prescaling. */
+    ADC_RANGE_COUNT
+} adc_range_t;
+
+/** ADC sample together with the settings it was converted with */
+typedef struct
+{
+    uint16_t    value;                                              /*!< ADC code. */
+    adc_range_t range;                                              /*!< Input range. */
+    uint8_t     resolution;                                         /*!< Resolution in bits. */
+} adc_sample_t;
+
+static const uint32_t m_range_inpsel[ADC_RANGE_COUNT]       = {ADC_CONFIG_INPSEL_AnalogInputNoPrescaling, ADC_CONFIG_INPSEL_AnalogInputTwoThirdsPrescaling, ADC_CONFIG_INPSEL_AnalogInputOneThirdPrescaling};
+static const uint16_t m_range_millivolts[ADC_RANGE_COUNT]   = {1200, 1800, 3600};  /*!< Input voltage at the highest ADC code, with the 1.2 V bandgap reference. */
+static adc_range_t    m_range      = ADC_RANGE_1200MV;          /*!< Input range of the next conversion. */
+static uint8_t        m_resolution = 10;                        /*!< Resolution of the next conversion in bits. */
+
+static uint32_t       m_sample_clock_next;                      /*!< Compare value of the next sample, free running counter ticks. */
+static uint32_t       m_sample_clock_acc;                       /*!< Accumulated fraction of a tick, in 1/SAMPLE_RATE_MILLIHZ ticks. Always below one tick. */
+static uint64_t       m_sample_clock_elapsed;                   /*!< Ticks from the first to the next sample. */
+static uint32_t       m_sample_clock_count;                     /*!< Number of sample periods scheduled. */
+static uint32_t       m_sample_clock_missed;                    /*!< Number of samples skipped because the compare value was set too late. */
+static uint32_t       m_sample_clock_latency_max;               /*!< Longest time from a compare event to its interrupt handler (ticks). */
+static uint32_t       m_sample_clock_jitter_max;                /*!< Largest deviation of a sample from its ideal time (fraction of a tick, 1/SAMPLE_RATE_MILLIHZ ticks). */
 
 static void hfclk_config(void)
 {
@@ -44,19 +93,132 @@ static void lfclk_config(void)
     NRF_CLOCK->EVENTS_LFCLKSTARTED = 0;
 }
 
-/** Configure and start RTC
+/** Schedules the next sample
+ *
+ * The period is SAMPLE_PERIOD_TICKS, plus one tick whenever the accumulated fractions add up to a
+ * whole tick (Bresenham). Every sample is then within one tick of its ideal time, and the rate
+ * has no long-term error. The compare value is advanced instead of clearing the counter, so
+ * the interrupt latency does not add to the period.
+ */
+static void sample_clock_advance(void)
+{
+    uint32_t period = SAMPLE_PERIOD_TICKS;
+
+    m_sample_clock_acc += SAMPLE_PERIOD_REMAINDER;
+    if (m_sample_clock_acc >= SAMPLE_RATE_MILLIHZ)
+    {
+        m_sample_clock_acc -= SAMPLE_RATE_MILLIHZ;
+        period++;
+    }
+    m_sample_clock_next    += period;
+    m_sample_clock_elapsed += period;
+    m_sample_clock_count++;
+    if (m_sample_clock_acc > m_sample_clock_jitter_max)
+    {
+        m_sample_clock_jitter_max = m_sample_clock_acc;
+    }
+}
+
+/** Logs the achieved rate error and jitter of the sample clock
+ *
+ * The rate error is the difference between the elapsed ticks and the ideal time of the scheduled
+ * samples, next to the error of a period rounded to whole ticks. The accuracy of the clock source
+ * itself, 20 ppm for the LFCLK crystal, comes on top.
+ */
+static void sample_clock_report(void)
+{
+    int64_t  ideal        = (int64_t)m_sample_clock_count * SAMPLE_CLOCK_FREQUENCY * 1000;
+    int64_t  error        = (int64_t)m_sample_clock_elapsed * SAMPLE_RATE_MILLIHZ - ideal;
+    int64_t  rounded      = (int64_t)ROUNDED_DIV(SAMPLE_CLOCK_FREQUENCY * 1000ULL, SAMPLE_RATE_MILLIHZ) * SAMPLE_RATE_MILLIHZ - SAMPLE_CLOCK_FREQUENCY * 1000LL;
+    int32_t  error_ppb    = (int32_t)((error * 1000000000) / ideal);
+    int32_t  rounded_ppb  = (int32_t)((rounded * 1000000000) / (SAMPLE_CLOCK_FREQUENCY * 1000LL));
+    uint32_t jitter_ns    = (uint32_t)(((uint64_t)m_sample_clock_jitter_max * 1000000000) / ((uint64_t)SAMPLE_CLOCK_FREQUENCY * SAMPLE_RATE_MILLIHZ));
+    uint32_t latency_ns   = (uint32_t)(((uint64_t)m_sample_clock_latency_max * 1000000000) / SAMPLE_CLOCK_FREQUENCY);
+
+    NRF_LOG_INFO("sample clock: %d samples, rate error %d ppb (rounded period: %d ppb)\r\n", m_sample_clock_count, error_ppb, rounded_ppb);
+    NRF_LOG_INFO("sample clock: jitter %d ns max, interrupt latency %d ns max, %d missed\r\n", jitter_ns, latency_ns, m_sample_clock_missed);
+}
+
+/** Handles a sample clock compare event and sets the compare value of the next sample
+ *
+ * @param[in] now  Counter value read in the interrupt handler.
+ */
+static uint32_t sample_clock_compare_handle(uint32_t now)
+{
+    uint32_t latency = (now - m_sample_clock_next) & SAMPLE_CLOCK_MASK;
+
+    if (latency > m_sample_clock_latency_max)
+    {
+        m_sample_clock_latency_max = latency;
+    }
+
+    sample_clock_advance();
+    while (((m_sample_clock_next - now) & SAMPLE_CLOCK_MASK) < SAMPLE_CLOCK_MIN_LEAD ||
+           ((m_sample_clock_next - now) & SAMPLE_CLOCK_MASK) > SAMPLE_PERIOD_TICKS + 1)
+    {
+        sample_clock_advance();                                 //Too late for this sample, skip it and keep the grid
+        m_sample_clock_missed++;
+    }
+
+    if ((m_sample_clock_count % SAMPLE_CLOCK_REPORT_SAMPLES) == 0)
+    {
+        sample_clock_report();
+    }
+    return m_sample_clock_next & SAMPLE_CLOCK_MASK;
+}
+
+#if (SAMPLE_CLOCK_USE_TIMER == 1)
+/** Configure and start TIMER0 as sample clock, for sample times more precise than the RTC step
  */
-static void rtc_config(void)
+static void sample_clock_config(void)
+{
+    NRF_TIMER0->MODE      = TIMER_MODE_MODE_Timer;
+    NRF_TIMER0->BITMODE   = TIMER_BITMODE_BITMODE_32Bit;
+    NRF_TIMER0->PRESCALER = 4;                                 // 16 MHz / 2^4 = SAMPLE_CLOCK_FREQUENCY
+    sample_clock_advance();
+    NRF_TIMER0->CC[0]     = m_sample_clock_next;
+    NRF_TIMER0->INTENSET  = TIMER_INTENSET_COMPARE0_Msk;
+    NVIC_EnableIRQ(TIMER0_IRQn);
+    NRF_TIMER0->TASKS_START = 1;
+}
+
+/* Interrupt handler for the sample clock compare event, the ADC is started through PPI */
+void TIMER0_IRQHandler(void)
 {
-    NRF_RTC0->PRESCALER = COUNTER_PRESCALER;                   // Set prescaler to a TICK of RTC_FREQUENCY
-    NRF_RTC0->EVTENSET = RTC_EVTENSET_TICK_Msk;                // Enable TICK event	
+    NRF_TIMER0->EVENTS_COMPARE[0] = 0;
+    NRF_TIMER0->TASKS_CAPTURE[1]  = 1;
+    NRF_TIMER0->CC[0]             = sample_clock_compare_handle(NRF_TIMER0->CC[1]);
+}
+#else
+/** Configure and start RTC0 as sample clock
+ */
+static void sample_clock_config(void)
+{
+    NRF_RTC0->PRESCALER   = 0;                                 // Count at LFCLK_FREQUENCY, the period is set by the compare value
+    sample_clock_advance();
+    NRF_RTC0->CC[0]       = m_sample_clock_next & SAMPLE_CLOCK_MASK;
+    NRF_RTC0->EVTENSET    = RTC_EVTENSET_COMPARE0_Msk;         // Enable COMPARE0 event for PPI
+    NRF_RTC0->INTENSET    = RTC_INTENSET_COMPARE0_Msk;         // and interrupt, to set the next compare value
+    NVIC_EnableIRQ(RTC0_IRQn);
     NRF_RTC0->TASKS_START = 1;                                 // Start RTC0
 }
 
+/* Interrupt handler for the sample clock compare event, the ADC is started through PPI */
+void RTC0_IRQHandler(void)
+{
+    NRF_RTC0->EVENTS_COMPARE[0] = 0;
+    NRF_RTC0->CC[0]             = sample_clock_compare_handle(NRF_RTC0->COUNTER);
+}
+#endif
+
 static void ppi_init(void)
 {
-    // Configure PPI channel 0 to start ADC task
-    NRF_PPI->CH[0].EEP = (uint32_t)&NRF_RTC0->EVENTS_TICK;
+    // Configure PPI channel 0 to start ADC task on the sample clock compare event
+#if (SAMPLE_CLOCK_USE_TIMER == 1)
+    NRF_PPI->CH[0].EEP = (uint32_t)&NRF_TIMER0->EVENTS_COMPARE[0];
+#else
+    NRF_PPI->CH[0].EEP = (uint32_t)&NRF_RTC0->EVENTS_COMPARE[0];
+#endif
     NRF_PPI->CH[0].TEP = (uint32_t)&NRF_ADC->TASKS_START;
 
     // Enable PPI channel 0
@@ -75,21 +237,74 @@ void ADC_init(void)
 	NRF_ADC->CONFIG	= (ADC_CONFIG_EXTREFSEL_None << ADC_CONFIG_EXTREFSEL_Pos) 								    /* Bits 17..16 : ADC external reference pin selection. */
 										| (ADC_CONFIG_PSEL_AnalogInput6 << ADC_CONFIG_PSEL_Pos)					/*!< Use analog input 6 as analog input (P0.05). */
 										| (ADC_CONFIG_REFSEL_VBG << ADC_CONFIG_REFSEL_Pos)						/*!< Use internal 1.2V bandgap voltage as reference for conversion. */
-										| (ADC_CONFIG_INPSEL_AnalogInputNoPrescaling << ADC_CONFIG_INPSEL_Pos) 	/*!< Analog input specified by PSEL with no prescaling used as input for the conversion. */
-										| (ADC_CONFIG_RES_10bit << ADC_CONFIG_RES_Pos);							/*!< 10bit ADC resolution. */ 	
+										| (m_range_inpsel[m_range] << ADC_CONFIG_INPSEL_Pos) 					/*!< Analog input specified by PSEL with the prescaling of the input range used as input for the conversion. */
+										| ((m_resolution - 8) << ADC_CONFIG_RES_Pos);							/*!< ADC resolution, 10bit at start. */ 	
 	
 	/* Enable ADC*/
 	NRF_ADC->ENABLE = ADC_ENABLE_ENABLE_Enabled;	
 }
 
+/** Converts a sample into millivolts, using the settings it was converted with
+ */
+static uint32_t adc_sample_millivolts(adc_sample_t const * p_sample)
+{
+    return ((uint32_t)p_sample->value * m_range_millivolts[p_sample->range]) / ((1UL << p_sample->resolution) - 1);
+}
+
+/** Selects the input range and resolution of the next conversion from a sample
+ *
+ * The smallest input range where the sample is below 3/4 of full scale is used, and a range up as
+ * soon as the sample is above 15/16 of full scale. The resolution is the lowest with an ADC step of
+ * at most ADC_AUTO_RANGE_MAX_LSB_UV in that range.
+ */
+static void adc_auto_range_update(adc_sample_t const * p_sample)
+{
+    uint32_t    millivolts = adc_sample_millivolts(p_sample);
+    adc_range_t range      = p_sample->range;
+
+    if ((p_sample->value >= (((1UL << p_sample->resolution) - 1) * 15) / 16) && (range < ADC_RANGE_COUNT - 1))
+    {
+        range++;                                                    //Close to saturation, the voltage may be higher than measured
+    }
+    else
+    {
+        while ((range > ADC_RANGE_1200MV) && (millivolts < (m_range_millivolts[range - 1] * 3UL) / 4))
+        {
+            range--;
+        }
+    }
+
+    m_range      = range;
+    m_resolution = 8;
+    while ((m_resolution < 10) && ((m_range_millivolts[range] * 1000UL) / ((1UL << m_resolution) - 1) > ADC_AUTO_RANGE_MAX_LSB_UV))
+    {
+        m_resolution++;
+    }
+
+    //The ADC is idle until the next sample clock event, so the configuration can be changed here
+    NRF_ADC->CONFIG = (NRF_ADC->CONFIG & ~(ADC_CONFIG_INPSEL_Msk | ADC_CONFIG_RES_Msk))
+                    | (m_range_inpsel[m_range] << ADC_CONFIG_INPSEL_Pos)
+                    | ((m_resolution - 8) << ADC_CONFIG_RES_Pos);
+}
+
 /* Interrupt handler for ADC data ready event. It will be executed when ADC sampling is complete */
 void ADC_IRQHandler(void)
 {
+    adc_sample_t sample;
+
 	/* Clear dataready event */
     NRF_ADC->EVENTS_END = 0;	
 
+    sample.value      = NRF_ADC->RESULT;
+    sample.range      = m_range;
+    sample.resolution = m_resolution;
+    if(ADC_AUTO_RANGE_ENABLED)
+    {
+        adc_auto_range_update(&sample);
+    }
+
 	//Print ADC result on UART
-	NRF_LOG_INFO("sample result: %X\r\n", NRF_ADC->RESULT);
+	NRF_LOG_INFO("sample result: %X, %d mV (%d mV range, %d bit)\r\n", sample.value, adc_sample_millivolts(&sample), m_range_millivolts[sample.range], sample.resolution);
 }
 
 
@@ -103,8 +318,8 @@ int main(void)
 	
 	hfclk_config();                         //Enable 16MHz crystal for maximum ADC accuracy. Comment out this line to use internal 16MHz RC instead, which saves power.
 	lfclk_config();			                //Configure 32kHz clock, required by the RTC timer
-    rtc_config();				            //Configure RTC timer
-	ppi_init();					            //Configure PPI channel, which connects RTC TICK event and ADC START task
+    sample_clock_config();		            //Configure the sample clock, RTC0 or TIMER0
+	ppi_init();					            //Configure PPI channel, which connects the sample clock compare event and ADC START task
 	ADC_init();					            //Configure the ADC
 	
     while (true)
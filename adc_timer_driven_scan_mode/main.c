@@ -38,12 +38,266 @@
 
 #define ADC_BUFFER_SIZE 6       //Size of buffer for ADC samples. Buffer size should be multiple of number of adc channels located.
 #define ADC_SAMPLE_RATE	1000     //Sets the sampling rate in ms
+#define ADC_AUTO_RANGE_ENABLED      0       //Set to 1 to select input scaling and resolution per channel from the previous buffer. Set to 0 for fixed 10 bit resolution with 1/3 prescaling.
+#define ADC_AUTO_RANGE_MAX_LSB_UV   4000    //Largest acceptable step between ADC codes in microvolts. The lowest resolution below it is used, as it converts faster (8 bit 20 us, 9 bit 36 us, 10 bit 68 us).
+#define ADC_CHANNEL_COUNT           3       //Number of configured ADC channels.
+#define ADC_SKEW_COMPENSATION_ENABLED 0     //Set to 1 to align the channels of each scan to the conversion time of channel 0, by linear interpolation with the previous scan of the channel.
+#define ADC_SCAN_CHANNEL_GAP_US     6       //Time from the end of a conversion to the start of the next channel in a scan. The driver starts the next channel from its ADC interrupt handler.
+#define ADC_SKEW_WEIGHT_BITS        30      //Fraction bits of the interpolation weights.
+#define LEVEL_CROSSING_ENABLED      0       //Set to 1 to encode each channel as events when it crosses one of m_level_crossing_levels_mv, instead of logging every sample.
+#define LEVEL_CROSSING_LEVEL_COUNT  37      //Number of levels in m_level_crossing_levels_mv, at most 64.
+#define LEVEL_CROSSING_HYSTERESIS_MV 10     //Distance beyond a level before it counts as crossed, so that noise around a level gives no events.
+#define LEVEL_CROSSING_EVENT_BYTES  3       //Size of an encoded event: channel and level index in one byte, then the number of scans since the previous event of the channel in two bytes.
+#define LEVEL_CROSSING_MAX_DELTA    0xFFFF  //Longest time in scans between two events of a channel. The level is repeated when it is reached.
+#define LEVEL_CROSSING_REPORT_SCANS 60      //Number of scans between two logs of the amount of encoded data.
+#define ADC_STREAM_SAMPLE_BYTES     2       //Size of a sample streamed at a fixed rate, for comparison with the level crossing events.
+
+#if (LEVEL_CROSSING_LEVEL_COUNT > 64)
+#error "The level index of a level crossing event has 6 bits."
+#endif
+
+/** ADC input ranges, from the smallest to the largest */
+typedef enum
+{
+    ADC_RANGE_1200MV,                                       /**< No prescaling. */
+    ADC_RANGE_1800MV,                                       /**< 2/3 prescaling. */
+    ADC_RANGE_3600MV,                                       /**< 1/3 prescaling. */
+    ADC_RANGE_COUNT
+} adc_range_t;
+
+/** ADC sample together with the settings it was converted with */
+typedef struct
+{
+    nrf_adc_value_t value;                                  /**< ADC code. */
+    adc_range_t     range;                                  /**< Input range. */
+    uint8_t         resolution;                             /**< Resolution in bits. */
+} adc_sample_t;
+
+static const nrf_adc_config_scaling_t m_range_scaling[ADC_RANGE_COUNT] = {NRF_ADC_CONFIG_SCALING_INPUT_FULL_SCALE, NRF_ADC_CONFIG_SCALING_INPUT_TWO_THIRDS, NRF_ADC_CONFIG_SCALING_INPUT_ONE_THIRD};
+static const uint16_t                 m_range_millivolts[ADC_RANGE_COUNT] = {1200, 1800, 3600};  /**< Input voltage at the highest ADC code, with the 1.2 V bandgap reference. */
 
 static nrf_adc_value_t          adc_buffer[ADC_BUFFER_SIZE]; /**< ADC buffer. */
 static nrf_ppi_channel_t        m_ppi_channel;
 static const nrf_drv_timer_t    m_timer = NRF_DRV_TIMER_INSTANCE(2);
-static uint8_t                  adc_event_counter = 0;
+static uint32_t                 adc_event_counter = 0;
+static volatile uint32_t        m_adc_scans_triggered;                       /**< Number of sampling timer events, each starts a scan through PPI. */
+static uint32_t                 m_adc_scan_next;                             /**< Sequence number expected for the first scan of the next buffer. */
+static uint32_t                 m_adc_scans_lost;                            /**< Number of scans missing in the sequence, e.g. triggered before the buffer was set up again. */
 static uint8_t                  number_of_adc_channels;
+static nrf_drv_adc_channel_t    m_channel_config[ADC_CHANNEL_COUNT] =        /**< ADC channels, sampled on AIN2, AIN6 and AIN7. */
+{
+    NRF_DRV_ADC_DEFAULT_CHANNEL(NRF_ADC_CONFIG_INPUT_2),
+    NRF_DRV_ADC_DEFAULT_CHANNEL(NRF_ADC_CONFIG_INPUT_6),
+    NRF_DRV_ADC_DEFAULT_CHANNEL(NRF_ADC_CONFIG_INPUT_7)
+};
+static adc_range_t              m_channel_range[ADC_CHANNEL_COUNT];          /**< Input range of each channel in the buffer being filled. */
+static uint8_t                  m_channel_resolution[ADC_CHANNEL_COUNT];     /**< Resolution of each channel in the buffer being filled. */
+#if (ADC_SKEW_COMPENSATION_ENABLED == 1)
+static const uint8_t            m_conversion_us[3] = {20, 36, 68};           /**< Conversion time at 8, 9 and 10 bit resolution. */
+static int32_t                  m_skew_previous_uv[ADC_CHANNEL_COUNT];       /**< Previous sample of each channel in microvolts. */
+static bool                     m_skew_previous_valid;                       /**< True when m_skew_previous_uv holds a complete scan. */
+#endif
+#if (LEVEL_CROSSING_ENABLED == 1)
+static const int16_t            m_level_crossing_levels_mv[LEVEL_CROSSING_LEVEL_COUNT] =   /**< Levels in ascending order. Voltages below the first or above the last level are encoded as that level. */
+{
+       0,  100,  200,  300,  400,  500,  600,  700,  800,  900, 1000, 1100, 1200,
+    1300, 1400, 1500, 1600, 1700, 1800, 1900, 2000, 2100, 2200, 2300, 2400, 2500,
+    2600, 2700, 2800, 2900, 3000, 3100, 3200, 3300, 3400, 3500, 3600
+};
+static bool                     m_level_crossing_valid[ADC_CHANNEL_COUNT];   /**< True when the channel has sent its first event. */
+static uint8_t                  m_level_crossing_level[ADC_CHANNEL_COUNT];   /**< Index of the last level sent for each channel. */
+static uint32_t                 m_level_crossing_last_scan[ADC_CHANNEL_COUNT]; /**< Scan of the last event of each channel. */
+static uint32_t                 m_level_crossing_scan;                       /**< Number of scans since start. */
+static uint32_t                 m_level_crossing_events;                     /**< Number of events since start. */
+#endif
+
+/**
+ * @brief Function for converting a sample into millivolts, using the settings it was converted with.
+ */
+static uint32_t adc_sample_millivolts(adc_sample_t const * p_sample)
+{
+    return ((uint32_t)p_sample->value * m_range_millivolts[p_sample->range]) / ((1UL << p_sample->resolution) - 1);
+}
+
+#if (ADC_SKEW_COMPENSATION_ENABLED == 1)
+/**
+ * @brief Function for converting a sample into microvolts, using the settings it was converted with.
+ */
+static int32_t adc_sample_microvolts(adc_sample_t const * p_sample)
+{
+    return (int32_t)(((uint32_t)p_sample->value * m_range_millivolts[p_sample->range] * 1000UL) / ((1UL << p_sample->resolution) - 1));
+}
+
+/**
+ * @brief Function for calculating the interpolation weight of each channel from the conversion schedule.
+ * Channels are converted one after another, so channel k is sampled the conversion times of channels
+ * 0 to k-1, plus ADC_SCAN_CHANNEL_GAP_US each, after channel 0. The weight is that delay as a fraction
+ * of the sampling period, with ADC_SKEW_WEIGHT_BITS fraction bits.
+ */
+static void adc_skew_weights_get(uint32_t * p_weights)
+{
+    uint32_t offset_us = 0;
+
+    for (uint8_t channel = 0; channel < ADC_CHANNEL_COUNT; channel++)
+    {
+        p_weights[channel] = (uint32_t)(((uint64_t)offset_us << ADC_SKEW_WEIGHT_BITS) / (ADC_SAMPLE_RATE * 1000UL));
+        offset_us += m_conversion_us[m_channel_resolution[channel] - 8] + ADC_SCAN_CHANNEL_GAP_US;
+    }
+}
+
+/**
+ * @brief Function for aligning a sample to the conversion time of channel 0 in its scan.
+ * The channel is interpolated linearly between its previous sample, one sampling period earlier, and
+ * this sample. Until a complete scan has been stored, the sample is returned unchanged.
+ */
+static int32_t adc_skew_align(uint8_t channel, int32_t microvolts, uint32_t weight)
+{
+    int32_t aligned = microvolts;
+
+    if (m_skew_previous_valid)
+    {
+        int64_t step = (int64_t)(microvolts - m_skew_previous_uv[channel]) * weight;
+        aligned -= (int32_t)((step + (1LL << (ADC_SKEW_WEIGHT_BITS - 1))) >> ADC_SKEW_WEIGHT_BITS);
+    }
+    m_skew_previous_uv[channel] = microvolts;
+    if (channel == ADC_CHANNEL_COUNT - 1)
+    {
+        m_skew_previous_valid = true;
+    }
+    return aligned;
+}
+#endif
+
+#if (LEVEL_CROSSING_ENABLED == 1)
+/**
+ * @brief Function for finding the highest level at or below a voltage, the first level if there is none.
+ */
+static uint8_t level_crossing_index_get(int32_t millivolts)
+{
+    uint8_t index = 0;
+
+    while ((index < LEVEL_CROSSING_LEVEL_COUNT - 1) && (millivolts >= m_level_crossing_levels_mv[index + 1]))
+    {
+        index++;
+    }
+    return index;
+}
+
+/**
+ * @brief Function for encoding a level crossing event and logging it.
+ * The event is the channel in the top 2 bits and the level index in the low 6 bits of the first byte,
+ * then the number of scans since the previous event of the channel, most significant byte first.
+ */
+static void level_crossing_event(uint8_t channel, uint8_t level)
+{
+    uint32_t delta = m_level_crossing_scan - m_level_crossing_last_scan[channel];
+    uint8_t  event[LEVEL_CROSSING_EVENT_BYTES] = {(uint8_t)((channel << 6) | level), (uint8_t)(delta >> 8), (uint8_t)delta};
+
+    m_level_crossing_level[channel]     = level;
+    m_level_crossing_last_scan[channel] = m_level_crossing_scan;
+    m_level_crossing_events++;
+    NRF_LOG_INFO("Level crossing 0x%02x%02x%02x: channel %d, level %d mV\r\n", event[0], event[1], event[2], channel, m_level_crossing_levels_mv[level]);
+}
+
+/**
+ * @brief Function for getting the largest error of the level crossing reconstruction.
+ * The host holds each channel at the middle between its last level and the next one. The encoder sends
+ * an event as soon as the voltage is more than LEVEL_CROSSING_HYSTERESIS_MV outside of these two
+ * levels, so between the first and last level, the error is at most half of the largest level spacing
+ * plus the hysteresis.
+ */
+static uint32_t level_crossing_error_bound_get(void)
+{
+    uint32_t spacing = 0;
+
+    for (uint8_t i = 1; i < LEVEL_CROSSING_LEVEL_COUNT; i++)
+    {
+        spacing = MAX(spacing, (uint32_t)(m_level_crossing_levels_mv[i] - m_level_crossing_levels_mv[i - 1]));
+    }
+    return (spacing + 1) / 2 + LEVEL_CROSSING_HYSTERESIS_MV;
+}
+
+/**
+ * @brief Function for feeding a sample of a channel to the level crossing encoder.
+ * An event is sent when the voltage is LEVEL_CROSSING_HYSTERESIS_MV above the next level up or below
+ * the last level sent, with the highest level crossed by that margin. The level is repeated when a
+ * channel had no event for LEVEL_CROSSING_MAX_DELTA scans, which keeps the delta within 16 bits.
+ */
+static void level_crossing_update(uint8_t channel, int32_t millivolts)
+{
+    uint8_t level = m_level_crossing_level[channel];
+
+    if (!m_level_crossing_valid[channel])
+    {
+        m_level_crossing_valid[channel] = true;
+        level_crossing_event(channel, level_crossing_index_get(millivolts));
+    }
+    else if ((level < LEVEL_CROSSING_LEVEL_COUNT - 1) && (millivolts >= m_level_crossing_levels_mv[level + 1] + LEVEL_CROSSING_HYSTERESIS_MV))
+    {
+        level_crossing_event(channel, level_crossing_index_get(millivolts - LEVEL_CROSSING_HYSTERESIS_MV));
+    }
+    else if ((level > 0) && (millivolts < m_level_crossing_levels_mv[level] - LEVEL_CROSSING_HYSTERESIS_MV))
+    {
+        level_crossing_event(channel, level_crossing_index_get(millivolts + LEVEL_CROSSING_HYSTERESIS_MV));
+    }
+    else if (m_level_crossing_scan - m_level_crossing_last_scan[channel] >= LEVEL_CROSSING_MAX_DELTA)
+    {
+        level_crossing_event(channel, level);
+    }
+
+    if (channel == ADC_CHANNEL_COUNT - 1)
+    {
+        m_level_crossing_scan++;
+        if ((m_level_crossing_scan % LEVEL_CROSSING_REPORT_SCANS) == 0)
+        {
+            NRF_LOG_INFO("Level crossing: %d events in %d scans, %d bytes, %d bytes at a fixed rate\r\n", m_level_crossing_events, m_level_crossing_scan,
+                         m_level_crossing_events * LEVEL_CROSSING_EVENT_BYTES, m_level_crossing_scan * ADC_CHANNEL_COUNT * ADC_STREAM_SAMPLE_BYTES);
+        }
+    }
+}
+#endif
+
+/**
+ * @brief Function for setting the input range and resolution of a channel.
+ */
+static void adc_channel_range_set(uint8_t channel, adc_range_t range, uint8_t resolution)
+{
+    m_channel_range[channel]      = range;
+    m_channel_resolution[channel] = resolution;
+    m_channel_config[channel].config.config.input      = m_range_scaling[range];
+    m_channel_config[channel].config.config.resolution = (nrf_adc_config_resolution_t)(NRF_ADC_CONFIG_RES_8BIT + resolution - 8);
+}
+
+/**
+ * @brief Function for selecting the input range and resolution of a channel from its last sample.
+ * The smallest input range where the sample is below 3/4 of full scale is used, and a range up as
+ * soon as the sample is above 15/16 of full scale. The resolution is the lowest with an ADC step of
+ * at most ADC_AUTO_RANGE_MAX_LSB_UV in that range.
+ */
+static void adc_auto_range_update(uint8_t channel, adc_sample_t const * p_sample)
+{
+    uint32_t    millivolts = adc_sample_millivolts(p_sample);
+    adc_range_t range      = p_sample->range;
+    uint8_t     resolution = 8;
+
+    if ((p_sample->value >= (((1UL << p_sample->resolution) - 1) * 15) / 16) && (range < ADC_RANGE_COUNT - 1))
+    {
+        range++;                                            //Close to saturation, the voltage may be higher than measured
+    }
+    else
+    {
+        while ((range > ADC_RANGE_1200MV) && (millivolts < (m_range_millivolts[range - 1] * 3UL) / 4))
+        {
+            range--;
+        }
+    }
+
+    while ((resolution < 10) && ((m_range_millivolts[range] * 1000UL) / ((1UL << resolution) - 1) > ADC_AUTO_RANGE_MAX_LSB_UV))
+    {
+        resolution++;
+    }
+    adc_channel_range_set(channel, range, resolution);
+}
 
 /**
  * @brief ADC interrupt handler.
@@ -52,11 +306,50 @@ static void adc_event_handler(nrf_drv_adc_evt_t const * p_event)
 {
     if (p_event->type == NRF_DRV_ADC_EVT_DONE)
     {
-        uint32_t i;
-        NRF_LOG_INFO("  adc event counter: %d\r\n", adc_event_counter);
+        uint32_t     i;
+        adc_sample_t sample;
+        uint32_t     seq = m_adc_scans_triggered - p_event->data.done.size / number_of_adc_channels;  //First scan of the buffer, scans are numbered by trigger
+#if (ADC_SKEW_COMPENSATION_ENABLED == 1)
+        uint32_t     skew_weights[ADC_CHANNEL_COUNT];
+
+        adc_skew_weights_get(skew_weights);                 //From the settings this buffer was converted with
+#endif
+        if (seq > m_adc_scan_next)
+        {
+            NRF_LOG_INFO("Gap: scans %u to %u not captured\r\n", m_adc_scan_next, seq - 1);
+            m_adc_scans_lost += seq - m_adc_scan_next;
+        }
+        else if (seq < m_adc_scan_next)
+        {
+            NRF_LOG_INFO("Scan %u out of order, expected %u\r\n", seq, m_adc_scan_next);
+        }
+        m_adc_scan_next = seq + p_event->data.done.size / number_of_adc_channels;
+        NRF_LOG_INFO("  adc event counter: %u, scans %u to %u, %u lost\r\n", adc_event_counter, seq, m_adc_scan_next - 1, m_adc_scans_lost);
         for (i = 0; i < p_event->data.done.size; i++)
         {
-            NRF_LOG_INFO("ADC value channel %d: %d\r\n", (i % number_of_adc_channels), p_event->data.done.p_buffer[i]);
+            uint8_t channel   = i % number_of_adc_channels;
+            sample.value      = p_event->data.done.p_buffer[i];
+            sample.range      = m_channel_range[channel];
+            sample.resolution = m_channel_resolution[channel];
+#if (ADC_SKEW_COMPENSATION_ENABLED == 1)
+            int32_t aligned_uv = adc_skew_align(channel, adc_sample_microvolts(&sample), skew_weights[channel]);
+#endif
+#if (LEVEL_CROSSING_ENABLED == 1)
+#if (ADC_SKEW_COMPENSATION_ENABLED == 1)
+            level_crossing_update(channel, aligned_uv / 1000);
+#else
+            level_crossing_update(channel, (int32_t)adc_sample_millivolts(&sample));
+#endif
+#else
+            NRF_LOG_INFO("ADC value channel %d: %d, %d mV\r\n", channel, sample.value, adc_sample_millivolts(&sample));
+#if (ADC_SKEW_COMPENSATION_ENABLED == 1)
+            NRF_LOG_INFO("  aligned to channel 0: %d uV\r\n", aligned_uv);
+#endif
+#endif
+            if(ADC_AUTO_RANGE_ENABLED && (i >= p_event->data.done.size - number_of_adc_channels))
+            {
+                adc_auto_range_update(channel, &sample);    //Settings for the next buffer, from the last sample of each channel
+            }
         }
     adc_event_counter++;
     }
@@ -67,6 +360,7 @@ static void adc_event_handler(nrf_drv_adc_evt_t const * p_event)
 
 void timer_handler(nrf_timer_event_t event_type, void* p_context)
 {
+    m_adc_scans_triggered++;
 }
 
 /**
@@ -81,22 +375,14 @@ static void adc_config(void)
     ret_code = nrf_drv_adc_init(&config, adc_event_handler);
     APP_ERROR_CHECK(ret_code);
 	
-    //Configure and enable ADC channel 0
-    static nrf_drv_adc_channel_t m_channel_0_config = NRF_DRV_ADC_DEFAULT_CHANNEL(NRF_ADC_CONFIG_INPUT_2); 
-    m_channel_0_config.config.config.input = NRF_ADC_CONFIG_SCALING_INPUT_ONE_THIRD;
-    nrf_drv_adc_channel_enable(&m_channel_0_config);
-	
-    //Configure and enable ADC channel 1
-    static nrf_drv_adc_channel_t m_channel_1_config = NRF_DRV_ADC_DEFAULT_CHANNEL(NRF_ADC_CONFIG_INPUT_6); 
-    m_channel_1_config.config.config.input = NRF_ADC_CONFIG_SCALING_INPUT_ONE_THIRD;
-    nrf_drv_adc_channel_enable(&m_channel_1_config);
-	
-    //Configure and enable ADC channel 2
-    static nrf_drv_adc_channel_t m_channel_2_config = NRF_DRV_ADC_DEFAULT_CHANNEL(NRF_ADC_CONFIG_INPUT_7);	
-    m_channel_2_config.config.config.input = NRF_ADC_CONFIG_SCALING_INPUT_ONE_THIRD;
-    nrf_drv_adc_channel_enable(&m_channel_2_config);
+    //Configure and enable ADC channels 0 to 2, starting with 1/3 prescaling and 10 bit resolution
+    for (uint8_t channel = 0; channel < ADC_CHANNEL_COUNT; channel++)
+    {
+        adc_channel_range_set(channel, ADC_RANGE_3600MV, 10);
+        nrf_drv_adc_channel_enable(&m_channel_config[channel]);
+    }
 	
-    number_of_adc_channels = 3;    //Set equal to the number of configured ADC channels, for the sake of UART output.
+    number_of_adc_channels = ADC_CHANNEL_COUNT;    //Set equal to the number of configured ADC channels, for the sake of UART output.
 }
 
 void adc_sampling_event_enable(void)
@@ -146,6 +432,9 @@ int main(void)
     APP_ERROR_CHECK(NRF_LOG_INIT(NULL));
 
     NRF_LOG_INFO("    ADC example\r\n");
+#if (LEVEL_CROSSING_ENABLED == 1)
+    NRF_LOG_INFO("Level crossing encoding, reconstruction error at most %d mV\r\n", level_crossing_error_bound_get());
+#endif
 
     APP_ERROR_CHECK(nrf_drv_adc_buffer_convert(adc_buffer,ADC_BUFFER_SIZE));
 	
@@ -41,6 +41,9 @@
 #include "nrf_ble_gatt.h"
 #include "ble_conn_state.h"
 #include "nrf_drv_adc.h"
+#include "ble_radio_notification.h"
+#include "nrf_drv_ppi.h"
+#include "nrf_drv_timer.h"
 #include "app_util_platform.h"
 #include "app_scheduler.h"
 #include "app_util.h"
@@ -59,22 +62,24 @@
 #define APP_TIMER_PRESCALER              0                                           /**< Value of the RTC1 PRESCALER register. */
 #define APP_TIMER_OP_QUEUE_SIZE          4                                           /**< Size of timer operation queues. */
 
-#define BATTERY_LEVEL_MEAS_INTERVAL      APP_TIMER_TICKS(2000, APP_TIMER_PRESCALER)  /**< Battery level measurement interval (ticks). */
-#define MIN_BATTERY_LEVEL                81                                          /**< Minimum simulated battery level. */
-#define MAX_BATTERY_LEVEL                100                                         /**< Maximum simulated 7battery level. */
-#define BATTERY_LEVEL_INCREMENT          1                                           /**< Increment between each simulated battery level measurement. */
+#define SENSOR_PIPELINE_INTERVAL_MS      1000                                        /**< Sensor pipeline tick interval, also the Heart Rate Measurement interval (milliseconds). */
+#define SENSOR_PIPELINE_INTERVAL         APP_TIMER_TICKS(SENSOR_PIPELINE_INTERVAL_MS, APP_TIMER_PRESCALER) /**< Sensor pipeline tick interval (ticks). */
+#define SENSOR_PIPELINE_INTERVAL_1024THS ((SENSOR_PIPELINE_INTERVAL_MS * 1024) / 1000) /**< Sensor pipeline tick interval in the 1/1024 second unit of RR intervals. */
 
-#define HEART_RATE_MEAS_INTERVAL         APP_TIMER_TICKS(1000, APP_TIMER_PRESCALER)  /**< Heart rate measurement interval (ticks). */
-#define MIN_HEART_RATE                   140                                         /**< Minimum heart rate as returned by the simulated measurement function. */
-#define MAX_HEART_RATE                   300                                         /**< Maximum heart rate as returned by the simulated measurement function. */
-#define HEART_RATE_INCREMENT             10                                          /**< Value by which the heart rate is incremented/decremented for each call to the simulated measurement function. */
+#define BATTERY_LEVEL_MEAS_INTERVAL_MIN  2                                           /**< Battery level measurement interval after a change of battery voltage or level, and after connecting (seconds). */
+#define BATTERY_LEVEL_MEAS_INTERVAL_MAX  3600                                        /**< Longest battery level measurement interval, reached while the battery level is stable (seconds). */
 
-#define RR_INTERVAL_INTERVAL             APP_TIMER_TICKS(300, APP_TIMER_PRESCALER)   /**< RR interval interval (ticks). */
+#define RR_INTERVAL_RING_SIZE            16                                          /**< Number of RR intervals buffered between two Heart Rate Measurements, must be a power of two. */
 #define MIN_RR_INTERVAL                  100                                         /**< Minimum RR interval as returned by the simulated measurement function. */
 #define MAX_RR_INTERVAL                  500                                         /**< Maximum RR interval as returned by the simulated measurement function. */
 #define RR_INTERVAL_INCREMENT            1                                           /**< Value by which the RR interval is incremented/decremented for each call to the simulated measurement function. */
 
-#define SENSOR_CONTACT_DETECTED_INTERVAL APP_TIMER_TICKS(5000, APP_TIMER_PRESCALER)  /**< Sensor Contact Detected toggle interval (ticks). */
+#define SENSOR_CONTACT_DETECTED_INTERVAL_MS 5000                                     /**< Sensor Contact Detected toggle interval (milliseconds). */
+#define SENSOR_CONTACT_DETECTED_TICKS    ROUNDED_DIV(SENSOR_CONTACT_DETECTED_INTERVAL_MS, SENSOR_PIPELINE_INTERVAL_MS) /**< Sensor Contact Detected toggle interval, rounded to whole sensor pipeline ticks. */
+STATIC_ASSERT(SENSOR_CONTACT_DETECTED_TICKS > 0);
+
+#define WAKEUP_STATS_ENABLED             0                                           /**< Set to 1 to log the number of CPU wakeups per second. */
+#define WAKEUP_STATS_INTERVAL_TICKS      10                                          /**< Sensor pipeline ticks between two wakeup reports. */
 
 #define MIN_CONN_INTERVAL                MSEC_TO_UNITS(400, UNIT_1_25_MS)            /**< Minimum acceptable connection interval (0.4 seconds). */
 #define MAX_CONN_INTERVAL                MSEC_TO_UNITS(650, UNIT_1_25_MS)            /**< Maximum acceptable connection interval (0.65 second). */
@@ -101,14 +106,105 @@
 #define ADC_REF_VOLTAGE_IN_MILLIVOLTS           1200
 #define ADC_PRE_SCALING_COMPENSATION            3 
 #define DIODE_FWD_VOLT_DROP_MILLIVOLTS          270
-#define ADC_RESULT_IN_MILLI_VOLTS(ADC_VALUE)    ((((ADC_VALUE) * ADC_REF_VOLTAGE_IN_MILLIVOLTS) / 1023) * ADC_PRE_SCALING_COMPENSATION)																	 
+#define ADC_CAL_FRACTION_BITS                   16                                   /**< Number of fractional bits of the calibration gain and offset. */
+#define ADC_CAL_IDEAL_GAIN                      (((ADC_REF_VOLTAGE_IN_MILLIVOLTS * ADC_PRE_SCALING_COMPENSATION) << ADC_CAL_FRACTION_BITS) / 1023)  /**< Millivolts per ADC code with an ideal bandgap reference and prescaler. */
 #define ADC_BUFFER_SIZE 6                                                            /**< Size of buffer for ADC samples.  */									
+
+#define ADC_ROBUST_FILTER_MEAN                  0                                    /**< Plain average of the burst. */
+#define ADC_ROBUST_FILTER_MEDIAN                1                                    /**< Sliding median. */
+#define ADC_ROBUST_FILTER_TRIMMED_MEAN          2                                    /**< Sliding mean without the ADC_ROBUST_TRIM lowest and highest samples. */
+#define ADC_ROBUST_FILTER_HAMPEL                3                                    /**< Sliding Hampel filter, outliers are replaced by the median. */
+#define ADC_ROBUST_FILTER                       ADC_ROBUST_FILTER_MEDIAN             /**< Filter stage combining the samples of a battery burst, so that a spike (e.g. from the radio) does not skew the battery reading. */
+#define ADC_ROBUST_WINDOW                       5                                    /**< Window of the robust filter, 3, 5 or 7 samples and at most ADC_BUFFER_SIZE. */
+#define ADC_ROBUST_TRIM                         1                                    /**< Samples dropped at each end of the sorted window by the trimmed mean. */
+#define ADC_HAMPEL_THRESHOLD_Q8                 1139                                 /**< Outlier threshold of the Hampel filter in MADs, with 8 fractional bits: 3 standard deviations of 1.4826 MAD. */
+#define ADC_HAMPEL_MIN_DEVIATION                2                                    /**< Deviations up to this number of ADC codes are never outliers, as the MAD of a quiet burst is often 0. */
+
+#define ADC_CALIBRATION_ENABLED                 0                                    /**< Set to 1 to calibrate the battery channel against a known supply voltage with button 3, and keep the calibration in flash. */
+#define ADC_CAL_POINT_LOW_MILLIVOLTS            2000                                 /**< Supply voltage applied while capturing the first calibration point. */
+#define ADC_CAL_POINT_HIGH_MILLIVOLTS           3300                                 /**< Supply voltage applied while capturing the second calibration point. */
+#define ADC_CAL_MAX_GAIN_ERROR_PERCENT          10                                   /**< Largest accepted deviation of the measured gain from the ideal gain. */
+#define ADC_CAL_FILE_ID                         0x1010                               /**< FDS file of the calibration record, outside the range used by the Peer Manager. */
+#define ADC_CAL_RECORD_KEY                      0x0001                               /**< FDS key of the calibration record. */
+#define ADC_CAL_RECORD_VERSION                  1                                    /**< Layout version of the calibration record. A record of another version is ignored. */
+
+#define HEART_RATE_ADC_FRONT_END_ENABLED        0                                    /**< Set to 1 to extract heart rate and RR intervals from a PPG sensor on PPG_ADC_INPUT. Set to 0 to use simulated RR intervals. */
+#define PPG_ADC_INPUT                           NRF_ADC_CONFIG_INPUT_2               /**< Analog input of the PPG front end output (AIN2). The pulse is expected to peak upwards. */
+#define PPG_SAMPLE_RATE_HZ                      125                                  /**< PPG sample rate, driven by TIMER2 through PPI (Hz). */
+#define PPG_TIMER_TICKS                         (31250 / PPG_SAMPLE_RATE_HZ)         /**< TIMER2 compare value for the PPG sample rate, TIMER2 running at 31250 Hz. */
+#define PPG_BUFFER_SIZE                         25                                   /**< PPG samples per ADC buffer, processed every 200 ms. */
+#define PPG_FRACTION_BITS                       8                                    /**< Number of fractional bits of the filtered PPG signal. */
+#define PPG_HIGHPASS_SHIFT                      6                                    /**< Baseline tracking factor of 1/64, high-pass corner at about 0.3 Hz. */
+#define PPG_LOWPASS_SHIFT                       2                                    /**< Smoothing factor of 1/4, low-pass corner at about 5 Hz. */
+#define PPG_ENVELOPE_DECAY_SHIFT                7                                    /**< Pulse envelope decays by 1/128 per sample, about 1 second time constant. */
+#define PPG_MIN_AMPLITUDE                       4                                    /**< Smallest pulse amplitude regarded as a heart beat (ADC codes). */
+#define PPG_REFRACTORY_SAMPLES                  (PPG_SAMPLE_RATE_HZ / 4)             /**< No beat is detected within 250 ms of the previous one, limiting the heart rate to 240 bpm. */
+#define PPG_MAX_BEAT_SAMPLES                    (PPG_SAMPLE_RATE_HZ * 2)             /**< Longer gaps between two beats, below 30 bpm, are not reported as RR interval. */
+
+#define REPLAY_TEST_ENABLED                     0                                    /**< Set to 1 to replay test traces through the signal processing at startup, and log the results against the expected ones and the CPU cycles taken. Uses TIMER1. */
+#define REPLAY_PPG_LEAD_IN_SAMPLES              250                                  /**< Samples of the synthetic PPG trace before its first beat, for the filters to settle. */
+#define REPLAY_PPG_REPEAT                       2                                    /**< Number of times the RR pattern of the synthetic PPG trace is repeated. */
+#define REPLAY_PPG_MATCH_SAMPLES                16                                   /**< Largest delay of a detected beat after the synthesized one still regarded as the same beat. */
+#define REPLAY_PPG_MAX_RR_ERROR_MS              32                                   /**< Largest accepted deviation of a detected RR interval from the synthesized one. */
+#define REPLAY_ROBUST_MAX_ERROR                 1                                    /**< Largest accepted deviation of the robust filter stage from the level of a burst without its spikes (ADC codes). */
+
+#define RADIO_AWARE_SAMPLING_ENABLED            0                                    /**< Set to 1 to place the battery ADC bursts right after a radio event, sharing the crystal the SoftDevice started for it. */
+#define RADIO_AWARE_AB_TEST_ENABLED             0                                    /**< Set to 1 to alternate radio-aligned and immediate bursts, and log the noise and crystal startup cost of both. */
+#define RADIO_AWARE_MAX_WAIT_TICKS              2                                    /**< Sensor pipeline ticks to wait for a radio event before sampling anyway, e.g. when not advertising. */
+#define RADIO_AWARE_WAIT_CURRENT_UA             4870                                 /**< Current while polling for the crystal: CPU running plus crystal oscillator, nRF51 typical values. */
+
+#if (RADIO_AWARE_SAMPLING_ENABLED == 1) && (HEART_RATE_ADC_FRONT_END_ENABLED == 1)
+#error "RADIO_AWARE_SAMPLING_ENABLED needs the ADC to be idle between battery bursts, disable HEART_RATE_ADC_FRONT_END_ENABLED"
+#endif
+
+#define BATTERY_CHEMISTRY_CR2032                0                                    /**< Li-MnO2 coin cell. */
+#define BATTERY_CHEMISTRY_ALKALINE_2S           1                                    /**< Two alkaline AA/AAA cells in series. */
+#define BATTERY_CHEMISTRY_NIMH_2S               2                                    /**< Two NiMH AA/AAA cells in series. */
+#define BATTERY_CHEMISTRY                       BATTERY_CHEMISTRY_CR2032             /**< Chemistry of the battery supplying VDD. Selects discharge curve and internal resistance. */
+
+#define BATTERY_MEAS_LOAD_MICROAMPS             4000                                 /**< Approximate current drawn while measuring (CPU, HFCLK crystal and ADC running). Used to compensate for the voltage drop over the battery internal resistance. */
+#define BATTERY_VOLTAGE_CHANGE_MILLIVOLTS       20                                   /**< Deviation from the smoothed voltage that is regarded as a change of the battery voltage. */
+#define BATTERY_FILTER_SHIFT_STABLE             4                                    /**< Exponential smoothing factor of 1/16 while the battery voltage is stable. */
+#define BATTERY_FILTER_SHIFT_CHANGING           1                                    /**< Exponential smoothing factor of 1/2 while the battery voltage is changing. */
+#define BATTERY_FILTER_FRACTION_BITS            4                                    /**< Number of fractional bits of the smoothed battery voltage. */
                                     
-#define APP_SCHED_MAX_EVT_SIZE			5
-#define APP_SCHED_QUEUE_SIZE			5	
+#define APP_SCHED_MAX_EVT_SIZE          sizeof(app_evt_t)                           /**< Maximum size of scheduler event data. All application events have the same fixed size. */
+#define APP_SCHED_QUEUE_SIZE            10                                          /**< Maximum number of events in the scheduler queue. */
 
 void adc_sample(void);																	 
 
+/**@brief Point on a battery discharge curve. */
+typedef struct
+{
+    uint16_t millivolts;                                  /**< Open-circuit battery voltage. */
+    uint8_t  percent;                                     /**< Remaining capacity at this voltage. */
+} battery_curve_point_t;
+
+#if (HEART_RATE_ADC_FRONT_END_ENABLED == 1) || (REPLAY_TEST_ENABLED == 1)
+/**@brief State of the PPG heart beat detector. */
+typedef struct
+{
+    int32_t  baseline;                                    /**< Tracked DC level of the PPG signal (ADC codes, PPG_FRACTION_BITS fraction). */
+    int32_t  filtered;                                    /**< Band-pass filtered PPG signal (ADC codes, PPG_FRACTION_BITS fraction). */
+    int32_t  envelope;                                    /**< Decaying peak envelope of the filtered PPG signal. */
+    bool     above_threshold;                             /**< True while the filtered PPG signal is above the beat detection threshold. */
+    uint32_t sample_count;                                /**< Number of PPG samples processed. */
+    uint32_t last_beat;                                   /**< Sample count at the last detected heart beat. */
+} ppg_detector_t;
+#endif
+
+#if (REPLAY_TEST_ENABLED == 1)
+/**@brief Battery burst of a golden trace, with the results expected from the processing. */
+typedef struct
+{
+    nrf_adc_value_t samples[ADC_BUFFER_SIZE];             /**< ADC codes of the burst. */
+    nrf_adc_value_t level;                                /**< Level of the burst without its spikes, expected from the robust filter stage. */
+    nrf_adc_value_t average;                              /**< Expected adc_average_compute result. */
+    uint16_t        millivolts;                           /**< Expected adc_cal_millivolts result, with the ideal calibration. */
+    uint8_t         percent;                              /**< Expected battery_model_update result, with the bursts replayed in order. */
+} replay_battery_burst_t;
+#endif
+
 static uint16_t  m_conn_handle = BLE_CONN_HANDLE_INVALID; /**< Handle of the current connection. */
 static ble_bas_t m_bas;                                   /**< Structure used to identify the battery service. */
 static ble_hrs_t m_hrs;                                   /**< Structure used to identify the heart rate service. */
@@ -116,17 +212,21 @@ static bool      m_rr_interval_enabled = true;            /**< Flag for enabling
 
 static nrf_ble_gatt_t m_gatt;                             /**< Structure for gatt module*/
 
-static sensorsim_cfg_t   m_battery_sim_cfg;               /**< Battery Level sensor simulator configuration. */
-static sensorsim_state_t m_battery_sim_state;             /**< Battery Level sensor simulator state. */
-static sensorsim_cfg_t   m_heart_rate_sim_cfg;            /**< Heart Rate sensor simulator configuration. */
-static sensorsim_state_t m_heart_rate_sim_state;          /**< Heart Rate sensor simulator state. */
+#if (HEART_RATE_ADC_FRONT_END_ENABLED == 0)
 static sensorsim_cfg_t   m_rr_interval_sim_cfg;           /**< RR Interval sensor simulator configuration. */
 static sensorsim_state_t m_rr_interval_sim_state;         /**< RR Interval sensor simulator state. */
+#endif
+
+static uint16_t  m_rr_ring[RR_INTERVAL_RING_SIZE];        /**< RR intervals acquired since the last Heart Rate Measurement (1/1024 seconds). */
+static uint8_t   m_rr_ring_tail;                          /**< Index of the oldest RR interval in the ring. */
+static uint8_t   m_rr_ring_count;                         /**< Number of RR intervals in the ring. */
+
+APP_TIMER_DEF(m_sensor_pipeline_timer_id);                /**< Sensor pipeline timer, drives the heart rate, RR interval, sensor contact and battery measurements. */
 
-APP_TIMER_DEF(m_battery_timer_id);                        /**< Battery timer. */
-APP_TIMER_DEF(m_heart_rate_timer_id);                     /**< Heart rate measurement timer. */
-APP_TIMER_DEF(m_rr_interval_timer_id);                    /**< RR interval timer. */                 /**< RR interval timer. */
-APP_TIMER_DEF(m_sensor_contact_timer_id);                 /**< Sensor contact detected timer. */
+#if (WAKEUP_STATS_ENABLED == 1)
+static uint32_t  m_wakeup_count;                          /**< Number of returns from sd_app_evt_wait since the last report. */
+static uint32_t  m_wakeup_timer_count;                    /**< Number of app_timer expirations since the last report. */
+#endif
 
 
 static ble_uuid_t m_adv_uuids[] = {{BLE_UUID_HEART_RATE_SERVICE, BLE_UUID_TYPE_BLE},
@@ -134,7 +234,219 @@ static ble_uuid_t m_adv_uuids[] = {{BLE_UUID_HEART_RATE_SERVICE, BLE_UUID_TYPE_B
                                    {BLE_UUID_DEVICE_INFORMATION_SERVICE, BLE_UUID_TYPE_BLE}}; /**< Universally unique service identifiers. */
 
 static nrf_adc_value_t          adc_buffer[ADC_BUFFER_SIZE]; /**< ADC buffer. */
-static uint8_t                  adc_event_counter = 0;                                   
+static uint32_t                 adc_event_counter = 0;                                   
+static nrf_drv_adc_channel_t    m_battery_channel_config = NRF_DRV_ADC_DEFAULT_CHANNEL(NRF_ADC_CONFIG_INPUT_DISABLED); /**< ADC channel sampling the supply voltage, no analog input pin. */
+
+#if (HEART_RATE_ADC_FRONT_END_ENABLED == 1)
+static const nrf_drv_timer_t    m_ppg_timer = NRF_DRV_TIMER_INSTANCE(2); /**< Timer driving the PPG sample rate. */
+static nrf_ppi_channel_t        m_ppg_ppi_channel;                 /**< PPI channel starting an ADC conversion on every PPG timer compare event. */
+static nrf_adc_value_t          m_ppg_buffer[2][PPG_BUFFER_SIZE];  /**< ADC buffers for PPG samples, one is filled while the other is processed. */
+static uint8_t                  m_ppg_buffer_index;                /**< Index of the PPG buffer being filled. */
+static volatile bool            m_ppg_buffer_busy[2];              /**< True while the main loop processes the buffer, it is not filled again until released. */
+static volatile uint32_t        m_ppg_buffers_dropped;             /**< Number of PPG buffers dropped because the other buffer was still processed or the scheduler queue was full. */
+static uint32_t                 m_ppg_buffers_dropped_reported;    /**< Number of dropped PPG buffers last reported on the log. */
+static ppg_detector_t           m_ppg_detector;                    /**< Heart beat detector of the PPG signal. */
+static volatile bool            m_battery_meas_pending;            /**< True when a battery measurement is due between two PPG buffers. */
+#endif
+
+/**@brief Timing of a battery ADC burst relative to the radio. */
+typedef enum
+{
+    ADC_BURST_IMMEDIATE,                                              /**< Started when due, at any time relative to radio events. */
+    ADC_BURST_RADIO_ALIGNED,                                          /**< Started on the radio inactive notification. */
+    ADC_BURST_MODE_COUNT
+} adc_burst_mode_t;
+
+/**@brief Noise and crystal startup statistics of the bursts of one mode. */
+typedef struct
+{
+    uint32_t bursts;                                                  /**< Number of bursts. */
+    uint32_t spread_sum;                                              /**< Sum of the difference between the highest and lowest sample of each burst (ADC codes). */
+    uint32_t hfxo_starts;                                             /**< Number of bursts that had to start the crystal. */
+    uint32_t hfxo_wait_ticks;                                         /**< Total time spent waiting for the crystal (RTC1 ticks). */
+} adc_burst_stats_t;
+
+#if (RADIO_AWARE_SAMPLING_ENABLED == 1)
+static volatile bool            m_adc_burst_radio_pending;         /**< True while a burst waits for the next radio event. */
+static volatile bool            m_adc_burst_hfclk_requested;       /**< True when the crystal was requested on the radio active notification. */
+static uint8_t                  m_adc_burst_wait_ticks;            /**< Sensor pipeline ticks the pending burst has waited for a radio event. */
+static adc_burst_mode_t         m_adc_burst_mode;                  /**< Mode of the burst being converted. */
+static bool                     m_adc_burst_hfxo_started;          /**< True when the burst being converted had to start the crystal. */
+static uint32_t                 m_adc_burst_hfxo_wait;             /**< Crystal wait of the burst being converted (RTC1 ticks). */
+static adc_burst_stats_t        m_adc_burst_stats[ADC_BURST_MODE_COUNT];  /**< Statistics per burst mode. */
+static const char * const       m_adc_burst_stats_formats[ADC_BURST_MODE_COUNT] =   /**< Log format per burst mode, NRF_LOG does not print strings held in variables. */
+{
+    "Immediate bursts: %d, noise %d.%02d LSB peak-peak, crystal started %d times\r\n",
+    "Radio-aligned bursts: %d, noise %d.%02d LSB peak-peak, crystal started %d times\r\n"
+};
+#endif
+
+/**@brief ADC channels with their own calibration. */
+typedef enum
+{
+    ADC_CAL_CHANNEL_BATTERY,                                                /**< Supply voltage with 1/3 prescaling. */
+    ADC_CAL_CHANNEL_COUNT
+} adc_cal_channel_t;
+
+/**@brief Calibration of one ADC channel, millivolts = (code * gain + offset) >> ADC_CAL_FRACTION_BITS. */
+typedef struct
+{
+    int32_t gain;                                                           /**< Millivolts per ADC code (ADC_CAL_FRACTION_BITS fraction). */
+    int32_t offset;                                                         /**< Millivolts at ADC code 0 (ADC_CAL_FRACTION_BITS fraction), including the rounding term. */
+} adc_cal_coeffs_t;
+
+/**@brief Calibration record as stored in flash, a whole number of words. */
+typedef struct
+{
+    uint32_t         version;                                               /**< ADC_CAL_RECORD_VERSION. */
+    adc_cal_coeffs_t coeffs[ADC_CAL_CHANNEL_COUNT];                         /**< Calibration of each channel. */
+} adc_cal_record_t;
+
+static adc_cal_record_t         m_adc_cal =                                 /**< Calibration in use, ideal until a record is loaded from flash. */
+{
+    .version = ADC_CAL_RECORD_VERSION,
+    .coeffs  = {{ADC_CAL_IDEAL_GAIN, 1 << (ADC_CAL_FRACTION_BITS - 1)}}
+};
+
+#if (ADC_CALIBRATION_ENABLED == 1)
+static uint16_t                 m_adc_cal_point_codes[2];                   /**< Averaged ADC codes captured at the low and high calibration voltage. */
+static uint8_t                  m_adc_cal_point_count;                      /**< Number of calibration points captured so far. */
+static volatile bool            m_adc_cal_capture_pending;                  /**< True when the next battery measurement is a calibration point. */
+static adc_cal_record_t         m_adc_cal_flash_buffer;                     /**< Copy of the record being written, must stay valid until the write completes. */
+static bool                     m_adc_cal_store_retry;                      /**< True while garbage is collected to make room for the calibration record, which is then written on FDS_EVT_GC. */
+#endif
+
+/**@brief Application event types. Events are posted from interrupt context and processed in the main loop. */
+typedef enum
+{
+    APP_EVT_BLE,                                                            /**< SoftDevice events are available. */
+    APP_EVT_PPG_ADC_DONE,                                                   /**< A PPG buffer is filled. */
+    APP_EVT_BATTERY_MEAS,                                                   /**< The battery level measurement interval has elapsed. */
+    APP_EVT_BATTERY_ADC_DONE,                                               /**< The battery ADC samples are converted. */
+} app_evt_type_t;
+
+/**@brief Application event priorities. Events of lower priority are deferred while events of higher priority are pending. */
+typedef enum
+{
+    APP_EVT_PRIORITY_HIGH,                                                  /**< Protocol and user input events. */
+    APP_EVT_PRIORITY_LOW,                                                   /**< Measurement processing. */
+    APP_EVT_PRIORITY_COUNT                                                  /**< Number of event priorities. */
+} app_evt_priority_t;
+
+/**@brief Fixed-size application event, copied into the scheduler queue. */
+typedef struct
+{
+    app_evt_type_t type;                                                    /**< Event type. */
+    union
+    {
+        struct
+        {
+            nrf_adc_value_t const * p_buffer;                               /**< Filled ADC buffer. */
+            uint16_t                size;                                   /**< Number of samples in the buffer. */
+            uint8_t                 index;                                  /**< Index of the PPG buffer in m_ppg_buffer, released after processing. */
+        } adc_done;                                                         /**< Parameters of @ref APP_EVT_PPG_ADC_DONE and @ref APP_EVT_BATTERY_ADC_DONE. */
+    } params;
+} app_evt_t;
+
+static volatile uint8_t                 m_app_evt_pending[APP_EVT_PRIORITY_COUNT];  /**< Number of queued application events per priority. */
+static uint8_t                          m_app_evt_queue_max;                        /**< High-water mark of the number of queued application events. */
+static uint8_t                          m_app_evt_queue_max_reported;               /**< High-water mark last reported on the log. */
+static volatile uint32_t                m_app_evt_dropped;                          /**< Number of application events dropped because the scheduler queue was full. */
+static uint32_t                         m_app_evt_dropped_reported;                 /**< Number of dropped application events last reported on the log. */
+static volatile bool                    m_softdevice_evt_scheduled;                 /**< True while an @ref APP_EVT_BLE event is queued. */
+
+static void app_evt_handler(void * p_event_data, uint16_t event_size);
+
+
+/**@brief Function for getting the priority of an application event type.
+ */
+static app_evt_priority_t app_evt_priority_get(app_evt_type_t type)
+{
+    return ((type == APP_EVT_BATTERY_MEAS) || (type == APP_EVT_BATTERY_ADC_DONE)) ? APP_EVT_PRIORITY_LOW : APP_EVT_PRIORITY_HIGH;
+}
+
+
+/**@brief Function for posting an application event to the scheduler queue.
+ *
+ * @details May be called from interrupt context. The event is copied into the queue.
+ *
+ * @param[in] p_evt  Event to post.
+ *
+ * @return NRF_SUCCESS, or NRF_ERROR_NO_MEM if the scheduler queue is full. The dropped event is
+ *         counted and reported on the log from the main loop.
+ */
+static uint32_t app_evt_put(app_evt_t const * p_evt)
+{
+    uint32_t err_code;
+    uint8_t  queued = 0;
+
+    CRITICAL_REGION_ENTER();
+    err_code = app_sched_event_put(p_evt, sizeof(app_evt_t), app_evt_handler);
+    if (err_code == NRF_SUCCESS)
+    {
+        m_app_evt_pending[app_evt_priority_get(p_evt->type)]++;
+        for (uint32_t i = 0; i < APP_EVT_PRIORITY_COUNT; i++)
+        {
+            queued += m_app_evt_pending[i];
+        }
+        if (queued > m_app_evt_queue_max)
+        {
+            m_app_evt_queue_max = queued;
+        }
+    }
+    else
+    {
+        m_app_evt_dropped++;
+    }
+    CRITICAL_REGION_EXIT();
+
+    return err_code;
+}
+
+
+/**@brief Function for scheduling SoftDevice event processing in the main loop.
+ *
+ * @details Called by the SoftDevice handler from the SoftDevice event interrupt. One queued event
+ *          pulls all pending SoftDevice events, so no further event is queued until it is processed.
+ */
+static uint32_t softdevice_evt_schedule(void)
+{
+    uint32_t  err_code;
+    app_evt_t evt;
+
+    if (m_softdevice_evt_scheduled)
+    {
+        return NRF_SUCCESS;
+    }
+
+    evt.type = APP_EVT_BLE;
+    err_code = app_evt_put(&evt);
+    if (err_code == NRF_SUCCESS)
+    {
+        m_softdevice_evt_scheduled = true;
+    }
+    return err_code;
+}
+
+/**@brief Discharge curve, sorted by descending voltage, and internal resistance of the configured battery. */
+#if (BATTERY_CHEMISTRY == BATTERY_CHEMISTRY_CR2032)
+static const battery_curve_point_t m_battery_curve[] = {{3000, 100}, {2900, 42}, {2740, 18}, {2440, 6}, {2100, 0}};
+#define BATTERY_INTERNAL_RESISTANCE_OHMS        15
+#elif (BATTERY_CHEMISTRY == BATTERY_CHEMISTRY_ALKALINE_2S)
+static const battery_curve_point_t m_battery_curve[] = {{3100, 100}, {2900, 80}, {2700, 50}, {2500, 25}, {2300, 10}, {2000, 0}};
+#define BATTERY_INTERNAL_RESISTANCE_OHMS        1
+#elif (BATTERY_CHEMISTRY == BATTERY_CHEMISTRY_NIMH_2S)
+static const battery_curve_point_t m_battery_curve[] = {{2800, 100}, {2600, 90}, {2500, 70}, {2400, 50}, {2300, 25}, {2200, 10}, {2000, 0}};
+#define BATTERY_INTERNAL_RESISTANCE_OHMS        0
+#else
+#error "Unsupported BATTERY_CHEMISTRY"
+#endif
+
+static uint32_t                 m_battery_voltage_filtered = 0;   /**< Smoothed open-circuit battery voltage in 1/(2^BATTERY_FILTER_FRACTION_BITS) mV. 0 until the first measurement. */
+static bool                     m_battery_voltage_changing = true; /**< True while the battery voltage deviates from the smoothed value. */
+static uint8_t                  m_battery_level_last = 0xFF;       /**< Battery level of the last measurement, 0xFF before the first measurement. */
+static uint32_t                 m_battery_meas_interval = BATTERY_LEVEL_MEAS_INTERVAL_MIN; /**< Current battery level measurement interval (seconds). */
+static uint32_t                 m_battery_meas_remaining;          /**< Sensor pipeline ticks left until the next battery level measurement. */
                                    
 /**@brief Callback function for asserts in the SoftDevice.
  *
@@ -163,6 +475,149 @@ void advertising_start(void)
 }
 
 
+/**@brief Function for converting an ADC code into calibrated millivolts.
+ *
+ * @details One multiply-add and a shift, with the coefficients computed when calibrating.
+ *
+ * @param[in] channel  Channel the code was converted on.
+ * @param[in] code     ADC code.
+ */
+static __INLINE uint16_t adc_cal_millivolts(adc_cal_channel_t channel, uint16_t code)
+{
+    int32_t millivolts = ((int32_t)code * m_adc_cal.coeffs[channel].gain + m_adc_cal.coeffs[channel].offset) >> ADC_CAL_FRACTION_BITS;
+
+    return (millivolts < 0) ? 0 : (uint16_t)millivolts;
+}
+
+
+#if (ADC_CALIBRATION_ENABLED == 1)
+/**@brief Function for loading the ADC calibration from flash.
+ *
+ * @details The ideal calibration stays in use when no valid record is found.
+ */
+static void adc_cal_load(void)
+{
+    ret_code_t         err_code;
+    fds_record_desc_t  record_desc;
+    fds_find_token_t   find_token;
+    fds_flash_record_t flash_record;
+
+    memset(&find_token, 0, sizeof(find_token));
+    if (fds_record_find(ADC_CAL_FILE_ID, ADC_CAL_RECORD_KEY, &record_desc, &find_token) != FDS_SUCCESS)
+    {
+        NRF_LOG_INFO("No ADC calibration in flash, using ideal reference and prescaler\r\n");
+        return;
+    }
+
+    err_code = fds_record_open(&record_desc, &flash_record);
+    APP_ERROR_CHECK(err_code);
+    if ((flash_record.p_header->length_words == BYTES_TO_WORDS(sizeof(adc_cal_record_t))) &&
+        (((adc_cal_record_t const *)flash_record.p_data)->version == ADC_CAL_RECORD_VERSION))
+    {
+        memcpy(&m_adc_cal, flash_record.p_data, sizeof(adc_cal_record_t));
+        NRF_LOG_INFO("ADC calibration loaded, battery gain %d, offset %d\r\n", m_adc_cal.coeffs[ADC_CAL_CHANNEL_BATTERY].gain, m_adc_cal.coeffs[ADC_CAL_CHANNEL_BATTERY].offset);
+    }
+    err_code = fds_record_close(&record_desc);
+    APP_ERROR_CHECK(err_code);
+}
+
+
+/**@brief Function for writing the ADC calibration in use to flash, replacing an existing record.
+ */
+static void adc_cal_store(void)
+{
+    ret_code_t         err_code;
+    fds_record_desc_t  record_desc;
+    fds_find_token_t   find_token;
+    fds_record_chunk_t record_chunk;
+    fds_record_t       record;
+
+    m_adc_cal_flash_buffer    = m_adc_cal;
+    record_chunk.p_data       = &m_adc_cal_flash_buffer;
+    record_chunk.length_words = BYTES_TO_WORDS(sizeof(adc_cal_record_t));
+    record.file_id            = ADC_CAL_FILE_ID;
+    record.key                = ADC_CAL_RECORD_KEY;
+    record.data.p_chunks      = &record_chunk;
+    record.data.num_chunks    = 1;
+
+    memset(&find_token, 0, sizeof(find_token));
+    if (fds_record_find(ADC_CAL_FILE_ID, ADC_CAL_RECORD_KEY, &record_desc, &find_token) == FDS_SUCCESS)
+    {
+        err_code = fds_record_update(&record_desc, &record);
+    }
+    else
+    {
+        err_code = fds_record_write(&record_desc, &record);
+    }
+
+    if ((err_code == FDS_ERR_NO_SPACE_IN_FLASH) && !m_adc_cal_store_retry)
+    {
+        NRF_LOG_WARNING("No space for the ADC calibration, collecting garbage before writing it\r\n");
+        m_adc_cal_store_retry = true;                                //Written again from fds_evt_handler when garbage collection is done
+        err_code = fds_gc();
+    }
+    APP_ERROR_CHECK(err_code);
+}
+
+
+/**@brief Function for computing the calibration of the battery channel from the two captured points.
+ *
+ * @return True if the calibration is plausible and has been applied.
+ */
+static bool adc_cal_compute(void)
+{
+    int32_t code_span = (int32_t)m_adc_cal_point_codes[1] - m_adc_cal_point_codes[0];
+    int32_t gain;
+
+    if (code_span <= 0)
+    {
+        return false;
+    }
+    gain = ((ADC_CAL_POINT_HIGH_MILLIVOLTS - ADC_CAL_POINT_LOW_MILLIVOLTS) << ADC_CAL_FRACTION_BITS) / code_span;
+    if ((gain < (ADC_CAL_IDEAL_GAIN * (100 - ADC_CAL_MAX_GAIN_ERROR_PERCENT)) / 100) ||
+        (gain > (ADC_CAL_IDEAL_GAIN * (100 + ADC_CAL_MAX_GAIN_ERROR_PERCENT)) / 100))
+    {
+        return false;
+    }
+
+    m_adc_cal.coeffs[ADC_CAL_CHANNEL_BATTERY].gain   = gain;
+    m_adc_cal.coeffs[ADC_CAL_CHANNEL_BATTERY].offset = (ADC_CAL_POINT_LOW_MILLIVOLTS << ADC_CAL_FRACTION_BITS) - (int32_t)m_adc_cal_point_codes[0] * gain
+                                                     + (1 << (ADC_CAL_FRACTION_BITS - 1));
+    return true;
+}
+
+
+/**@brief Function for using a battery measurement as calibration point.
+ *
+ * @details The first point is captured at ADC_CAL_POINT_LOW_MILLIVOLTS and the second at
+ *          ADC_CAL_POINT_HIGH_MILLIVOLTS. The calibration is written to flash after the second point.
+ *
+ * @param[in] code  Averaged ADC code of the battery measurement.
+ */
+static void adc_cal_point_process(uint16_t code)
+{
+    m_adc_cal_point_codes[m_adc_cal_point_count++] = code;
+    NRF_LOG_INFO("Calibration point %d: ADC code %d\r\n", m_adc_cal_point_count, code);
+    if (m_adc_cal_point_count == 1)
+    {
+        NRF_LOG_INFO("Apply %d mV and press button 3 again\r\n", ADC_CAL_POINT_HIGH_MILLIVOLTS);
+        return;
+    }
+
+    m_adc_cal_point_count = 0;
+    if (adc_cal_compute())
+    {
+        NRF_LOG_INFO("ADC calibrated, battery gain %d, offset %d\r\n", m_adc_cal.coeffs[ADC_CAL_CHANNEL_BATTERY].gain, m_adc_cal.coeffs[ADC_CAL_CHANNEL_BATTERY].offset);
+        adc_cal_store();
+    }
+    else
+    {
+        NRF_LOG_WARNING("Calibration points out of range, calibration unchanged\r\n");
+    }
+}
+#endif
+
+
 /**@brief Function for handling File Data Storage events.
  *
  * @param[in] p_evt  Peer Manager event.
@@ -173,7 +628,24 @@ static void fds_evt_handler(fds_evt_t const * const p_evt)
     if (p_evt->id == FDS_EVT_GC)
     {
         NRF_LOG_DEBUG("GC completed\n");
+#if (ADC_CALIBRATION_ENABLED == 1)
+        if (m_adc_cal_store_retry)
+        {
+            adc_cal_store();                                         //Still no space after garbage collection asserts in adc_cal_store
+            m_adc_cal_store_retry = false;
+        }
+#endif
+    }
+#if (ADC_CALIBRATION_ENABLED == 1)
+    else if ((p_evt->id == FDS_EVT_INIT) && (p_evt->result == FDS_SUCCESS))
+    {
+        adc_cal_load();
     }
+    else if (((p_evt->id == FDS_EVT_WRITE) || (p_evt->id == FDS_EVT_UPDATE)) && (p_evt->write.file_id == ADC_CAL_FILE_ID))
+    {
+        NRF_LOG_INFO("ADC calibration stored: %d\r\n", p_evt->result);
+    }
+#endif
 }
 
 
@@ -278,170 +750,550 @@ static void pm_evt_handler(pm_evt_t const * p_evt)
 }
 
 
-/**@brief Function for performing battery measurement and updating the Battery Level characteristic
- *        in Battery Service.
- */
-static void battery_level_update(void)
-{	
-    NRF_LOG_INFO("\r\n    Triggering battery level update...\r\n");          //Indicate on UART that Button 4 is pressed
-	app_sched_event_put(0,0,(app_sched_event_handler_t)adc_sample);    //Put adc_sample function into the scheduler queue, which will then be executed in the main context (lowest priority) when app_sched_execute is called in the main loop
-}
-
-
-/**@brief Function for handling the Battery measurement timer timeout.
+/**@brief Function for converting an open-circuit battery voltage into remaining capacity.
  *
- * @details This function will be called each time the battery level measurement timer expires.
+ * @details Interpolates linearly between the points of the discharge curve of the configured
+ *          battery chemistry.
  *
- * @param[in] p_context  Pointer used for passing some arbitrary information (context) from the
- *                       app_start_timer() call to the timeout handler.
+ * @param[in] millivolts  Open-circuit battery voltage.
+ *
+ * @return Remaining capacity in percent.
  */
-static void battery_level_meas_timeout_handler(void * p_context)
+static uint8_t battery_curve_percent_get(uint16_t millivolts)
 {
-    UNUSED_PARAMETER(p_context);
-    battery_level_update();
+    uint32_t i;
+
+    if (millivolts >= m_battery_curve[0].millivolts)
+    {
+        return m_battery_curve[0].percent;
+    }
+    for (i = 1; i < ARRAY_SIZE(m_battery_curve); i++)
+    {
+        if (millivolts >= m_battery_curve[i].millivolts)
+        {
+            return m_battery_curve[i].percent +
+                   ((millivolts - m_battery_curve[i].millivolts) *
+                    (m_battery_curve[i - 1].percent - m_battery_curve[i].percent)) /
+                   (m_battery_curve[i - 1].millivolts - m_battery_curve[i].millivolts);
+        }
+    }
+    return m_battery_curve[ARRAY_SIZE(m_battery_curve) - 1].percent;
 }
 
 
-/**@brief Function for handling the Heart rate measurement timer timeout.
+/**@brief Function for updating the battery model with a new supply voltage measurement.
  *
- * @details This function will be called each time the heart rate measurement timer expires.
- *          It will exclude RR Interval data from every third measurement.
+ * @details The measured voltage is compensated for the drop over the internal resistance of the
+ *          battery during the measurement, and then smoothed with an exponential filter. The filter
+ *          follows quickly while the voltage is changing and averages heavily while it is stable.
  *
- * @param[in] p_context  Pointer used for passing some arbitrary information (context) from the
- *                       app_start_timer() call to the timeout handler.
+ * @param[in] measured_millivolts  Supply voltage measured under load.
+ *
+ * @return Remaining battery capacity in percent.
  */
-static void heart_rate_meas_timeout_handler(void * p_context)
+static uint8_t battery_model_update(uint16_t measured_millivolts)
 {
-    static uint32_t cnt = 0;
-    uint32_t        err_code;
-    uint16_t        heart_rate;
+    uint32_t open_circuit;
+    uint32_t deviation;
+    uint32_t shift;
 
-    UNUSED_PARAMETER(p_context);
-
-    heart_rate = (uint16_t)sensorsim_measure(&m_heart_rate_sim_state, &m_heart_rate_sim_cfg);
+    open_circuit = ((uint32_t)measured_millivolts +
+                    (BATTERY_MEAS_LOAD_MICROAMPS * BATTERY_INTERNAL_RESISTANCE_OHMS) / 1000)
+                   << BATTERY_FILTER_FRACTION_BITS;
 
-    cnt++;
-    err_code = ble_hrs_heart_rate_measurement_send(&m_hrs, heart_rate);
-    if ((err_code != NRF_SUCCESS) &&
-        (err_code != NRF_ERROR_INVALID_STATE) &&
-        (err_code != BLE_ERROR_NO_TX_PACKETS) &&
-        (err_code != BLE_ERROR_GATTS_SYS_ATTR_MISSING)
-       )
+    if (m_battery_voltage_filtered == 0)
     {
-        APP_ERROR_HANDLER(err_code);
+        m_battery_voltage_filtered = open_circuit;               //First measurement, nothing to smooth
     }
 
-    // Disable RR Interval recording every third heart rate measurement.
-    // NOTE: An application will normally not do this. It is done here just for testing generation
-    // of messages without RR Interval measurements.
-    m_rr_interval_enabled = ((cnt % 3) != 0);
+    deviation = (open_circuit > m_battery_voltage_filtered) ? (open_circuit - m_battery_voltage_filtered)
+                                                            : (m_battery_voltage_filtered - open_circuit);
+    m_battery_voltage_changing = (deviation >= (BATTERY_VOLTAGE_CHANGE_MILLIVOLTS << BATTERY_FILTER_FRACTION_BITS));
+    shift = m_battery_voltage_changing ? BATTERY_FILTER_SHIFT_CHANGING : BATTERY_FILTER_SHIFT_STABLE;
+
+    m_battery_voltage_filtered = m_battery_voltage_filtered - (m_battery_voltage_filtered >> shift) + (open_circuit >> shift);
+
+    return battery_curve_percent_get(m_battery_voltage_filtered >> BATTERY_FILTER_FRACTION_BITS);
 }
 
 
-/**@brief Function for handling the RR interval timer timeout.
+/**@brief Function for posting a battery measurement event.
  *
- * @details This function will be called each time the RR interval timer expires.
+ * @details When the scheduler queue is full, the event is dropped and counted by app_evt_put, and
+ *          the measurement is taken again on the next sensor pipeline tick.
  *
- * @param[in] p_context  Pointer used for passing some arbitrary information (context) from the
- *                       app_start_timer() call to the timeout handler.
+ * @param[in] p_evt  Event to post.
  */
-static void rr_interval_timeout_handler(void * p_context)
+static void battery_evt_put(app_evt_t const * p_evt)
 {
-    UNUSED_PARAMETER(p_context);
-
-    if (m_rr_interval_enabled)
+    if (app_evt_put(p_evt) != NRF_SUCCESS)
     {
-        uint16_t rr_interval;
-
-        rr_interval = (uint16_t)sensorsim_measure(&m_rr_interval_sim_state,
-                                                  &m_rr_interval_sim_cfg);
-        ble_hrs_rr_interval_add(&m_hrs, rr_interval);
-        rr_interval = (uint16_t)sensorsim_measure(&m_rr_interval_sim_state,
-                                                  &m_rr_interval_sim_cfg);
-        ble_hrs_rr_interval_add(&m_hrs, rr_interval);
-        rr_interval = (uint16_t)sensorsim_measure(&m_rr_interval_sim_state,
-                                                  &m_rr_interval_sim_cfg);
-        ble_hrs_rr_interval_add(&m_hrs, rr_interval);
-        rr_interval = (uint16_t)sensorsim_measure(&m_rr_interval_sim_state,
-                                                  &m_rr_interval_sim_cfg);
-        ble_hrs_rr_interval_add(&m_hrs, rr_interval);
-        rr_interval = (uint16_t)sensorsim_measure(&m_rr_interval_sim_state,
-                                                  &m_rr_interval_sim_cfg);
-        ble_hrs_rr_interval_add(&m_hrs, rr_interval);
-        rr_interval = (uint16_t)sensorsim_measure(&m_rr_interval_sim_state,
-                                                  &m_rr_interval_sim_cfg);
-        ble_hrs_rr_interval_add(&m_hrs, rr_interval);
+        m_battery_meas_remaining = 1;
     }
 }
 
 
-/**@brief Function for handling the Sensor Contact Detected timer timeout.
+#if (RADIO_AWARE_SAMPLING_ENABLED == 1)
+/**@brief Function for starting a battery ADC burst from the main loop.
  *
- * @details This function will be called each time the Sensor Contact Detected timer expires.
- *
- * @param[in] p_context  Pointer used for passing some arbitrary information (context) from the
- *                       app_start_timer() call to the timeout handler.
+ * @param[in] mode  Timing of the burst relative to the radio, for the statistics.
  */
-static void sensor_contact_detected_timeout_handler(void * p_context)
+static void adc_burst_start(adc_burst_mode_t mode)
 {
-    static bool sensor_contact_detected = false;
-
-    UNUSED_PARAMETER(p_context);
+    app_evt_t evt;
 
-    sensor_contact_detected = !sensor_contact_detected;
-    ble_hrs_sensor_contact_detected_update(&m_hrs, sensor_contact_detected);
+    m_adc_burst_mode = mode;
+    evt.type = APP_EVT_BATTERY_MEAS;                                   //adc_sample is executed in the main context
+    battery_evt_put(&evt);
 }
 
 
-/**@brief Function for the Timer initialization.
+/**@brief Function for taking the pending burst, so that it is started only once.
  *
- * @details Initializes the timer module. This creates and starts application timers.
+ * @return True if a burst was pending.
  */
-static void timers_init(void)
+static bool adc_burst_pending_take(void)
 {
-    uint32_t err_code;
-
-    // Initialize timer module.
-    APP_TIMER_INIT(APP_TIMER_PRESCALER, APP_TIMER_OP_QUEUE_SIZE, false);
-
-    // Create timers.
-    err_code = app_timer_create(&m_battery_timer_id,
-                                APP_TIMER_MODE_REPEATED,
-                                battery_level_meas_timeout_handler);
-    APP_ERROR_CHECK(err_code);
-
-    err_code = app_timer_create(&m_heart_rate_timer_id,
-                                APP_TIMER_MODE_REPEATED,
-                                heart_rate_meas_timeout_handler);
-    APP_ERROR_CHECK(err_code);
+    bool pending;
 
-    err_code = app_timer_create(&m_rr_interval_timer_id,
-                                APP_TIMER_MODE_REPEATED,
-                                rr_interval_timeout_handler);
-    APP_ERROR_CHECK(err_code);
+    CRITICAL_REGION_ENTER();
+    pending                   = m_adc_burst_radio_pending;
+    m_adc_burst_radio_pending = false;
+    CRITICAL_REGION_EXIT();
 
-    err_code = app_timer_create(&m_sensor_contact_timer_id,
-                                APP_TIMER_MODE_REPEATED,
-                                sensor_contact_detected_timeout_handler);
-    APP_ERROR_CHECK(err_code);
+    return pending;
 }
 
 
-/**@brief Function for the GAP initialization.
+/**@brief Function for handling the SoftDevice radio notifications.
  *
- * @details This function sets up all the necessary GAP (Generic Access Profile) parameters of the
- *          device including the device name, appearance, and the preferred connection parameters.
+ * @details The crystal is requested on the active notification, while the SoftDevice starts it
+ *          for the radio event anyway, so it keeps running after the event. The burst is started
+ *          on the inactive notification, when the radio is silent for the rest of the connection
+ *          or advertising interval.
+ *
+ * @param[in] radio_active  True before a radio event, false after it.
  */
-static void gap_params_init(void)
+static void radio_notification_evt_handler(bool radio_active)
 {
-    uint32_t                err_code;
-    ble_gap_conn_params_t   gap_conn_params;
-    ble_gap_conn_sec_mode_t sec_mode;
+    if (!m_adc_burst_radio_pending)
+    {
+        return;
+    }
 
-    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&sec_mode);
+    if (radio_active)
+    {
+        if (!m_adc_burst_hfclk_requested)
+        {
+            m_adc_burst_hfclk_requested = true;
+            APP_ERROR_CHECK(sd_clock_hfclk_request());
+        }
+    }
+    else if (m_adc_burst_hfclk_requested && adc_burst_pending_take())
+    {
+        adc_burst_start(ADC_BURST_RADIO_ALIGNED);
+    }
+}
 
-    err_code = sd_ble_gap_device_name_set(&sec_mode,
-                                          (const uint8_t *)DEVICE_NAME,
+
+/**@brief Function for starting a burst that waited too long for a radio event, called on every sensor pipeline tick.
+ */
+static void adc_burst_timeout_check(void)
+{
+    if (m_adc_burst_radio_pending && (++m_adc_burst_wait_ticks >= RADIO_AWARE_MAX_WAIT_TICKS) && adc_burst_pending_take())
+    {
+        adc_burst_start(ADC_BURST_IMMEDIATE);
+    }
+}
+
+
+/**@brief Function for adding a converted burst to the statistics of its mode and logging them.
+ */
+static void adc_burst_stats_update(nrf_adc_value_t const * p_buffer, uint16_t size)
+{
+    nrf_adc_value_t    min = p_buffer[0];
+    nrf_adc_value_t    max = p_buffer[0];
+    adc_burst_stats_t * p_stats = &m_adc_burst_stats[m_adc_burst_mode];
+
+    for (uint32_t i = 1; i < size; i++)
+    {
+        min = MIN(min, p_buffer[i]);
+        max = MAX(max, p_buffer[i]);
+    }
+    p_stats->bursts++;
+    p_stats->spread_sum      += max - min;
+    p_stats->hfxo_starts     += m_adc_burst_hfxo_started ? 1 : 0;
+    p_stats->hfxo_wait_ticks += m_adc_burst_hfxo_wait;
+
+    for (uint32_t mode = 0; mode < ADC_BURST_MODE_COUNT; mode++)
+    {
+        uint32_t bursts       = MAX(m_adc_burst_stats[mode].bursts, 1);
+        uint32_t spread_centi = (m_adc_burst_stats[mode].spread_sum * 100) / bursts;
+        uint32_t wait_us      = (uint32_t)(((uint64_t)m_adc_burst_stats[mode].hfxo_wait_ticks * 1000000) / (32768 * bursts));
+
+        NRF_LOG_INFO(m_adc_burst_stats_formats[mode], m_adc_burst_stats[mode].bursts, spread_centi / 100, spread_centi % 100, m_adc_burst_stats[mode].hfxo_starts);
+        NRF_LOG_INFO("  crystal wait %d us per burst, %d nC\r\n", wait_us, (wait_us * RADIO_AWARE_WAIT_CURRENT_UA) / 1000);
+    }
+}
+
+
+/**@brief Function for initializing the SoftDevice radio notifications.
+ */
+static void radio_notification_init(void)
+{
+    uint32_t err_code;
+
+    err_code = ble_radio_notification_init(APP_IRQ_PRIORITY_LOW,
+                                           NRF_RADIO_NOTIFICATION_DISTANCE_800US,
+                                           radio_notification_evt_handler);
+    APP_ERROR_CHECK(err_code);
+}
+#endif
+
+
+/**@brief Function for performing battery measurement and updating the Battery Level characteristic
+ *        in Battery Service.
+ */
+static void battery_level_update(void)
+{	
+    NRF_LOG_INFO("\r\n    Triggering battery level update...\r\n");          //Indicate on UART that Button 4 is pressed
+#if (HEART_RATE_ADC_FRONT_END_ENABLED == 1)
+    m_battery_meas_pending = true;                                     //The ADC is busy with PPG samples, measure the battery in between two PPG buffers in adc_event_handler
+#elif (RADIO_AWARE_SAMPLING_ENABLED == 1)
+    static bool ab_toggle = false;
+
+    ab_toggle = RADIO_AWARE_AB_TEST_ENABLED ? !ab_toggle : true;
+    if (!ab_toggle)
+    {
+        adc_burst_start(ADC_BURST_IMMEDIATE);                          //Reference burst for the comparison
+        return;
+    }
+    m_adc_burst_wait_ticks    = 0;
+    m_adc_burst_radio_pending = true;                                  //Started by radio_notification_evt_handler after the next radio event
+#else
+    app_evt_t evt;
+
+    evt.type = APP_EVT_BATTERY_MEAS;                                   //Put battery measurement event into the scheduler queue, adc_sample will then be executed in the main context when app_sched_execute is called in the main loop
+    battery_evt_put(&evt);
+#endif
+}
+
+
+/**@brief Function for scheduling the next battery level measurement.
+ *
+ * @param[in] interval  Time until the next measurement (seconds).
+ */
+static void battery_meas_schedule(uint32_t interval)
+{
+    m_battery_meas_interval  = interval;
+    m_battery_meas_remaining = interval * 1000 / SENSOR_PIPELINE_INTERVAL_MS;
+}
+
+
+/**@brief Function for adapting the battery level measurement interval to the last measurement.
+ *
+ * @details The interval is doubled for every measurement where the battery voltage is stable and
+ *          the reported battery level is unchanged, up to BATTERY_LEVEL_MEAS_INTERVAL_MAX. It falls
+ *          back to BATTERY_LEVEL_MEAS_INTERVAL_MIN as soon as either of them changes.
+ *
+ * @param[in] battery_level  Battery level of the last measurement.
+ */
+static void battery_meas_interval_adapt(uint8_t battery_level)
+{
+    uint32_t interval;
+
+    if (m_battery_voltage_changing || (battery_level != m_battery_level_last))
+    {
+        interval = BATTERY_LEVEL_MEAS_INTERVAL_MIN;
+    }
+    else
+    {
+        interval = MIN(m_battery_meas_interval * 2, BATTERY_LEVEL_MEAS_INTERVAL_MAX);
+    }
+    m_battery_level_last = battery_level;
+
+    NRF_LOG_INFO("Next battery measurement in %d s\r\n", interval);
+    battery_meas_schedule(interval);
+}
+
+
+/**@brief Function for queuing an RR interval in the RR interval ring.
+ *
+ * @param[in] rr_interval  RR interval (1/1024 seconds).
+ */
+static void rr_interval_push(uint16_t rr_interval)
+{
+    CRITICAL_REGION_ENTER();                                               //The ring is filled from the main loop and flushed from the pipeline timer when the PPG front end is used
+    if (m_rr_ring_count == RR_INTERVAL_RING_SIZE)
+    {
+        m_rr_ring_tail = (m_rr_ring_tail + 1) & (RR_INTERVAL_RING_SIZE - 1);   //Ring full, drop the oldest interval
+        m_rr_ring_count--;
+    }
+    m_rr_ring[(m_rr_ring_tail + m_rr_ring_count) & (RR_INTERVAL_RING_SIZE - 1)] = rr_interval;
+    m_rr_ring_count++;
+    CRITICAL_REGION_EXIT();
+}
+
+
+#if (HEART_RATE_ADC_FRONT_END_ENABLED == 1) || (REPLAY_TEST_ENABLED == 1)
+/**@brief Function for resetting the PPG heart beat detector.
+ *
+ * @param[out] p_detector  Detector state.
+ */
+static void ppg_detector_reset(ppg_detector_t * p_detector)
+{
+    memset(p_detector, 0, sizeof(ppg_detector_t));
+}
+
+/**@brief Function for processing one PPG sample.
+ *
+ * @details The sample is band-pass filtered by subtracting the tracked baseline and smoothing the
+ *          result. A heart beat is detected when the filtered signal rises above half of its
+ *          decaying peak envelope, at least PPG_REFRACTORY_SAMPLES after the previous beat. The
+ *          time between two beats is output as RR interval.
+ *
+ * @param[in,out] p_detector     Detector state.
+ * @param[in]     sample         ADC value of the PPG sample.
+ * @param[out]    p_rr_interval  RR interval ending at this sample (1/1024 seconds).
+ *
+ * @return True if a heart beat was detected and an RR interval output. A beat more than
+ *         PPG_MAX_BEAT_SAMPLES after the previous one gives no RR interval.
+ */
+static bool ppg_sample_process(ppg_detector_t * p_detector, nrf_adc_value_t sample, uint16_t * p_rr_interval)
+{
+    int32_t  input = (int32_t)sample << PPG_FRACTION_BITS;
+    uint32_t samples_since_beat;
+    bool     above_threshold;
+    bool     rr_interval_valid = false;
+
+    //Band-pass filter: first order high-pass followed by first order low-pass
+    p_detector->baseline += (input - p_detector->baseline) >> PPG_HIGHPASS_SHIFT;
+    p_detector->filtered += ((input - p_detector->baseline) - p_detector->filtered) >> PPG_LOWPASS_SHIFT;
+
+    //Adaptive beat detection threshold at half the pulse envelope
+    p_detector->envelope -= p_detector->envelope >> PPG_ENVELOPE_DECAY_SHIFT;
+    if (p_detector->filtered > p_detector->envelope)
+    {
+        p_detector->envelope = p_detector->filtered;
+    }
+    above_threshold = (p_detector->envelope > (PPG_MIN_AMPLITUDE << PPG_FRACTION_BITS)) &&
+                      (p_detector->filtered > (p_detector->envelope >> 1));
+
+    p_detector->sample_count++;
+    samples_since_beat = p_detector->sample_count - p_detector->last_beat;
+    if (above_threshold && !p_detector->above_threshold && (samples_since_beat > PPG_REFRACTORY_SAMPLES))
+    {
+        if (samples_since_beat <= PPG_MAX_BEAT_SAMPLES)
+        {
+            *p_rr_interval    = (uint16_t)((samples_since_beat * 1024) / PPG_SAMPLE_RATE_HZ);
+            rr_interval_valid = true;
+        }
+        p_detector->last_beat = p_detector->sample_count;
+    }
+    p_detector->above_threshold = above_threshold;
+
+    return rr_interval_valid;
+}
+#endif
+
+#if (HEART_RATE_ADC_FRONT_END_ENABLED == 0)
+/**@brief Function for acquiring the RR intervals of the heart beats within one pipeline tick.
+ *
+ * @details Simulated RR intervals are queued in the RR interval ring until they cover the time
+ *          of one tick. The part of the last interval reaching into the next tick is carried over.
+ */
+static void rr_interval_acquire(void)
+{
+    static uint32_t rr_interval_carry = 0;
+    uint16_t        rr_interval;
+
+    while (rr_interval_carry < SENSOR_PIPELINE_INTERVAL_1024THS)
+    {
+        rr_interval = (uint16_t)sensorsim_measure(&m_rr_interval_sim_state,
+                                                  &m_rr_interval_sim_cfg);
+        rr_interval_push(rr_interval);
+        rr_interval_carry += rr_interval;
+    }
+    rr_interval_carry -= SENSOR_PIPELINE_INTERVAL_1024THS;
+}
+#endif
+
+
+/**@brief Function for flushing the RR interval ring into the next Heart Rate Measurement.
+ *
+ * @return  Heart rate computed from the mean of the flushed RR intervals (beats per minute), or 0
+ *          if no heart beat was detected since the last flush.
+ */
+static uint16_t rr_interval_flush(void)
+{
+    uint32_t rr_interval_sum = 0;
+    uint32_t rr_interval_count;
+    uint16_t rr_interval;
+
+    CRITICAL_REGION_ENTER();
+    rr_interval_count = m_rr_ring_count;
+    while (m_rr_ring_count > 0)
+    {
+        rr_interval = m_rr_ring[m_rr_ring_tail];
+        m_rr_ring_tail = (m_rr_ring_tail + 1) & (RR_INTERVAL_RING_SIZE - 1);
+        m_rr_ring_count--;
+
+        rr_interval_sum += rr_interval;
+        if (m_rr_interval_enabled)
+        {
+            ble_hrs_rr_interval_add(&m_hrs, rr_interval);
+        }
+    }
+    CRITICAL_REGION_EXIT();
+
+    if (rr_interval_count == 0)
+    {
+        return 0;
+    }
+    return (uint16_t)((60 * 1024 * rr_interval_count) / rr_interval_sum);
+}
+
+
+/**@brief Function for toggling the simulated Sensor Contact Detected state.
+ *
+ * @details Called from the sensor pipeline every SENSOR_CONTACT_DETECTED_TICKS ticks.
+ */
+static void sensor_contact_detected_update(void)
+{
+    static bool sensor_contact_detected = false;
+
+    sensor_contact_detected = !sensor_contact_detected;
+    ble_hrs_sensor_contact_detected_update(&m_hrs, sensor_contact_detected);
+}
+
+
+#if (WAKEUP_STATS_ENABLED == 1)
+/**@brief Function for logging the number of CPU wakeups per second since the last report.
+ *
+ * @details Wakeups are returns from sd_app_evt_wait, caused by the app_timer, the SoftDevice
+ *          (radio events), the ADC or the log. Timer wakeups are the ones a separate timer per
+ *          sensor would multiply.
+ */
+static void wakeup_stats_report(void)
+{
+    uint32_t interval_ms = WAKEUP_STATS_INTERVAL_TICKS * SENSOR_PIPELINE_INTERVAL_MS;
+    uint32_t total_centi = (m_wakeup_count * 100000) / interval_ms;
+    uint32_t timer_centi = (m_wakeup_timer_count * 100000) / interval_ms;
+
+    NRF_LOG_INFO("Wakeups per second: %d.%02d, of which app_timer: %d.%02d\r\n",
+                 total_centi / 100, total_centi % 100, timer_centi / 100, timer_centi % 100);
+    m_wakeup_count       = 0;
+    m_wakeup_timer_count = 0;
+}
+#endif
+
+
+/**@brief Function for handling the sensor pipeline timer timeout.
+ *
+ * @details This function will be called each time the sensor pipeline timer expires. One tick
+ *          serves all sensors: the RR intervals of the past tick are acquired and sent together
+ *          with the heart rate computed from them, the sensor contact is toggled every
+ *          SENSOR_CONTACT_DETECTED_TICKS, and the battery level is measured when its
+ *          measurement interval has elapsed. RR Interval data is excluded from every third
+ *          Heart Rate Measurement.
+ *
+ * @param[in] p_context  Pointer used for passing some arbitrary information (context) from the
+ *                       app_start_timer() call to the timeout handler.
+ */
+static void sensor_pipeline_timeout_handler(void * p_context)
+{
+    static uint32_t cnt = 0;
+    static uint16_t heart_rate = 0;
+    uint32_t        err_code;
+    uint16_t        heart_rate_new;
+
+    UNUSED_PARAMETER(p_context);
+
+    // Battery level, measured by the ADC every few ticks only.
+    if ((m_battery_meas_remaining > 0) && (--m_battery_meas_remaining == 0))
+    {
+        battery_level_update();
+    }
+#if (RADIO_AWARE_SAMPLING_ENABLED == 1)
+    adc_burst_timeout_check();
+#endif
+
+    // RR intervals and heart rate, batched into one notification.
+#if (HEART_RATE_ADC_FRONT_END_ENABLED == 0)
+    rr_interval_acquire();
+#endif
+    heart_rate_new = rr_interval_flush();
+    if (heart_rate_new != 0)
+    {
+        heart_rate = heart_rate_new;                                       //Keep reporting the last heart rate when no beat was detected in this tick
+    }
+
+    cnt++;
+    err_code = ble_hrs_heart_rate_measurement_send(&m_hrs, heart_rate);
+    if ((err_code != NRF_SUCCESS) &&
+        (err_code != NRF_ERROR_INVALID_STATE) &&
+        (err_code != BLE_ERROR_NO_TX_PACKETS) &&
+        (err_code != BLE_ERROR_GATTS_SYS_ATTR_MISSING)
+       )
+    {
+        APP_ERROR_HANDLER(err_code);
+    }
+
+    // Sensor contact, toggled on a whole number of ticks instead of an own timer.
+    if ((cnt % SENSOR_CONTACT_DETECTED_TICKS) == 0)
+    {
+        sensor_contact_detected_update();
+    }
+
+#if (WAKEUP_STATS_ENABLED == 1)
+    m_wakeup_timer_count++;
+    if ((cnt % WAKEUP_STATS_INTERVAL_TICKS) == 0)
+    {
+        wakeup_stats_report();
+    }
+#endif
+
+    // Disable RR Interval recording every third heart rate measurement.
+    // NOTE: An application will normally not do this. It is done here just for testing generation
+    // of messages without RR Interval measurements.
+    m_rr_interval_enabled = ((cnt % 3) != 0);
+}
+
+
+/**@brief Function for the Timer initialization.
+ *
+ * @details Initializes the timer module. This creates and starts application timers.
+ */
+static void timers_init(void)
+{
+    uint32_t err_code;
+
+    // Initialize timer module.
+    APP_TIMER_INIT(APP_TIMER_PRESCALER, APP_TIMER_OP_QUEUE_SIZE, false);
+
+    // Create timers.
+    err_code = app_timer_create(&m_sensor_pipeline_timer_id,
+                                APP_TIMER_MODE_REPEATED,
+                                sensor_pipeline_timeout_handler);
+    APP_ERROR_CHECK(err_code);
+}
+
+
+/**@brief Function for the GAP initialization.
+ *
+ * @details This function sets up all the necessary GAP (Generic Access Profile) parameters of the
+ *          device including the device name, appearance, and the preferred connection parameters.
+ */
+static void gap_params_init(void)
+{
+    uint32_t                err_code;
+    ble_gap_conn_params_t   gap_conn_params;
+    ble_gap_conn_sec_mode_t sec_mode;
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&sec_mode);
+
+    err_code = sd_ble_gap_device_name_set(&sec_mode,
+                                          (const uint8_t *)DEVICE_NAME,
                                           strlen(DEVICE_NAME));
     APP_ERROR_CHECK(err_code);
 
@@ -523,24 +1375,11 @@ static void services_init(void)
 }
 
 
+#if (HEART_RATE_ADC_FRONT_END_ENABLED == 0)
 /**@brief Function for initializing the sensor simulators.
  */
 static void sensor_simulator_init(void)
 {
-    m_battery_sim_cfg.min          = MIN_BATTERY_LEVEL;
-    m_battery_sim_cfg.max          = MAX_BATTERY_LEVEL;
-    m_battery_sim_cfg.incr         = BATTERY_LEVEL_INCREMENT;
-    m_battery_sim_cfg.start_at_max = true;
-
-    sensorsim_init(&m_battery_sim_state, &m_battery_sim_cfg);
-
-    m_heart_rate_sim_cfg.min          = MIN_HEART_RATE;
-    m_heart_rate_sim_cfg.max          = MAX_HEART_RATE;
-    m_heart_rate_sim_cfg.incr         = HEART_RATE_INCREMENT;
-    m_heart_rate_sim_cfg.start_at_max = false;
-
-    sensorsim_init(&m_heart_rate_sim_state, &m_heart_rate_sim_cfg);
-
     m_rr_interval_sim_cfg.min          = MIN_RR_INTERVAL;
     m_rr_interval_sim_cfg.max          = MAX_RR_INTERVAL;
     m_rr_interval_sim_cfg.incr         = RR_INTERVAL_INCREMENT;
@@ -548,6 +1387,7 @@ static void sensor_simulator_init(void)
 
     sensorsim_init(&m_rr_interval_sim_state, &m_rr_interval_sim_cfg);
 }
+#endif
 
 
 /**@brief Function for starting application timers.
@@ -557,16 +1397,9 @@ static void application_timers_start(void)
     uint32_t err_code;
 
     // Start application timers.
-    err_code = app_timer_start(m_battery_timer_id, BATTERY_LEVEL_MEAS_INTERVAL, NULL);
-    APP_ERROR_CHECK(err_code);
-
-    err_code = app_timer_start(m_heart_rate_timer_id, HEART_RATE_MEAS_INTERVAL, NULL);
-    APP_ERROR_CHECK(err_code);
-
-    err_code = app_timer_start(m_rr_interval_timer_id, RR_INTERVAL_INTERVAL, NULL);
-    APP_ERROR_CHECK(err_code);
+    battery_meas_schedule(BATTERY_LEVEL_MEAS_INTERVAL_MIN);
 
-    err_code = app_timer_start(m_sensor_contact_timer_id, SENSOR_CONTACT_DETECTED_INTERVAL, NULL);
+    err_code = app_timer_start(m_sensor_pipeline_timer_id, SENSOR_PIPELINE_INTERVAL, NULL);
     APP_ERROR_CHECK(err_code);
 }
 
@@ -689,6 +1522,7 @@ static void on_ble_evt(ble_evt_t * p_ble_evt)
             err_code = bsp_indication_set(BSP_INDICATE_CONNECTED);
             APP_ERROR_CHECK(err_code);
             m_conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+            battery_meas_schedule(BATTERY_LEVEL_MEAS_INTERVAL_MIN);   //Give the new peer an up to date battery level
             break; // BLE_GAP_EVT_CONNECTED
 
         case BLE_GAP_EVT_DISCONNECTED:
@@ -807,7 +1641,7 @@ static void ble_stack_init(void)
     nrf_clock_lf_cfg_t clock_lf_cfg = NRF_CLOCK_LFCLKSRC;
 
     // Initialize the SoftDevice handler module.
-    SOFTDEVICE_HANDLER_INIT(&clock_lf_cfg, NULL);
+    SOFTDEVICE_HANDLER_INIT(&clock_lf_cfg, softdevice_evt_schedule);       //SoftDevice events are processed in the main loop
 
     ble_enable_params_t ble_enable_params;
     err_code = softdevice_enable_get_default_config(NRF_BLE_CENTRAL_LINK_COUNT,
@@ -869,6 +1703,17 @@ void bsp_event_handler(bsp_event_t event)
             }
             break;
 
+#if (ADC_CALIBRATION_ENABLED == 1)
+        case BSP_EVENT_KEY_2:
+            if (m_adc_cal_point_count == 0)
+            {
+                NRF_LOG_INFO("Capturing calibration point at %d mV\r\n", ADC_CAL_POINT_LOW_MILLIVOLTS);
+            }
+            m_adc_cal_capture_pending = true;
+            battery_level_update();                                           //The next battery measurement is taken as calibration point
+            break;
+#endif
+
         default:
             break;
     }
@@ -885,6 +1730,9 @@ static void peer_manager_init(bool erase_bonds)
     ble_gap_sec_params_t sec_param;
     ret_code_t           err_code;
 
+    err_code = fds_register(fds_evt_handler);                                  //Registered before pm_init initializes FDS, to receive FDS_EVT_INIT
+    APP_ERROR_CHECK(err_code);
+
     err_code = pm_init();
     APP_ERROR_CHECK(err_code);
 
@@ -913,9 +1761,6 @@ static void peer_manager_init(bool erase_bonds)
 
     err_code = pm_register(pm_evt_handler);
     APP_ERROR_CHECK(err_code);
-
-    err_code = fds_register(fds_evt_handler);
-    APP_ERROR_CHECK(err_code);
 }
 
 
@@ -974,6 +1819,9 @@ static void power_manage(void)
     uint32_t err_code = sd_app_evt_wait();
 
     APP_ERROR_CHECK(err_code);
+#if (WAKEUP_STATS_ENABLED == 1)
+    m_wakeup_count++;
+#endif
 }
 
 /*GATT generic Event handler*/
@@ -991,46 +1839,302 @@ void gatt_init(void)
 }
 
 /**
- * @brief ADC interrupt handler.
+ * @brief Function for averaging ADC samples.
  */
-static void adc_event_handler(nrf_drv_adc_evt_t const * p_event)
+static nrf_adc_value_t adc_average_compute(nrf_adc_value_t const * p_buffer, uint16_t size)
+{
+    uint32_t sum = 0;
+
+    for (uint32_t i = 0; i < size; i++)
+    {
+        sum += p_buffer[i];
+    }
+    return sum / size;
+}
+
+#if (ADC_ROBUST_FILTER != ADC_ROBUST_FILTER_MEAN)
+STATIC_ASSERT(ADC_ROBUST_WINDOW <= ADC_BUFFER_SIZE);
+STATIC_ASSERT(2 * ADC_ROBUST_TRIM < ADC_ROBUST_WINDOW);
+
+/**@brief Sorting network for ADC_ROBUST_WINDOW values, as pairs of indexes to compare and exchange. */
+#if (ADC_ROBUST_WINDOW == 3)
+static const uint8_t m_robust_network[][2] = {{0, 2}, {0, 1}, {1, 2}};
+#elif (ADC_ROBUST_WINDOW == 5)
+static const uint8_t m_robust_network[][2] = {{0, 3}, {1, 4}, {0, 2}, {1, 3}, {0, 1}, {2, 4}, {1, 2}, {3, 4}, {2, 3}};
+#elif (ADC_ROBUST_WINDOW == 7)
+static const uint8_t m_robust_network[][2] = {{0, 6}, {2, 3}, {4, 5}, {0, 2}, {1, 4}, {3, 6}, {0, 1}, {2, 5},
+                                              {3, 4}, {1, 2}, {4, 6}, {2, 3}, {4, 5}, {1, 2}, {3, 4}, {5, 6}};
+#else
+#error "ADC_ROBUST_WINDOW must be 3, 5 or 7."
+#endif
+
+/**@brief Sliding window of the robust filter stage. */
+typedef struct
+{
+    nrf_adc_value_t window[ADC_ROBUST_WINDOW];                  /**< Last ADC_ROBUST_WINDOW samples, the oldest at index next. */
+    uint8_t         next;                                       /**< Index the next sample is written to. */
+    uint8_t         count;                                      /**< Number of samples in the window, up to ADC_ROBUST_WINDOW. */
+} robust_filter_t;
+
+/**@brief Function for sorting ADC_ROBUST_WINDOW values in place with the sorting network.
+ * The same compare-exchange steps are run for any input, so the time is constant.
+ */
+static void robust_sort(nrf_adc_value_t * p_values)
+{
+    for (uint32_t i = 0; i < ARRAY_SIZE(m_robust_network); i++)
+    {
+        nrf_adc_value_t a = p_values[m_robust_network[i][0]];
+        nrf_adc_value_t b = p_values[m_robust_network[i][1]];
+
+        p_values[m_robust_network[i][0]] = MIN(a, b);
+        p_values[m_robust_network[i][1]] = MAX(a, b);
+    }
+}
+
+/**@brief Function for emptying the window of a robust filter.
+ */
+static void robust_filter_reset(robust_filter_t * p_filter)
+{
+    p_filter->next  = 0;
+    p_filter->count = 0;
+}
+
+/**@brief Function for adding a sample to a robust filter.
+ *
+ * @details The output depends on ADC_ROBUST_FILTER:
+ *          - ADC_ROBUST_FILTER_MEDIAN: median of the window.
+ *          - ADC_ROBUST_FILTER_TRIMMED_MEAN: rounded mean of the window without its ADC_ROBUST_TRIM
+ *            lowest and highest samples.
+ *          - ADC_ROBUST_FILTER_HAMPEL: the middle sample of the window, replaced by the median when it
+ *            deviates from the median by more than ADC_HAMPEL_THRESHOLD_Q8 / 256 times the median
+ *            absolute deviation (MAD), and by more than ADC_HAMPEL_MIN_DEVIATION.
+ *          Each update sorts a copy of the window, twice for the Hampel filter, so it takes the same
+ *          time for every sample.
+ *
+ * @param[in]  p_filter  Filter.
+ * @param[in]  sample    New sample.
+ * @param[out] p_output  Filtered sample, only written once the window is full.
+ *
+ * @return True if p_output was written.
+ */
+static bool robust_filter_update(robust_filter_t * p_filter, nrf_adc_value_t sample, nrf_adc_value_t * p_output)
+{
+    nrf_adc_value_t sorted[ADC_ROBUST_WINDOW];
+
+    p_filter->window[p_filter->next] = sample;
+    p_filter->next                   = (p_filter->next + 1) % ADC_ROBUST_WINDOW;
+    if (p_filter->count < ADC_ROBUST_WINDOW)
+    {
+        if (++p_filter->count < ADC_ROBUST_WINDOW)
+        {
+            return false;
+        }
+    }
+
+    memcpy(sorted, p_filter->window, sizeof(sorted));
+    robust_sort(sorted);
+
+#if (ADC_ROBUST_FILTER == ADC_ROBUST_FILTER_MEDIAN)
+    *p_output = sorted[ADC_ROBUST_WINDOW / 2];
+#elif (ADC_ROBUST_FILTER == ADC_ROBUST_FILTER_TRIMMED_MEAN)
+    uint32_t sum = 0;
+
+    for (uint32_t i = ADC_ROBUST_TRIM; i < ADC_ROBUST_WINDOW - ADC_ROBUST_TRIM; i++)
+    {
+        sum += sorted[i];
+    }
+    *p_output = (sum + (ADC_ROBUST_WINDOW - 2 * ADC_ROBUST_TRIM) / 2) / (ADC_ROBUST_WINDOW - 2 * ADC_ROBUST_TRIM);
+#elif (ADC_ROBUST_FILTER == ADC_ROBUST_FILTER_HAMPEL)
+    nrf_adc_value_t median = sorted[ADC_ROBUST_WINDOW / 2];
+    nrf_adc_value_t middle = p_filter->window[(p_filter->next + ADC_ROBUST_WINDOW / 2) % ADC_ROBUST_WINDOW];
+    uint32_t        deviation;
+
+    for (uint32_t i = 0; i < ADC_ROBUST_WINDOW; i++)
+    {
+        sorted[i] = (sorted[i] > median) ? (sorted[i] - median) : (median - sorted[i]);
+    }
+    robust_sort(sorted);                                        //Absolute deviations, their median is the MAD
+    deviation = (middle > median) ? (middle - median) : (median - middle);
+    *p_output = ((deviation > ADC_HAMPEL_MIN_DEVIATION) && ((deviation << 8) > (uint32_t)sorted[ADC_ROBUST_WINDOW / 2] * ADC_HAMPEL_THRESHOLD_Q8)) ? median : middle;
+#endif
+    return true;
+}
+
+/**
+ * @brief Function for combining the samples of a battery burst with the robust filter stage.
+ * The burst is run through a robust filter, and the outputs of the full windows are averaged.
+ */
+static nrf_adc_value_t adc_robust_compute(nrf_adc_value_t const * p_buffer, uint16_t size)
+{
+    robust_filter_t filter;
+    nrf_adc_value_t filtered[ADC_BUFFER_SIZE];
+    uint16_t        count = 0;
+
+    robust_filter_reset(&filter);
+    for (uint32_t i = 0; i < size; i++)
+    {
+        if (robust_filter_update(&filter, p_buffer[i], &filtered[count]))
+        {
+            count++;
+        }
+    }
+    return adc_average_compute(filtered, count);
+}
+#endif
+
+/**
+ * @brief Function for transforming battery ADC samples into the battery level and sending it over BLE.
+ */
+static void battery_adc_result_process(nrf_adc_value_t const * p_buffer, uint16_t size)
 {
     uint32_t err_code;
-    uint16_t adc_sum_value = 0;
     uint16_t adc_average_value;
     uint16_t adc_result_millivolts;
     uint8_t  adc_result_percent;
+    uint32_t i;
 
-    sd_clock_hfclk_release();			//Release the external crystal
-	
     adc_event_counter++;
-    NRF_LOG_INFO("    ADC event counter: %d\r\n", adc_event_counter);
+    NRF_LOG_INFO("    ADC event counter: %u\r\n", adc_event_counter);
+    for (i = 0; i < size; i++)
+    {
+        NRF_LOG_INFO("Sample value %d: %d\r\n", i+1, p_buffer[i]);
+    }
+#if (RADIO_AWARE_SAMPLING_ENABLED == 1)
+    adc_burst_stats_update(p_buffer, size);                                        //Noise and crystal startup per burst mode
+#endif
+#if (ADC_ROBUST_FILTER == ADC_ROBUST_FILTER_MEAN)
+    adc_average_value = adc_average_compute(p_buffer, size);                       //Calculate average value from all samples in the ADC buffer
+    NRF_LOG_INFO("Average ADC value: %d\r\n", adc_average_value);
+#else
+    adc_average_value = adc_robust_compute(p_buffer, size);                        //Combine the samples in the ADC buffer, rejecting spikes
+    NRF_LOG_INFO("Filtered ADC value: %d, average %d\r\n", adc_average_value, adc_average_compute(p_buffer, size));
+#endif
+			
+#if (ADC_CALIBRATION_ENABLED == 1)
+    if (m_adc_cal_capture_pending)
+    {
+        m_adc_cal_capture_pending = false;
+        adc_cal_point_process(adc_average_value);                                  //Calibration supply voltage, not the battery
+        if (m_battery_meas_remaining == 0)
+        {
+            battery_meas_schedule(BATTERY_LEVEL_MEAS_INTERVAL_MIN);                //The capture took the burst of a scheduled measurement, keep measuring periodically
+        }
+        return;
+    }
+#endif
+
+    adc_result_millivolts = adc_cal_millivolts(ADC_CAL_CHANNEL_BATTERY, adc_average_value);  //Transform the average ADC value into calibrated millivolts
+    NRF_LOG_INFO("ADC result in millivolts: %d\r\n", adc_result_millivolts);
+			
+    adc_result_percent = battery_model_update(adc_result_millivolts);              //Transform the millivolts value into battery level percent.
+    NRF_LOG_INFO("Battery voltage: %d mV, %d percent\r\n", m_battery_voltage_filtered >> BATTERY_FILTER_FRACTION_BITS, adc_result_percent);
+			
+    //Send the battery level over BLE
+    err_code = ble_bas_battery_level_update(&m_bas, adc_result_percent);           //Send the battery level over BLE
+    if ((err_code != NRF_SUCCESS) &&
+        (err_code != NRF_ERROR_INVALID_STATE) &&                                   
+        (err_code != BLE_ERROR_NO_TX_PACKETS) &&                                   
+        (err_code != BLE_ERROR_GATTS_SYS_ATTR_MISSING))
+    {
+        APP_ERROR_HANDLER(err_code);                                               //Assert on error
+    }
+
+    battery_meas_interval_adapt(adc_result_percent);                              //Measure often while the battery level changes and rarely while it is stable
+}
+
+#if (HEART_RATE_ADC_FRONT_END_ENABLED == 1)
+/**
+ * @brief Function for measuring the battery in between two PPG buffers.
+ *
+ * @details The PPG sample clock is disconnected from the ADC while the supply voltage is converted
+ *          ADC_BUFFER_SIZE times, which takes well below one PPG sample period.
+ */
+static void battery_adc_sample_convert(void)
+{
+    ret_code_t err_code;
+
+    err_code = nrf_drv_ppi_channel_disable(m_ppg_ppi_channel);
+    APP_ERROR_CHECK(err_code);
+
+    for (uint32_t i = 0; i < ADC_BUFFER_SIZE; i++)
+    {
+        err_code = nrf_drv_adc_sample_convert(&m_battery_channel_config, &adc_buffer[i]);   //Blocking conversion of the supply voltage
+        APP_ERROR_CHECK(err_code);
+    }
+
+    err_code = nrf_drv_ppi_channel_enable(m_ppg_ppi_channel);
+    APP_ERROR_CHECK(err_code);
+}
+
+/**
+ * @brief Function for processing a filled PPG buffer in the main loop.
+ */
+static void ppg_buffer_process(nrf_adc_value_t const * p_buffer, uint16_t size)
+{
+    uint16_t rr_interval;
+
+    for (uint32_t i = 0; i < size; i++)
+    {
+        if (ppg_sample_process(&m_ppg_detector, p_buffer[i], &rr_interval))       //Filter the PPG samples and detect heart beats
+        {
+            rr_interval_push(rr_interval);
+        }
+    }
+    if (m_ppg_buffers_dropped != m_ppg_buffers_dropped_reported)
+    {
+        m_ppg_buffers_dropped_reported = m_ppg_buffers_dropped;
+        NRF_LOG_INFO("PPG buffers dropped: %u\r\n", m_ppg_buffers_dropped_reported);
+    }
+}
+#endif
+
+/**
+ * @brief ADC interrupt handler.
+ * A filled PPG buffer is handed over to the main loop and sampling continues into the other buffer. If
+ * the main loop still processes the other buffer, or the scheduler queue is full, the filled buffer is
+ * dropped and sampled into again.
+ */
+static void adc_event_handler(nrf_drv_adc_evt_t const * p_event)
+{
+    app_evt_t evt;
+
     if (p_event->type == NRF_DRV_ADC_EVT_DONE)
     {
-        uint32_t i;
-        for (i = 0; i < p_event->data.done.size; i++)
+#if (HEART_RATE_ADC_FRONT_END_ENABLED == 1)
+        evt.type                     = APP_EVT_PPG_ADC_DONE;                       //Process the PPG samples in the main loop
+        evt.params.adc_done.p_buffer = p_event->data.done.p_buffer;
+        evt.params.adc_done.size     = p_event->data.done.size;
+        evt.params.adc_done.index    = m_ppg_buffer_index;
+        if (!m_ppg_buffer_busy[m_ppg_buffer_index ^ 1] && (app_evt_put(&evt) == NRF_SUCCESS))
+        {
+            m_ppg_buffer_busy[m_ppg_buffer_index] = true;
+            m_ppg_buffer_index ^= 1;
+        }
+        else
         {
-            NRF_LOG_INFO("Sample value %d: %d\r\n", i+1, p_event->data.done.p_buffer[i]);
-            adc_sum_value += p_event->data.done.p_buffer[i];                           //Sum all values in ADC buffer
+            m_ppg_buffers_dropped++;
         }
-        adc_average_value = adc_sum_value / p_event->data.done.size;                   //Calculate average value from all samples in the ADC buffer
-        NRF_LOG_INFO("Average ADC value: %d\r\n", adc_average_value);
-				
-        adc_result_millivolts = ADC_RESULT_IN_MILLI_VOLTS(adc_average_value);          //Transform the average ADC value into millivolts value
-        NRF_LOG_INFO("ADC result in millivolts: %d\r\n", adc_result_millivolts);
-				
-        adc_result_percent = battery_level_in_percent(adc_result_millivolts);          //Transform the millivolts value into battery level percent.
-        NRF_LOG_INFO("ADC result in percent: %d\r\n", adc_result_percent);
-				
-        //Send the battery level over BLE
-        err_code = ble_bas_battery_level_update(&m_bas, adc_result_percent);           //Send the battery level over BLE
-        if ((err_code != NRF_SUCCESS) &&
-            (err_code != NRF_ERROR_INVALID_STATE) &&                                   
-            (err_code != BLE_ERROR_NO_TX_PACKETS) &&                                   
-            (err_code != BLE_ERROR_GATTS_SYS_ATTR_MISSING))
+
+        if (m_battery_meas_pending)
         {
-            APP_ERROR_HANDLER(err_code);                                               //Assert on error
+            m_battery_meas_pending = false;
+            battery_adc_sample_convert();
+
+            evt.type                     = APP_EVT_BATTERY_ADC_DONE;
+            evt.params.adc_done.p_buffer = adc_buffer;
+            evt.params.adc_done.size     = ADC_BUFFER_SIZE;
+            battery_evt_put(&evt);
         }
+
+        APP_ERROR_CHECK(nrf_drv_adc_buffer_convert(m_ppg_buffer[m_ppg_buffer_index], PPG_BUFFER_SIZE));   //Continue sampling the PPG signal into the other buffer
+#else
+        sd_clock_hfclk_release();			//Release the external crystal
+
+        evt.type                     = APP_EVT_BATTERY_ADC_DONE;                   //Process the battery samples in the main loop
+        evt.params.adc_done.p_buffer = p_event->data.done.p_buffer;
+        evt.params.adc_done.size     = p_event->data.done.size;
+        battery_evt_put(&evt);
+#endif
     }
 }
 
@@ -1041,17 +2145,66 @@ static void adc_config(void)
 {
     ret_code_t ret_code;
     nrf_drv_adc_config_t adc_config = NRF_DRV_ADC_DEFAULT_CONFIG;                                              //Get default ADC configuration
-    static nrf_drv_adc_channel_t adc_channel_config = NRF_DRV_ADC_DEFAULT_CHANNEL(NRF_ADC_CONFIG_INPUT_2);     //Get default ADC channel configuration
 	
-    //Uncomment the following two lines to sample the supply voltage of the nRF51 directly (not from a pin)
-    //adc_channel_config.config.config.input = NRF_ADC_CONFIG_SCALING_SUPPLY_ONE_THIRD;
-    //adc_channel_config.config.config.ain = NRF_ADC_CONFIG_INPUT_DISABLED;
+    //Sample the supply voltage (VDD/3) of the nRF51 directly, not from a pin
+    m_battery_channel_config.config.config.input = NRF_ADC_CONFIG_SCALING_SUPPLY_ONE_THIRD;
 	
     ret_code = nrf_drv_adc_init(&adc_config, adc_event_handler);              //Initialize the ADC
     APP_ERROR_CHECK(ret_code);
 
-    nrf_drv_adc_channel_enable(&adc_channel_config);                          //Configure and enable an ADC channel
+#if (HEART_RATE_ADC_FRONT_END_ENABLED == 1)
+    //Only the PPG input is scanned, the supply voltage is converted on request with nrf_drv_adc_sample_convert
+    static nrf_drv_adc_channel_t ppg_channel_config = NRF_DRV_ADC_DEFAULT_CHANNEL(PPG_ADC_INPUT);
+    ppg_channel_config.config.config.input = NRF_ADC_CONFIG_SCALING_INPUT_ONE_THIRD;
+    nrf_drv_adc_channel_enable(&ppg_channel_config);
+#else
+    nrf_drv_adc_channel_enable(&m_battery_channel_config);                    //Configure and enable an ADC channel
+#endif
+}
+
+#if (HEART_RATE_ADC_FRONT_END_ENABLED == 1)
+/**
+ * @brief PPG timer event handler. Not used, the compare event is routed to the ADC through PPI.
+ */
+static void ppg_timer_handler(nrf_timer_event_t event_type, void * p_context)
+{
 }
+
+/**
+ * @brief Function for starting PPG sampling at PPG_SAMPLE_RATE_HZ, with TIMER2 compare events starting ADC conversions through PPI.
+ */
+static void ppg_sampling_start(void)
+{
+    ret_code_t err_code;
+
+    ppg_detector_reset(&m_ppg_detector);
+
+    err_code = nrf_drv_ppi_init();
+    APP_ERROR_CHECK(err_code);
+
+    nrf_drv_timer_config_t timer_config = NRF_DRV_TIMER_DEFAULT_CONFIG;
+    timer_config.frequency = NRF_TIMER_FREQ_31250Hz;
+    err_code = nrf_drv_timer_init(&m_ppg_timer, &timer_config, ppg_timer_handler);
+    APP_ERROR_CHECK(err_code);
+
+    /* setup m_ppg_timer for compare event, without interrupt */
+    nrf_drv_timer_extended_compare(&m_ppg_timer, NRF_TIMER_CC_CHANNEL0, PPG_TIMER_TICKS, NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK, false);
+
+    /* setup ppi channel so that timer compare event is triggering sample task in ADC */
+    err_code = nrf_drv_ppi_channel_alloc(&m_ppg_ppi_channel);
+    APP_ERROR_CHECK(err_code);
+    err_code = nrf_drv_ppi_channel_assign(m_ppg_ppi_channel,
+                                          nrf_drv_timer_compare_event_address_get(&m_ppg_timer, NRF_TIMER_CC_CHANNEL0),
+                                          nrf_drv_adc_start_task_get());
+    APP_ERROR_CHECK(err_code);
+    err_code = nrf_drv_ppi_channel_enable(m_ppg_ppi_channel);
+    APP_ERROR_CHECK(err_code);
+
+    APP_ERROR_CHECK(nrf_drv_adc_buffer_convert(m_ppg_buffer[m_ppg_buffer_index], PPG_BUFFER_SIZE));
+    nrf_drv_timer_enable(&m_ppg_timer);
+}
+#endif
+
 /**
  * @brief Function to trigger ADC sampling
  */
@@ -1063,11 +2216,26 @@ void adc_sample(void)
     ret_code = nrf_drv_adc_buffer_convert(adc_buffer, ADC_BUFFER_SIZE);       // Allocate buffer for ADC
     APP_ERROR_CHECK(ret_code);
 	
+#if (RADIO_AWARE_SAMPLING_ENABLED == 1)
+    uint32_t wait_start;
+    uint32_t wait_end;
+
+    sd_clock_hfclk_is_running(&p_is_running);
+    m_adc_burst_hfxo_started = !p_is_running;                          //Not running when the burst is not radio-aligned, or the crystal was released already
+    APP_ERROR_CHECK(app_timer_cnt_get(&wait_start));
+#endif
+
     //Request the external high frequency crystal for best ADC accuracy. For lowest current consumption, don't request the crystal.
     sd_clock_hfclk_request();
     while(! p_is_running) {          //wait for the hfclk to be available
         sd_clock_hfclk_is_running((&p_is_running));
     }  
+
+#if (RADIO_AWARE_SAMPLING_ENABLED == 1)
+    APP_ERROR_CHECK(app_timer_cnt_get(&wait_end));
+    APP_ERROR_CHECK(app_timer_cnt_diff_compute(wait_end, wait_start, &m_adc_burst_hfxo_wait));
+    m_adc_burst_hfclk_requested = false;                               //Released in adc_event_handler when the burst is converted
+#endif
 	
     for (uint32_t i = 0; i < ADC_BUFFER_SIZE; i++)
     {
@@ -1077,6 +2245,346 @@ void adc_sample(void)
     }					
 }
 
+/**@brief Function for processing application events in the main loop.
+ *
+ * @details An event of low priority is put back at the end of the scheduler queue while events of
+ *          high priority are pending, unless the queue is full.
+ */
+static void app_evt_handler(void * p_event_data, uint16_t event_size)
+{
+    app_evt_t const  * p_evt    = (app_evt_t const *)p_event_data;
+    app_evt_priority_t priority = app_evt_priority_get(p_evt->type);
+
+    UNUSED_PARAMETER(event_size);
+
+    if ((priority == APP_EVT_PRIORITY_LOW) && (m_app_evt_pending[APP_EVT_PRIORITY_HIGH] > 0))
+    {
+        if (app_sched_event_put(p_evt, sizeof(app_evt_t), app_evt_handler) == NRF_SUCCESS)
+        {
+            return;                                                         //Deferred, still counted as pending
+        }
+    }
+
+    CRITICAL_REGION_ENTER();
+    m_app_evt_pending[priority]--;
+    CRITICAL_REGION_EXIT();
+
+    switch (p_evt->type)
+    {
+        case APP_EVT_BLE:
+            m_softdevice_evt_scheduled = false;
+            intern_softdevice_events_execute();                             //Pull and dispatch all pending SoftDevice events
+            break;
+
+#if (HEART_RATE_ADC_FRONT_END_ENABLED == 1)
+        case APP_EVT_PPG_ADC_DONE:
+            ppg_buffer_process(p_evt->params.adc_done.p_buffer, p_evt->params.adc_done.size);
+            m_ppg_buffer_busy[p_evt->params.adc_done.index] = false;
+            break;
+#endif
+
+        case APP_EVT_BATTERY_MEAS:
+            adc_sample();
+            break;
+
+        case APP_EVT_BATTERY_ADC_DONE:
+            battery_adc_result_process(p_evt->params.adc_done.p_buffer, p_evt->params.adc_done.size);
+            break;
+
+        default:
+            break;
+    }
+
+    if (m_app_evt_queue_max != m_app_evt_queue_max_reported)
+    {
+        m_app_evt_queue_max_reported = m_app_evt_queue_max;
+        NRF_LOG_INFO("Scheduler queue high-water mark: %d of %d events\r\n", m_app_evt_queue_max_reported, APP_SCHED_QUEUE_SIZE);
+    }
+    if (m_app_evt_dropped != m_app_evt_dropped_reported)
+    {
+        m_app_evt_dropped_reported = m_app_evt_dropped;
+        NRF_LOG_INFO("Events dropped, scheduler queue full: %u\r\n", m_app_evt_dropped_reported);
+    }
+}
+
+#if (REPLAY_TEST_ENABLED == 1)
+static const uint8_t m_replay_ppg_rr[]    = {100, 92, 110, 84, 120, 96, 104, 88, 116, 100, 75, 140};   /**< RR intervals of the synthetic PPG trace, 54 to 100 bpm (samples). */
+static const uint8_t m_replay_ppg_pulse[] = {0, 3, 9, 17, 26, 33, 38, 40, 39, 36, 32, 28, 25, 23, 22, 21,
+                                             19, 17, 15, 13, 11, 9, 7, 6, 5, 4, 3, 2, 2, 1, 1, 0};      /**< Pulse added to the synthetic PPG trace at every beat (ADC codes). */
+
+/**@brief Function for starting TIMER1 as CPU cycle counter. At 16 MHz, one tick is one CPU cycle.
+ */
+static void replay_cycles_start(void)
+{
+    NRF_TIMER1->MODE        = TIMER_MODE_MODE_Timer;
+    NRF_TIMER1->BITMODE     = TIMER_BITMODE_BITMODE_32Bit;
+    NRF_TIMER1->PRESCALER   = 0;
+    NRF_TIMER1->TASKS_CLEAR = 1;
+    NRF_TIMER1->TASKS_START = 1;
+}
+
+/**@brief Function for stopping the CPU cycle counter.
+ *
+ * @return CPU cycles since replay_cycles_start.
+ */
+static uint32_t replay_cycles_stop(void)
+{
+    NRF_TIMER1->TASKS_CAPTURE[0] = 1;
+    NRF_TIMER1->TASKS_STOP       = 1;
+    return NRF_TIMER1->CC[0];
+}
+
+/**@brief Function for replaying a synthetic PPG trace through the heart beat detector.
+ *
+ * @details The trace is a pulse shape at known beats on a wandering baseline with noise, handed to
+ *          the detector in buffers of PPG_BUFFER_SIZE like the ADC fills them. A detected beat
+ *          within REPLAY_PPG_MATCH_SAMPLES after a synthesized one is a hit, any other one is a
+ *          false beat. The RR intervals output are compared to the synthesized ones. Each buffer is
+ *          processed once more on a copy of the detector while counting CPU cycles.
+ *
+ * @return True if every beat was detected, no false beat was detected, and no RR interval deviated
+ *         more than REPLAY_PPG_MAX_RR_ERROR_MS.
+ */
+static bool replay_ppg_run(void)
+{
+    ppg_detector_t  detector;
+    ppg_detector_t  timed;
+    nrf_adc_value_t buffer[PPG_BUFFER_SIZE];
+    uint32_t        beat_mask;
+    uint32_t        seed            = 12345;
+    uint32_t        beats           = 0;
+    uint32_t        next_beat       = REPLAY_PPG_LEAD_IN_SAMPLES;
+    uint32_t        pulse_index     = ARRAY_SIZE(m_replay_ppg_pulse);
+    uint32_t        beat_at         = 0;
+    uint32_t        beat_before     = 0;
+    bool            beat_hit        = true;
+    bool            beat_before_hit = false;
+    uint32_t        hits            = 0;
+    uint32_t        false_beats     = 0;
+    uint32_t        rr_checked      = 0;
+    uint32_t        rr_error_max    = 0;
+    uint32_t        cycles_total    = 0;
+    uint32_t        cycles_max      = 0;
+    uint32_t        samples         = REPLAY_PPG_LEAD_IN_SAMPLES + ARRAY_SIZE(m_replay_ppg_pulse);
+
+    STATIC_ASSERT(PPG_BUFFER_SIZE <= 32);                                        //One bit of beat_mask per sample
+
+    for (uint32_t k = 0; k < ARRAY_SIZE(m_replay_ppg_rr); k++)
+    {
+        samples += REPLAY_PPG_REPEAT * m_replay_ppg_rr[k];
+    }
+    samples = ((samples + PPG_BUFFER_SIZE - 1) / PPG_BUFFER_SIZE) * PPG_BUFFER_SIZE;   //Whole buffers only
+    ppg_detector_reset(&detector);
+
+    for (uint32_t start = 0; start < samples; start += PPG_BUFFER_SIZE)
+    {
+        uint32_t cycles;
+        uint16_t rr_interval;
+
+        //Synthesize the next buffer: baseline, triangle wander of +-20 codes with 8 s period, noise of +-2 codes, and the pulses
+        beat_mask = 0;
+        for (uint32_t j = 0; j < PPG_BUFFER_SIZE; j++)
+        {
+            uint32_t sample = start + j;
+            uint32_t phase  = sample % 1000;
+            int32_t  wander = (int32_t)((((phase < 500) ? phase : (1000 - phase)) * 40) / 500) - 20;
+
+            if ((sample == next_beat) && (beats < REPLAY_PPG_REPEAT * ARRAY_SIZE(m_replay_ppg_rr)))
+            {
+                next_beat  += m_replay_ppg_rr[beats % ARRAY_SIZE(m_replay_ppg_rr)];
+                pulse_index = 0;
+                beat_mask  |= 1UL << j;
+                beats++;
+            }
+            seed      = seed * 1103515245 + 12345;
+            buffer[j] = (nrf_adc_value_t)(500 + wander + (int32_t)((seed >> 16) % 5) - 2);
+            if (pulse_index < ARRAY_SIZE(m_replay_ppg_pulse))
+            {
+                buffer[j] += m_replay_ppg_pulse[pulse_index++];
+            }
+        }
+
+        //Time the detector on a copy, the way the main loop processes a buffer
+        timed = detector;
+        replay_cycles_start();
+        for (uint32_t j = 0; j < PPG_BUFFER_SIZE; j++)
+        {
+            (void)ppg_sample_process(&timed, buffer[j], &rr_interval);
+        }
+        cycles        = replay_cycles_stop();
+        cycles_total += cycles;
+        cycles_max    = MAX(cycles_max, cycles);
+
+        //Match the detected beats and RR intervals to the synthesized ones
+        for (uint32_t j = 0; j < PPG_BUFFER_SIZE; j++)
+        {
+            uint32_t sample   = start + j;
+            bool     rr_valid = ppg_sample_process(&detector, buffer[j], &rr_interval);
+
+            if (beat_mask & (1UL << j))
+            {
+                beat_before     = beat_at;
+                beat_before_hit = beat_hit;
+                beat_at         = sample;
+                beat_hit        = false;
+            }
+            if (detector.last_beat != detector.sample_count)
+            {
+                continue;                                                        //No beat detected at this sample
+            }
+            if (!beat_hit && (sample - beat_at < REPLAY_PPG_MATCH_SAMPLES))
+            {
+                hits++;
+                beat_hit = true;
+                if (rr_valid && beat_before_hit)
+                {
+                    uint32_t expected = ((beat_at - beat_before) * 1024) / PPG_SAMPLE_RATE_HZ;
+                    uint32_t error    = (rr_interval > expected) ? (rr_interval - expected) : (expected - rr_interval);
+
+                    rr_error_max = MAX(rr_error_max, (error * 1000) / 1024);
+                    rr_checked++;
+                }
+            }
+            else
+            {
+                false_beats++;
+            }
+        }
+    }
+
+    NRF_LOG_INFO("PPG replay: %u beats, %u detected, %u false, %u RR intervals checked\r\n", beats, hits, false_beats, rr_checked);
+    NRF_LOG_INFO("PPG replay: RR error max %u ms, %u cycles per sample, %u cycles per buffer max\r\n", rr_error_max, cycles_total / samples, cycles_max);
+
+    return (hits == beats) && (false_beats == 0) && (rr_error_max <= REPLAY_PPG_MAX_RR_ERROR_MS);
+}
+
+#if (BATTERY_CHEMISTRY == BATTERY_CHEMISTRY_CR2032)
+/**@brief Golden trace of a CR2032 discharging from about 2.97 V to 2.75 V under load, with spikes
+ *        of the radio. The expected results hold at the default BATTERY_MEAS_LOAD_MICROAMPS and
+ *        BATTERY_FILTER_* settings. */
+static const replay_battery_burst_t m_replay_battery_trace[] =
+{
+    {{845, 846, 845, 844, 845, 846}, 845, 845, 2974, 100},
+    {{842, 843, 877, 842, 841, 843}, 842, 848, 2984, 100},
+    {{838, 839, 806, 838, 839, 840}, 839, 833, 2931, 100},
+    {{830, 868, 829, 830, 862, 829}, 830, 841, 2960, 100},
+    {{820, 821, 819, 820, 821, 820}, 820, 820, 2886, 87},
+    {{805, 806, 804, 845, 805, 806}, 805, 811, 2854, 68},
+    {{790, 791, 789, 790, 791, 790}, 790, 790, 2780, 40},
+    {{780, 781, 779, 780, 740, 780}, 780, 773, 2720, 32},
+};
+#endif
+
+/**@brief Function for replaying the golden battery trace through the battery processing.
+ *
+ * @details Every burst is averaged, converted into millivolts and run through the battery model,
+ *          and the results are compared exactly with the golden ones. The battery model is reset
+ *          afterwards, so the live measurements start from scratch.
+ *
+ * @return True if all results match.
+ */
+static bool replay_battery_run(void)
+{
+#if (BATTERY_CHEMISTRY == BATTERY_CHEMISTRY_CR2032)
+    uint32_t mismatches = 0;
+
+    for (uint32_t i = 0; i < ARRAY_SIZE(m_replay_battery_trace); i++)
+    {
+        replay_battery_burst_t const * p_burst = &m_replay_battery_trace[i];
+        nrf_adc_value_t                average;
+        uint16_t                       millivolts;
+        uint8_t                        percent;
+
+        average    = adc_average_compute(p_burst->samples, ADC_BUFFER_SIZE);
+        millivolts = adc_cal_millivolts(ADC_CAL_CHANNEL_BATTERY, average);
+        percent    = battery_model_update(millivolts);
+        if ((average != p_burst->average) || (millivolts != p_burst->millivolts) || (percent != p_burst->percent))
+        {
+            NRF_LOG_WARNING("Battery replay burst %u: %d, %d mV, %d percent\r\n", i, average, millivolts, percent);
+            NRF_LOG_WARNING("  expected %d, %d mV, %d percent\r\n", p_burst->average, p_burst->millivolts, p_burst->percent);
+            NRF_LOG_FLUSH();
+            mismatches++;
+        }
+    }
+    m_battery_voltage_filtered = 0;                                              //Initial state of the battery model
+    m_battery_voltage_changing = true;
+
+    NRF_LOG_INFO("Battery replay: %u bursts, %u mismatches\r\n", (uint32_t)ARRAY_SIZE(m_replay_battery_trace), mismatches);
+    return (mismatches == 0);
+#else
+    NRF_LOG_INFO("Battery replay skipped, the golden trace is for BATTERY_CHEMISTRY_CR2032\r\n");
+    return true;
+#endif
+}
+
+/**@brief Function for replaying the battery bursts through the robust filter stage and the average.
+ *
+ * @details The robust filter stage must come within REPLAY_ROBUST_MAX_ERROR of the level of every
+ *          burst without its spikes. The largest deviation of both and the CPU cycles per sample of
+ *          both are logged, so the filter stage can be compared with the plain average.
+ *
+ * @return True if the robust filter stage came close enough to the level of every burst.
+ */
+static bool replay_robust_run(void)
+{
+#if (BATTERY_CHEMISTRY == BATTERY_CHEMISTRY_CR2032) && (ADC_ROBUST_FILTER != ADC_ROBUST_FILTER_MEAN)
+    uint32_t average_cycles    = 0;
+    uint32_t robust_cycles     = 0;
+    uint32_t average_error_max = 0;
+    uint32_t robust_error_max  = 0;
+    uint32_t samples           = ARRAY_SIZE(m_replay_battery_trace) * ADC_BUFFER_SIZE;
+
+    for (uint32_t i = 0; i < ARRAY_SIZE(m_replay_battery_trace); i++)
+    {
+        replay_battery_burst_t const * p_burst = &m_replay_battery_trace[i];
+        int32_t                        average;
+        int32_t                        robust;
+
+        replay_cycles_start();
+        average         = adc_average_compute(p_burst->samples, ADC_BUFFER_SIZE);
+        average_cycles += replay_cycles_stop();
+
+        replay_cycles_start();
+        robust          = adc_robust_compute(p_burst->samples, ADC_BUFFER_SIZE);
+        robust_cycles  += replay_cycles_stop();
+
+        average_error_max = MAX(average_error_max, (uint32_t)((average > p_burst->level) ? (average - p_burst->level) : (p_burst->level - average)));
+        robust_error_max  = MAX(robust_error_max, (uint32_t)((robust > p_burst->level) ? (robust - p_burst->level) : (p_burst->level - robust)));
+    }
+
+    NRF_LOG_INFO("Robust replay: error max %u, average error max %u (ADC codes)\r\n", robust_error_max, average_error_max);
+    NRF_LOG_INFO("Robust replay: %u cycles per sample, average %u cycles per sample\r\n", robust_cycles / samples, average_cycles / samples);
+    return (robust_error_max <= REPLAY_ROBUST_MAX_ERROR);
+#else
+    NRF_LOG_INFO("Robust replay skipped, it needs BATTERY_CHEMISTRY_CR2032 and a robust ADC_ROBUST_FILTER\r\n");
+    return true;
+#endif
+}
+
+/**@brief Function for replaying the test traces through the signal processing.
+ *
+ * @details Runs before the SoftDevice is enabled, so the cycle counts are not disturbed by its
+ *          interrupts.
+ */
+static void replay_test_run(void)
+{
+    bool passed = replay_ppg_run();
+
+    passed = replay_battery_run() && passed;
+    passed = replay_robust_run() && passed;
+
+    if (passed)
+    {
+        NRF_LOG_INFO("Replay test passed\r\n");
+    }
+    else
+    {
+        NRF_LOG_ERROR("Replay test FAILED\r\n");
+    }
+    NRF_LOG_FLUSH();
+}
+#endif
+
 /**@brief Function for application main entry.
  */
 int main(void)
@@ -1088,10 +2596,17 @@ int main(void)
     err_code = NRF_LOG_INIT(NULL);
     APP_ERROR_CHECK(err_code);
 
+    APP_SCHED_INIT(APP_SCHED_MAX_EVT_SIZE, APP_SCHED_QUEUE_SIZE);            //Initialize scheduler
+#if (REPLAY_TEST_ENABLED == 1)
+    replay_test_run();
+#endif
     adc_config();
     timers_init();
     buttons_leds_init(&erase_bonds);
     ble_stack_init();
+#if (RADIO_AWARE_SAMPLING_ENABLED == 1)
+    radio_notification_init();
+#endif
     peer_manager_init(erase_bonds);
     if (erase_bonds == true)
     {
@@ -1101,17 +2616,23 @@ int main(void)
     advertising_init();
     gatt_init();
     services_init();
+#if (HEART_RATE_ADC_FRONT_END_ENABLED == 0)
     sensor_simulator_init();
+#endif
     conn_params_init();
 
     // Start execution.
     NRF_LOG_INFO("Heart Rate Sensor Start!\r\n");
     application_timers_start();
+#if (HEART_RATE_ADC_FRONT_END_ENABLED == 1)
+    ppg_sampling_start();
+#endif
     advertising_start();
 
     // Enter main loop.
     for (;;)
     {
+        app_sched_execute();     //Let scheduler execute whatever is in the scheduler queue
         if (NRF_LOG_PROCESS() == false)
         {
             power_manage();
@@ -13,9 +13,10 @@
 /**
  * This example is basically the ble_app_uart example in nRF5 SDK 12.2.0 with nRF51 ADC addon
  * functionality. ADC sampling is triggered with pressing Button 4 (search for BSP_EVENT_KEY_3
- * in this file) on the nRF51-DK board. When Button 4 is pressed, ADC sample task is put into 
+ * in this file) on the nRF51-DK board. When Button 4 is pressed, an ADC sample event is put into 
  * app_scheduler queue, which results in the adc_sample function to be executed in the main 
- * context. The ADC outputs the result on UART.
+ * context. The ADC outputs the result on UART. BLE, UART and ADC events are processed in the
+ * main loop as well, see app_evt_handler.
  *
  * In this example, a single ADC channel is configured to sample on Analog Input 2, which maps
  * to physical pin P0.01 on the nRF51 IC. Buffer size is set to 3, which makes the nrf_drv_adc
@@ -24,6 +25,15 @@
  * nrf_drv_adc_sample funciton is called three times which will output three ADC sample results
  * on the UART. The ADC_BUFFER_SIZE constant configures the ADC buffer size. 
  *
+ * With ADC_CAPTURE_MODE_ENABLED set to 1, the ADC instead samples continuously into a circular
+ * buffer. Button 4, a rising edge on CAPTURE_TRIGGER_PIN or a rising crossing of
+ * CAPTURE_TRIGGER_THRESHOLD freezes a window of CAPTURE_PRE_TRIGGER_SAMPLES before and
+ * CAPTURE_POST_TRIGGER_SAMPLES after the trigger, which is then streamed over BLE via NUS.
+ *
+ * With ADC_HW_TRIGGER_ENABLED set to 1, a rising edge on HW_TRIGGER_PIN starts a conversion
+ * directly through GPIOTE and PPI, without CPU involvement. The trigger to conversion end latency
+ * is measured with TIMER1 and printed on the UART.
+ *
  * The UART output can be seen by connecting with e.g. Realterm UART terminal program for PC 
  * (when nRF51-DK connected to PC via USB) with the UART settings configured in the uart_init 
  * function, which is also described in the ble_app_uart documentation at 
@@ -47,6 +57,9 @@
 #include "bsp.h"
 #include "bsp_btn_ble.h"
 #include "nrf_drv_adc.h"
+#include "nrf_drv_ppi.h"
+#include "nrf_drv_timer.h"
+#include "nrf_drv_gpiote.h"
 #include "app_scheduler.h"
 
 #define IS_SRVC_CHANGED_CHARACT_PRESENT 0                                           /**< Include the service_changed characteristic. If not enabled, the server's database cannot be changed for the lifetime of the device. */
@@ -82,19 +95,204 @@
 #define UART_TX_BUF_SIZE                1024                                         /**< UART TX buffer size. */
 #define UART_RX_BUF_SIZE                256                                         /**< UART RX buffer size. */
 
-#define APP_SCHED_MAX_EVT_SIZE          30
-#define APP_SCHED_QUEUE_SIZE            10
+#define APP_SCHED_MAX_EVT_SIZE          sizeof(app_evt_t)                           /**< Maximum size of scheduler event data. All application events have the same fixed size. */
+#define APP_SCHED_QUEUE_SIZE            10                                          /**< Maximum number of events in the scheduler queue. */
 
 #define ADC_BUFFER_SIZE 3                                                           /**< Size of buffer for ADC samples.  */
-static nrf_adc_value_t                  adc_buffer[ADC_BUFFER_SIZE];                /**< ADC buffer. */
+static nrf_adc_value_t                  adc_buffer[2][ADC_BUFFER_SIZE];             /**< ADC buffers, one is filled while the other is processed. */
+static uint8_t                          adc_buffer_index = 0;                       /**< Index of the ADC buffer being filled. */
 static nrf_drv_adc_channel_t            m_channel_config = NRF_DRV_ADC_DEFAULT_CHANNEL(NRF_ADC_CONFIG_INPUT_2); /**< Channel instance. Default configuration used. */
-static uint8_t                          adc_event_counter = 0;
+static uint32_t                         adc_event_counter = 0;
+static volatile bool                    m_adc_buffer_busy[2];                       /**< True while the main loop processes the buffer, it is not filled again until released. */
+static volatile uint32_t                m_adc_buffers_dropped;                      /**< Number of buffers dropped because they were still processed or the scheduler queue was full. */
+
+#define ADC_CAPTURE_MODE_ENABLED        0                                           /**< Set to 1 to sample continuously and capture a window around a trigger. Set to 0 to sample ADC_BUFFER_SIZE times on each press of Button 4. */
+#define CAPTURE_SAMPLE_RATE_HZ          1000                                        /**< Continuous sample rate in capture mode, driven by TIMER2 through PPI (Hz). */
+#define CAPTURE_BLOCK_SIZE              16                                          /**< Samples per ADC buffer. Triggers from button and pin are resolved to this number of samples. */
+#define CAPTURE_BLOCK_COUNT             32                                          /**< Number of blocks in the circular capture buffer. */
+#define CAPTURE_RING_SIZE               (CAPTURE_BLOCK_SIZE * CAPTURE_BLOCK_COUNT)  /**< Size of the circular capture buffer (samples). */
+#define CAPTURE_PRE_TRIGGER_SAMPLES     128                                         /**< Samples captured before the trigger. */
+#define CAPTURE_POST_TRIGGER_SAMPLES    256                                         /**< Samples captured from the trigger on. */
+#define CAPTURE_TRIGGER_PIN             3                                           /**< A rising edge on this pin (P0.03) triggers a capture. */
+#define CAPTURE_TRIGGER_THRESHOLD       512                                         /**< A rising crossing of this ADC value triggers a capture. */
+#define CAPTURE_SAMPLES_PER_PACKET      (BLE_NUS_MAX_DATA_LEN / 2)                  /**< Samples per NUS packet, two bytes each. */
+
+STATIC_ASSERT(CAPTURE_PRE_TRIGGER_SAMPLES + CAPTURE_POST_TRIGGER_SAMPLES + 2 * CAPTURE_BLOCK_SIZE <= CAPTURE_RING_SIZE);
+
+/**@brief Capture trigger sources, sent in the capture header. */
+typedef enum
+{
+    CAPTURE_TRIGGER_BUTTON    = 1,                                                  /**< Button 4 was pressed. */
+    CAPTURE_TRIGGER_PIN_EDGE  = 2,                                                  /**< Rising edge on CAPTURE_TRIGGER_PIN. */
+    CAPTURE_TRIGGER_THRESHOLD_CROSSING = 3                                          /**< The ADC value crossed CAPTURE_TRIGGER_THRESHOLD. */
+} capture_trigger_t;
+
+/**@brief Capture states. */
+typedef enum
+{
+    CAPTURE_STATE_ARMED,                                                            /**< Sampling into the circular buffer, waiting for a trigger. */
+    CAPTURE_STATE_TRIGGERED,                                                        /**< Sampling the post-trigger part of the window. */
+    CAPTURE_STATE_STREAMING                                                         /**< Sampling stopped, the window is streamed over BLE. */
+} capture_state_t;
+
+#if (ADC_CAPTURE_MODE_ENABLED == 1)
+static nrf_adc_value_t                  m_capture_ring[CAPTURE_RING_SIZE];          /**< Circular capture buffer. */
+static const nrf_drv_timer_t            m_capture_timer = NRF_DRV_TIMER_INSTANCE(2); /**< Timer driving the continuous sample rate. */
+static nrf_ppi_channel_t                m_capture_ppi_channel;                      /**< PPI channel starting an ADC conversion on every capture timer compare event. */
+static volatile capture_state_t         m_capture_state = CAPTURE_STATE_ARMED;      /**< Capture state. */
+static volatile uint32_t                m_capture_sample_count;                     /**< Number of samples written into the circular buffer. */
+static uint32_t                         m_capture_armed_count;                      /**< Sample count when the capture was armed. */
+static uint32_t                         m_capture_trigger_count;                    /**< Sample count at the trigger. */
+static capture_trigger_t                m_capture_trigger;                          /**< Source of the trigger. */
+static uint32_t                         m_capture_stream_count;                     /**< Sample count of the next sample to stream. */
+static bool                             m_capture_header_sent;                      /**< True when the capture header was sent. */
+#endif
+
+#define ADC_HW_TRIGGER_ENABLED          0                                           /**< Set to 1 to start a conversion on each rising edge of HW_TRIGGER_PIN through GPIOTE and PPI. Requires ADC_CAPTURE_MODE_ENABLED set to 0. */
+#define HW_TRIGGER_PIN                  4                                           /**< A rising edge on this pin (P0.04) starts a conversion in hardware trigger mode. */
+#define HW_TRIGGER_TICKS_TO_NS(TICKS)   (((TICKS) * 125) / 2)                       /**< Converts latency timer ticks (16 MHz) to nanoseconds. */
+
+#if (ADC_HW_TRIGGER_ENABLED == 1) && (ADC_CAPTURE_MODE_ENABLED == 1)
+#error "ADC_HW_TRIGGER_ENABLED and ADC_CAPTURE_MODE_ENABLED cannot both be set"
+#endif
+
+#if (ADC_HW_TRIGGER_ENABLED == 1)
+static nrf_adc_value_t                  m_hw_trigger_value;                         /**< ADC buffer of one sample, rearmed after each conversion. */
+static const nrf_drv_timer_t            m_hw_trigger_timer = NRF_DRV_TIMER_INSTANCE(1); /**< Free running timer, captures the trigger and conversion end times. */
+static uint32_t                         m_hw_trigger_count;                         /**< Number of triggered conversions. */
+static uint16_t                         m_hw_trigger_latency_min = UINT16_MAX;      /**< Shortest trigger to conversion end latency (ticks). */
+static uint16_t                         m_hw_trigger_latency_max;                   /**< Longest trigger to conversion end latency (ticks). */
+#endif
 
 static ble_nus_t                        m_nus;                                      /**< Structure to identify the Nordic UART Service. */
 static uint16_t                         m_conn_handle = BLE_CONN_HANDLE_INVALID;    /**< Handle of the current connection. */
 
 static ble_uuid_t                       m_adv_uuids[] = {{BLE_UUID_NUS_SERVICE, NUS_SERVICE_UUID_TYPE}};  /**< Universally unique service identifier. */
 
+/**@brief Application event types. Events are posted from interrupt context and processed in the main loop. */
+typedef enum
+{
+    APP_EVT_BLE,                                                            /**< SoftDevice events are available. */
+    APP_EVT_UART_RX,                                                        /**< A line was received on UART. */
+    APP_EVT_ADC_SAMPLE,                                                     /**< Button 4 was pressed, start sampling. */
+    APP_EVT_ADC_DONE,                                                       /**< An ADC buffer is filled. */
+    APP_EVT_CAPTURE_DONE,                                                   /**< A capture window is complete. */
+    APP_EVT_HW_TRIGGER_DONE,                                                /**< A conversion started by HW_TRIGGER_PIN is complete. */
+} app_evt_type_t;
+
+/**@brief Application event priorities. Events of lower priority are deferred while events of higher priority are pending. */
+typedef enum
+{
+    APP_EVT_PRIORITY_HIGH,                                                  /**< Protocol and user input events. */
+    APP_EVT_PRIORITY_LOW,                                                   /**< Measurement processing. */
+    APP_EVT_PRIORITY_COUNT                                                  /**< Number of event priorities. */
+} app_evt_priority_t;
+
+/**@brief Fixed-size application event, copied into the scheduler queue. */
+typedef struct
+{
+    app_evt_type_t type;                                                    /**< Event type. */
+    union
+    {
+        struct
+        {
+            uint8_t data[BLE_NUS_MAX_DATA_LEN];                             /**< Received characters. */
+            uint8_t length;                                                 /**< Number of received characters. */
+        } uart_rx;                                                          /**< Parameters of @ref APP_EVT_UART_RX. */
+        struct
+        {
+            nrf_adc_value_t const * p_buffer;                               /**< Filled ADC buffer. */
+            uint16_t                size;                                   /**< Number of samples in the buffer. */
+            uint8_t                 index;                                  /**< Index of the buffer in adc_buffer, released after processing. */
+        } adc_done;                                                         /**< Parameters of @ref APP_EVT_ADC_DONE. */
+        struct
+        {
+            nrf_adc_value_t value;                                          /**< Converted value. */
+            uint16_t        latency;                                        /**< Trigger to conversion end latency (ticks). */
+        } hw_trigger_done;                                                  /**< Parameters of @ref APP_EVT_HW_TRIGGER_DONE. */
+    } params;
+} app_evt_t;
+
+static volatile uint8_t                 m_app_evt_pending[APP_EVT_PRIORITY_COUNT];  /**< Number of queued application events per priority. */
+static uint8_t                          m_app_evt_queue_max;                        /**< High-water mark of the number of queued application events. */
+static uint8_t                          m_app_evt_queue_max_reported;               /**< High-water mark last reported on the log. */
+static volatile uint32_t                m_app_evt_dropped;                          /**< Number of application events dropped because the scheduler queue was full. */
+static uint32_t                         m_app_evt_dropped_reported;                 /**< Number of dropped application events last reported on the log. */
+static volatile bool                    m_softdevice_evt_scheduled;                 /**< True while an @ref APP_EVT_BLE event is queued. */
+
+static void app_evt_handler(void * p_event_data, uint16_t event_size);
+
+
+/**@brief Function for getting the priority of an application event type.
+ */
+static app_evt_priority_t app_evt_priority_get(app_evt_type_t type)
+{
+    return ((type == APP_EVT_ADC_DONE) || (type == APP_EVT_CAPTURE_DONE) || (type == APP_EVT_HW_TRIGGER_DONE)) ? APP_EVT_PRIORITY_LOW : APP_EVT_PRIORITY_HIGH;
+}
+
+
+/**@brief Function for posting an application event to the scheduler queue.
+ *
+ * @details May be called from interrupt context. The event is copied into the queue.
+ *
+ * @param[in] p_evt  Event to post.
+ *
+ * @return NRF_SUCCESS, or NRF_ERROR_NO_MEM if the scheduler queue is full. The dropped event is
+ *         counted and reported on the log from the main loop.
+ */
+static uint32_t app_evt_put(app_evt_t const * p_evt)
+{
+    uint32_t err_code;
+    uint8_t  queued = 0;
+
+    CRITICAL_REGION_ENTER();
+    err_code = app_sched_event_put(p_evt, sizeof(app_evt_t), app_evt_handler);
+    if (err_code == NRF_SUCCESS)
+    {
+        m_app_evt_pending[app_evt_priority_get(p_evt->type)]++;
+        for (uint32_t i = 0; i < APP_EVT_PRIORITY_COUNT; i++)
+        {
+            queued += m_app_evt_pending[i];
+        }
+        if (queued > m_app_evt_queue_max)
+        {
+            m_app_evt_queue_max = queued;
+        }
+    }
+    else
+    {
+        m_app_evt_dropped++;
+    }
+    CRITICAL_REGION_EXIT();
+
+    return err_code;
+}
+
+
+/**@brief Function for scheduling SoftDevice event processing in the main loop.
+ *
+ * @details Called by the SoftDevice handler from the SoftDevice event interrupt. One queued event
+ *          pulls all pending SoftDevice events, so no further event is queued until it is processed.
+ */
+static uint32_t softdevice_evt_schedule(void)
+{
+    uint32_t  err_code;
+    app_evt_t evt;
+
+    if (m_softdevice_evt_scheduled)
+    {
+        return NRF_SUCCESS;
+    }
+
+    evt.type = APP_EVT_BLE;
+    err_code = app_evt_put(&evt);
+    if (err_code == NRF_SUCCESS)
+    {
+        m_softdevice_evt_scheduled = true;
+    }
+    return err_code;
+}
+
 /**@brief Function for placing the application in low power state while waiting for events.
  */
 static void power_manage(void)
@@ -288,6 +486,120 @@ static void on_adv_evt(ble_adv_evt_t ble_adv_evt)
 }
 
 
+#if (ADC_CAPTURE_MODE_ENABLED == 1)
+/**@brief Function for triggering a capture.
+ *
+ * @details Ignored unless the capture is armed and enough samples were taken since arming to fill
+ *          the pre-trigger part of the window. May be called from interrupt context.
+ *
+ * @param[in] trigger       Trigger source.
+ * @param[in] trigger_count Sample count at the trigger.
+ */
+static void capture_trigger(capture_trigger_t trigger, uint32_t trigger_count)
+{
+    CRITICAL_REGION_ENTER();
+    if ((m_capture_state == CAPTURE_STATE_ARMED) &&
+        (trigger_count >= m_capture_armed_count + CAPTURE_PRE_TRIGGER_SAMPLES))
+    {
+        m_capture_trigger       = trigger;
+        m_capture_trigger_count = trigger_count;
+        m_capture_state         = CAPTURE_STATE_TRIGGERED;
+    }
+    CRITICAL_REGION_EXIT();
+}
+
+
+/**@brief Function for restarting continuous sampling after a capture.
+ */
+static void capture_rearm(void)
+{
+    m_capture_armed_count = m_capture_sample_count;
+    m_capture_state       = CAPTURE_STATE_ARMED;
+    APP_ERROR_CHECK(nrf_drv_ppi_channel_enable(m_capture_ppi_channel));
+    LEDS_OFF(BSP_LED_2_MASK);
+}
+
+
+/**@brief Function for streaming the captured window over BLE.
+ *
+ * @details Sends a header followed by the samples, CAPTURE_SAMPLES_PER_PACKET per notification,
+ *          until the SoftDevice runs out of TX buffers. Streaming is continued on
+ *          BLE_EVT_TX_COMPLETE. The header holds the trigger source and the number of pre-trigger
+ *          and post-trigger samples, the samples are sent as big endian 16 bit values.
+ */
+static void capture_stream(void)
+{
+    uint32_t err_code = NRF_SUCCESS;
+    uint32_t end_count = m_capture_trigger_count + CAPTURE_POST_TRIGGER_SAMPLES;
+    uint8_t  packet[BLE_NUS_MAX_DATA_LEN];
+    uint16_t length;
+
+    if (m_capture_state != CAPTURE_STATE_STREAMING)
+    {
+        return;
+    }
+
+    while ((err_code == NRF_SUCCESS) && (m_capture_stream_count < end_count))
+    {
+        if (!m_capture_header_sent)
+        {
+            packet[0] = m_capture_trigger;
+            packet[1] = CAPTURE_PRE_TRIGGER_SAMPLES >> 8;
+            packet[2] = CAPTURE_PRE_TRIGGER_SAMPLES & 0xFF;
+            packet[3] = CAPTURE_POST_TRIGGER_SAMPLES >> 8;
+            packet[4] = CAPTURE_POST_TRIGGER_SAMPLES & 0xFF;
+            length    = 5;
+        }
+        else
+        {
+            for (length = 0; (length < BLE_NUS_MAX_DATA_LEN) && (m_capture_stream_count + length / 2 < end_count); length += 2)
+            {
+                nrf_adc_value_t sample = m_capture_ring[(m_capture_stream_count + length / 2) % CAPTURE_RING_SIZE];
+                packet[length]     = sample >> 8;
+                packet[length + 1] = sample;
+            }
+        }
+
+        err_code = ble_nus_string_send(&m_nus, packet, length);
+        if (err_code == NRF_SUCCESS)
+        {
+            if (!m_capture_header_sent)
+            {
+                m_capture_header_sent = true;
+            }
+            else
+            {
+                m_capture_stream_count += length / 2;
+            }
+        }
+    }
+
+    if (err_code == BLE_ERROR_NO_TX_PACKETS)
+    {
+        return;                                                             //Continued on BLE_EVT_TX_COMPLETE
+    }
+    if ((err_code != NRF_SUCCESS) && (err_code != NRF_ERROR_INVALID_STATE))
+    {
+        APP_ERROR_HANDLER(err_code);
+    }
+
+    printf("Capture %s: trigger %d, %d samples\r\n", (err_code == NRF_SUCCESS) ? "sent" : "discarded, not connected",
+           m_capture_trigger, CAPTURE_PRE_TRIGGER_SAMPLES + CAPTURE_POST_TRIGGER_SAMPLES);
+    capture_rearm();
+}
+
+
+/**@brief Function for starting to stream a completed capture window.
+ */
+static void capture_stream_start(void)
+{
+    m_capture_stream_count = m_capture_trigger_count - CAPTURE_PRE_TRIGGER_SAMPLES;
+    m_capture_header_sent  = false;
+    capture_stream();
+}
+#endif
+
+
 /**@brief Function for the application's SoftDevice event handler.
  *
  * @param[in] p_ble_evt SoftDevice event.
@@ -308,8 +620,17 @@ static void on_ble_evt(ble_evt_t * p_ble_evt)
             err_code = bsp_indication_set(BSP_INDICATE_IDLE);
             APP_ERROR_CHECK(err_code);
             m_conn_handle = BLE_CONN_HANDLE_INVALID;
+#if (ADC_CAPTURE_MODE_ENABLED == 1)
+            capture_stream();                                               //Stops streaming an ongoing capture
+#endif
             break; // BLE_GAP_EVT_DISCONNECTED
 
+#if (ADC_CAPTURE_MODE_ENABLED == 1)
+        case BLE_EVT_TX_COMPLETE:
+            capture_stream();                                               //Continue streaming an ongoing capture
+            break; // BLE_EVT_TX_COMPLETE
+#endif
+
         case BLE_GAP_EVT_SEC_PARAMS_REQUEST:
             // Pairing not supported
             err_code = sd_ble_gap_sec_params_reply(m_conn_handle, BLE_GAP_SEC_STATUS_PAIRING_NOT_SUPP, NULL, NULL);
@@ -414,7 +735,7 @@ static void ble_stack_init(void)
     nrf_clock_lf_cfg_t clock_lf_cfg = NRF_CLOCK_LFCLKSRC;
 
     // Initialize SoftDevice.
-    SOFTDEVICE_HANDLER_INIT(&clock_lf_cfg, NULL);
+    SOFTDEVICE_HANDLER_INIT(&clock_lf_cfg, softdevice_evt_schedule);       //SoftDevice events are processed in the main loop
 
     ble_enable_params_t ble_enable_params;
     err_code = softdevice_enable_get_default_config(CENTRAL_LINK_COUNT,
@@ -441,7 +762,12 @@ void adc_sample(void)
 {
     ret_code_t ret_code;
 	
-    ret_code = nrf_drv_adc_buffer_convert(adc_buffer, ADC_BUFFER_SIZE);        // Allocate buffer for ADC
+    if (m_adc_buffer_busy[adc_buffer_index])
+    {
+        m_adc_buffers_dropped++;                                                                //The buffer is still processed, skip this press
+        return;
+    }
+    ret_code = nrf_drv_adc_buffer_convert(adc_buffer[adc_buffer_index], ADC_BUFFER_SIZE);        // Allocate buffer for ADC
     APP_ERROR_CHECK(ret_code);
 	
     for (uint32_t i = 0; i < ADC_BUFFER_SIZE; i++)
@@ -458,7 +784,10 @@ void adc_sample(void)
  */
 void bsp_event_handler(bsp_event_t event)
 {
-    uint32_t err_code;
+    uint32_t  err_code;
+#if (ADC_CAPTURE_MODE_ENABLED == 0) && (ADC_HW_TRIGGER_ENABLED == 0)
+    app_evt_t evt;
+#endif
     switch (event)
     {
         case BSP_EVENT_SLEEP:
@@ -486,7 +815,14 @@ void bsp_event_handler(bsp_event_t event)
         
         case BSP_EVENT_KEY_3:
             printf("\r\n    BUTTON 4 is pressed...\r\n");                      //Indicate on UART that Button 4 is pressed
-            app_sched_event_put(0,0,(app_sched_event_handler_t)adc_sample);    //Put adc_sample function into the scheduler queue, which will then be executed in the main context (lowest priority) when app_sched_execute is called in the main loop
+#if (ADC_CAPTURE_MODE_ENABLED == 1)
+            capture_trigger(CAPTURE_TRIGGER_BUTTON, m_capture_sample_count);
+#elif (ADC_HW_TRIGGER_ENABLED == 1)
+            printf("Button sampling is disabled, conversions are started by pin %d\r\n", HW_TRIGGER_PIN);
+#else
+            evt.type = APP_EVT_ADC_SAMPLE;                                     //Put ADC sample event into the scheduler queue, adc_sample will then be executed in the main context when app_sched_execute is called in the main loop
+            (void)app_evt_put(&evt);                                           //The press is dropped and counted when the scheduler queue is full
+#endif
             break;	
 
         default:
@@ -507,7 +843,6 @@ void uart_event_handle(app_uart_evt_t * p_event)
 {
     static uint8_t data_array[BLE_NUS_MAX_DATA_LEN];
     static uint8_t index = 0;
-    uint32_t       err_code;
 
     switch (p_event->evt_type)
     {
@@ -517,11 +852,12 @@ void uart_event_handle(app_uart_evt_t * p_event)
 
             if ((data_array[index - 1] == '\n') || (index >= (BLE_NUS_MAX_DATA_LEN)))
             {
-                err_code = ble_nus_string_send(&m_nus, data_array, index);
-                if (err_code != NRF_ERROR_INVALID_STATE)
-                {
-                    APP_ERROR_CHECK(err_code);
-                }
+                app_evt_t evt;
+
+                evt.type = APP_EVT_UART_RX;                                 //Send the line over BLE from the main loop
+                memcpy(evt.params.uart_rx.data, data_array, index);
+                evt.params.uart_rx.length = index;
+                (void)app_evt_put(&evt);                                    //The line is dropped and counted when the scheduler queue is full
 
                 index = 0;
             }
@@ -619,30 +955,168 @@ static void buttons_leds_init(bool * p_erase_bonds)
 }
 
 
+/**@brief Function for sending a line received on UART over BLE.
+ */
+static void nus_string_send(uint8_t const * p_data, uint8_t length)
+{
+    uint32_t err_code = ble_nus_string_send(&m_nus, (uint8_t *)p_data, length);
+    if (err_code != NRF_ERROR_INVALID_STATE)
+    {
+        APP_ERROR_CHECK(err_code);
+    }
+}
+
+
 /**
- * @brief ADC interrupt handler.
+ * @brief Function for packing ADC samples into a NUS payload, two bytes per sample, most significant byte first.
+ *
+ * @return Number of bytes written to p_data.
+ */
+static uint16_t adc_samples_pack(nrf_adc_value_t const * p_buffer, uint16_t size, uint8_t * p_data)
+{
+    for (uint32_t i = 0; i < size; i++)
+    {
+        p_data[(i*2)]   = p_buffer[i] >> 8;
+        p_data[(i*2)+1] = p_buffer[i];
+    }
+    return size * 2;
+}
+
+
+/**
+ * @brief Function for processing a filled ADC buffer in the main loop.
  * Prints ADC results on hardware UART and over BLE via the NUS service.
  */
-static void adc_event_handler(nrf_drv_adc_evt_t const * p_event)
+static void adc_buffer_process(nrf_adc_value_t const * p_buffer, uint16_t size)
 {
-    uint8_t adc_result[ADC_BUFFER_SIZE*2];	
+    uint8_t  adc_result[ADC_BUFFER_SIZE*2];	
+    uint16_t length;
 	
+    adc_event_counter++;
+    printf("    ADC event counter: %lu, %lu buffers dropped\r\n", (unsigned long)adc_event_counter, (unsigned long)m_adc_buffers_dropped);
+    for (uint32_t i = 0; i < size; i++)
+    {
+        printf("Sample value %u: %d\r\n", (unsigned int)i+1, p_buffer[i]);
+    }
+			
+    length = adc_samples_pack(p_buffer, size, adc_result);
+    if(length <= BLE_NUS_MAX_DATA_LEN)
+    {
+        ble_nus_string_send(&m_nus, &adc_result[0], length);
+    }					
+    LEDS_INVERT(BSP_LED_3_MASK);
+}
+
+#if (ADC_CAPTURE_MODE_ENABLED == 1)
+/**
+ * @brief Function for handling a filled block of the circular capture buffer in interrupt context.
+ *
+ * @details Sampling continues into the next block right away. The block is searched for a rising
+ *          crossing of CAPTURE_TRIGGER_THRESHOLD, and sampling is stopped when the post-trigger
+ *          part of the window is complete.
+ */
+static void capture_block_process(nrf_adc_value_t const * p_block)
+{
+    static nrf_adc_value_t previous_sample = 0;
+    uint32_t               block_count = m_capture_sample_count;
+    app_evt_t              evt;
+
+    m_capture_sample_count += CAPTURE_BLOCK_SIZE;
+    APP_ERROR_CHECK(nrf_drv_adc_buffer_convert(&m_capture_ring[m_capture_sample_count % CAPTURE_RING_SIZE], CAPTURE_BLOCK_SIZE));
+
+    for (uint32_t i = 0; (i < CAPTURE_BLOCK_SIZE) && (m_capture_state == CAPTURE_STATE_ARMED); i++)
+    {
+        if ((previous_sample < CAPTURE_TRIGGER_THRESHOLD) && (p_block[i] >= CAPTURE_TRIGGER_THRESHOLD))
+        {
+            capture_trigger(CAPTURE_TRIGGER_THRESHOLD_CROSSING, block_count + i);
+        }
+        previous_sample = p_block[i];
+    }
+    previous_sample = p_block[CAPTURE_BLOCK_SIZE - 1];
+
+    if ((m_capture_state == CAPTURE_STATE_TRIGGERED) &&
+        (m_capture_sample_count >= m_capture_trigger_count + CAPTURE_POST_TRIGGER_SAMPLES))
+    {
+        APP_ERROR_CHECK(nrf_drv_ppi_channel_disable(m_capture_ppi_channel));   //Freeze the window, the next block stays allocated until sampling is resumed
+        m_capture_state = CAPTURE_STATE_STREAMING;
+        LEDS_ON(BSP_LED_2_MASK);
+
+        evt.type = APP_EVT_CAPTURE_DONE;
+        if (app_evt_put(&evt) != NRF_SUCCESS)
+        {
+            m_adc_buffers_dropped++;                                        //The scheduler queue is full, drop the window
+            capture_rearm();
+        }
+    }
+    LEDS_INVERT(BSP_LED_3_MASK);
+}
+#endif
+
+#if (ADC_HW_TRIGGER_ENABLED == 1)
+/**
+ * @brief Function for processing a conversion started by HW_TRIGGER_PIN in the main loop.
+ * Prints the value and the trigger to conversion end latency on hardware UART. The spread between
+ * the shortest and the longest latency is the trigger jitter, with a resolution of 62.5 ns.
+ */
+static void hw_trigger_result_process(nrf_adc_value_t value, uint16_t latency)
+{
+    m_hw_trigger_count++;
+    m_hw_trigger_latency_min = MIN(m_hw_trigger_latency_min, latency);
+    m_hw_trigger_latency_max = MAX(m_hw_trigger_latency_max, latency);
+
+    printf("Trigger %lu: value %d, latency %lu ns (min %lu ns, max %lu ns, jitter %lu ns)\r\n",
+           (unsigned long)m_hw_trigger_count, value,
+           (unsigned long)HW_TRIGGER_TICKS_TO_NS(latency),
+           (unsigned long)HW_TRIGGER_TICKS_TO_NS(m_hw_trigger_latency_min),
+           (unsigned long)HW_TRIGGER_TICKS_TO_NS(m_hw_trigger_latency_max),
+           (unsigned long)HW_TRIGGER_TICKS_TO_NS(m_hw_trigger_latency_max - m_hw_trigger_latency_min));
+    LEDS_INVERT(BSP_LED_3_MASK);
+}
+#endif
+
+/**
+ * @brief ADC interrupt handler.
+ * Hands the filled buffer over to the main loop. The next button press samples into the other buffer.
+ * If the scheduler queue is full, the filled buffer is dropped and the next press samples into it again.
+ */
+static void adc_event_handler(nrf_drv_adc_evt_t const * p_event)
+{
     if (p_event->type == NRF_DRV_ADC_EVT_DONE)
     {
-        adc_event_counter++;
-        printf("    ADC event counter: %d\r\n", adc_event_counter);
-        for (uint32_t i = 0; i < p_event->data.done.size; i++)
+        app_evt_t evt;
+
+#if (ADC_CAPTURE_MODE_ENABLED == 1)
+        capture_block_process(p_event->data.done.p_buffer);
+        return;
+#endif
+
+#if (ADC_HW_TRIGGER_ENABLED == 1)
+        //Both times are captured by PPI, the 16 bit difference is valid as the latency is far below the timer period
+        evt.type                           = APP_EVT_HW_TRIGGER_DONE;
+        evt.params.hw_trigger_done.value   = m_hw_trigger_value;
+        evt.params.hw_trigger_done.latency = (uint16_t)(nrf_drv_timer_capture_get(&m_hw_trigger_timer, NRF_TIMER_CC_CHANNEL1) -
+                                                        nrf_drv_timer_capture_get(&m_hw_trigger_timer, NRF_TIMER_CC_CHANNEL0));
+        APP_ERROR_CHECK(nrf_drv_adc_buffer_convert(&m_hw_trigger_value, 1));  //Ready for the next trigger
+        if (app_evt_put(&evt) != NRF_SUCCESS)
+        {
+            m_adc_buffers_dropped++;
+        }
+        return;
+#endif
+
+        evt.type                     = APP_EVT_ADC_DONE;
+        evt.params.adc_done.p_buffer = p_event->data.done.p_buffer;
+        evt.params.adc_done.size     = p_event->data.done.size;
+        evt.params.adc_done.index    = adc_buffer_index;
+        if (app_evt_put(&evt) == NRF_SUCCESS)
         {
-            printf("Sample value %u: %d\r\n", (unsigned int)i+1, p_event->data.done.p_buffer[i]);
-            adc_result[(i*2)] = p_event->data.done.p_buffer[i] >> 8;
-            adc_result[(i*2)+1] = p_event->data.done.p_buffer[i];					
+            m_adc_buffer_busy[adc_buffer_index] = true;
+            adc_buffer_index ^= 1;
         }
-				
-        if(ADC_BUFFER_SIZE <= 10)
+        else
         {
-            ble_nus_string_send(&m_nus, &adc_result[0], ADC_BUFFER_SIZE*2);
-        }					
-        LEDS_INVERT(BSP_LED_3_MASK);
+            m_adc_buffers_dropped++;
+        }
     }
 }
 
@@ -660,6 +1134,208 @@ static void adc_config(void)
     nrf_drv_adc_channel_enable(&m_channel_config);
 }
 
+#if (ADC_CAPTURE_MODE_ENABLED == 1)
+/**
+ * @brief Capture trigger pin handler.
+ */
+static void capture_pin_handler(nrf_drv_gpiote_pin_t pin, nrf_gpiote_polarity_t action)
+{
+    capture_trigger(CAPTURE_TRIGGER_PIN_EDGE, m_capture_sample_count);
+}
+
+/**
+ * @brief TIMER interrupt handler.
+ */
+static void capture_timer_handler(nrf_timer_event_t event_type, void * p_context)
+{
+}
+
+/**
+ * @brief Function for starting continuous sampling into the circular capture buffer.
+ * TIMER2 compare events trigger the ADC START task through a PPI channel.
+ */
+static void capture_init(void)
+{
+    ret_code_t err_code;
+
+    err_code = nrf_drv_ppi_init();
+    APP_ERROR_CHECK(err_code);
+
+    nrf_drv_timer_config_t timer_cfg = NRF_DRV_TIMER_DEFAULT_CONFIG;
+    timer_cfg.frequency = NRF_TIMER_FREQ_1MHz;
+    err_code = nrf_drv_timer_init(&m_capture_timer, &timer_cfg, capture_timer_handler);
+    APP_ERROR_CHECK(err_code);
+
+    /* setup m_capture_timer for compare event, without interrupt */
+    uint32_t time_ticks = nrf_drv_timer_us_to_ticks(&m_capture_timer, 1000000 / CAPTURE_SAMPLE_RATE_HZ);
+    nrf_drv_timer_extended_compare(&m_capture_timer, NRF_TIMER_CC_CHANNEL0, time_ticks, NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK, false);
+
+    /* setup ppi channel so that timer compare event is triggering sample task in ADC */
+    err_code = nrf_drv_ppi_channel_alloc(&m_capture_ppi_channel);
+    APP_ERROR_CHECK(err_code);
+    err_code = nrf_drv_ppi_channel_assign(m_capture_ppi_channel,
+                                          nrf_drv_timer_compare_event_address_get(&m_capture_timer, NRF_TIMER_CC_CHANNEL0),
+                                          nrf_drv_adc_start_task_get());
+    APP_ERROR_CHECK(err_code);
+
+    /* setup trigger pin, GPIOTE is already initialized by the BSP */
+    if (!nrf_drv_gpiote_is_init())
+    {
+        err_code = nrf_drv_gpiote_init();
+        APP_ERROR_CHECK(err_code);
+    }
+    nrf_drv_gpiote_in_config_t pin_cfg = GPIOTE_CONFIG_IN_SENSE_LOTOHI(true);
+    pin_cfg.pull = NRF_GPIO_PIN_PULLDOWN;
+    err_code = nrf_drv_gpiote_in_init(CAPTURE_TRIGGER_PIN, &pin_cfg, capture_pin_handler);
+    APP_ERROR_CHECK(err_code);
+    nrf_drv_gpiote_in_event_enable(CAPTURE_TRIGGER_PIN, true);
+
+    APP_ERROR_CHECK(nrf_drv_adc_buffer_convert(&m_capture_ring[0], CAPTURE_BLOCK_SIZE));
+    nrf_drv_timer_enable(&m_capture_timer);
+    capture_rearm();
+}
+#endif
+
+#if (ADC_HW_TRIGGER_ENABLED == 1)
+/**
+ * @brief TIMER interrupt handler.
+ */
+static void hw_trigger_timer_handler(nrf_timer_event_t event_type, void * p_context)
+{
+}
+
+/**
+ * @brief Function for connecting HW_TRIGGER_PIN to the ADC START task.
+ * The GPIOTE IN event of the pin starts a conversion and captures the time in TIMER1 CC[0], and the
+ * ADC END event captures the time in TIMER1 CC[1], all through PPI.
+ */
+static void hw_trigger_init(void)
+{
+    ret_code_t        err_code;
+    nrf_ppi_channel_t ppi_channel;
+
+    err_code = nrf_drv_ppi_init();
+    APP_ERROR_CHECK(err_code);
+
+    nrf_drv_timer_config_t timer_cfg = NRF_DRV_TIMER_DEFAULT_CONFIG;
+    timer_cfg.frequency = NRF_TIMER_FREQ_16MHz;
+    timer_cfg.bit_width = NRF_TIMER_BIT_WIDTH_16;
+    err_code = nrf_drv_timer_init(&m_hw_trigger_timer, &timer_cfg, hw_trigger_timer_handler);
+    APP_ERROR_CHECK(err_code);
+
+    /* setup trigger pin, GPIOTE is already initialized by the BSP. The event needs a GPIOTE channel (high accuracy) and no interrupt */
+    if (!nrf_drv_gpiote_is_init())
+    {
+        err_code = nrf_drv_gpiote_init();
+        APP_ERROR_CHECK(err_code);
+    }
+    nrf_drv_gpiote_in_config_t pin_cfg = GPIOTE_CONFIG_IN_SENSE_LOTOHI(true);
+    pin_cfg.pull = NRF_GPIO_PIN_PULLDOWN;
+    err_code = nrf_drv_gpiote_in_init(HW_TRIGGER_PIN, &pin_cfg, NULL);
+    APP_ERROR_CHECK(err_code);
+
+    /* setup ppi channels: pin event starts the conversion, and pin event and conversion end capture the time */
+    err_code = nrf_drv_ppi_channel_alloc(&ppi_channel);
+    APP_ERROR_CHECK(err_code);
+    err_code = nrf_drv_ppi_channel_assign(ppi_channel, nrf_drv_gpiote_in_event_addr_get(HW_TRIGGER_PIN), nrf_drv_adc_start_task_get());
+    APP_ERROR_CHECK(err_code);
+    err_code = nrf_drv_ppi_channel_enable(ppi_channel);
+    APP_ERROR_CHECK(err_code);
+
+    err_code = nrf_drv_ppi_channel_alloc(&ppi_channel);
+    APP_ERROR_CHECK(err_code);
+    err_code = nrf_drv_ppi_channel_assign(ppi_channel, nrf_drv_gpiote_in_event_addr_get(HW_TRIGGER_PIN),
+                                          nrf_drv_timer_capture_task_address_get(&m_hw_trigger_timer, NRF_TIMER_CC_CHANNEL0));
+    APP_ERROR_CHECK(err_code);
+    err_code = nrf_drv_ppi_channel_enable(ppi_channel);
+    APP_ERROR_CHECK(err_code);
+
+    err_code = nrf_drv_ppi_channel_alloc(&ppi_channel);
+    APP_ERROR_CHECK(err_code);
+    err_code = nrf_drv_ppi_channel_assign(ppi_channel, (uint32_t)&NRF_ADC->EVENTS_END,
+                                          nrf_drv_timer_capture_task_address_get(&m_hw_trigger_timer, NRF_TIMER_CC_CHANNEL1));
+    APP_ERROR_CHECK(err_code);
+    err_code = nrf_drv_ppi_channel_enable(ppi_channel);
+    APP_ERROR_CHECK(err_code);
+
+    APP_ERROR_CHECK(nrf_drv_adc_buffer_convert(&m_hw_trigger_value, 1));
+    nrf_drv_timer_enable(&m_hw_trigger_timer);
+    nrf_drv_gpiote_in_event_enable(HW_TRIGGER_PIN, false);
+}
+#endif
+
+
+/**@brief Function for processing application events in the main loop.
+ *
+ * @details An event of low priority is put back at the end of the scheduler queue while events of
+ *          high priority are pending, unless the queue is full.
+ */
+static void app_evt_handler(void * p_event_data, uint16_t event_size)
+{
+    app_evt_t const  * p_evt    = (app_evt_t const *)p_event_data;
+    app_evt_priority_t priority = app_evt_priority_get(p_evt->type);
+
+    UNUSED_PARAMETER(event_size);
+
+    if ((priority == APP_EVT_PRIORITY_LOW) && (m_app_evt_pending[APP_EVT_PRIORITY_HIGH] > 0))
+    {
+        if (app_sched_event_put(p_evt, sizeof(app_evt_t), app_evt_handler) == NRF_SUCCESS)
+        {
+            return;                                                         //Deferred, still counted as pending
+        }
+    }
+
+    CRITICAL_REGION_ENTER();
+    m_app_evt_pending[priority]--;
+    CRITICAL_REGION_EXIT();
+
+    switch (p_evt->type)
+    {
+        case APP_EVT_BLE:
+            m_softdevice_evt_scheduled = false;
+            intern_softdevice_events_execute();                             //Pull and dispatch all pending SoftDevice events
+            break;
+
+        case APP_EVT_UART_RX:
+            nus_string_send(p_evt->params.uart_rx.data, p_evt->params.uart_rx.length);
+            break;
+
+        case APP_EVT_ADC_SAMPLE:
+            adc_sample();
+            break;
+
+        case APP_EVT_ADC_DONE:
+            adc_buffer_process(p_evt->params.adc_done.p_buffer, p_evt->params.adc_done.size);
+            m_adc_buffer_busy[p_evt->params.adc_done.index] = false;
+            break;
+
+#if (ADC_CAPTURE_MODE_ENABLED == 1)
+        case APP_EVT_CAPTURE_DONE:
+            capture_stream_start();
+            break;
+#endif
+
+#if (ADC_HW_TRIGGER_ENABLED == 1)
+        case APP_EVT_HW_TRIGGER_DONE:
+            hw_trigger_result_process(p_evt->params.hw_trigger_done.value, p_evt->params.hw_trigger_done.latency);
+            break;
+#endif
+
+        default:
+            break;
+    }
+
+    if (m_app_evt_queue_max != m_app_evt_queue_max_reported)
+    {
+        m_app_evt_queue_max_reported = m_app_evt_queue_max;
+        printf("Scheduler queue high-water mark: %d of %d events\r\n", m_app_evt_queue_max_reported, APP_SCHED_QUEUE_SIZE);
+    }
+    if (m_app_evt_dropped != m_app_evt_dropped_reported)
+    {
+        m_app_evt_dropped_reported = m_app_evt_dropped;
+        printf("Events dropped, scheduler queue full: %lu\r\n", (unsigned long)m_app_evt_dropped_reported);
+    }
+}
 
 /**@brief Application main function.
  */
@@ -685,6 +1361,12 @@ int main(void)
     APP_ERROR_CHECK(err_code);
     
     adc_config();                //Initialize ADC
+#if (ADC_CAPTURE_MODE_ENABLED == 1)
+    capture_init();              //Start continuous sampling
+#endif
+#if (ADC_HW_TRIGGER_ENABLED == 1)
+    hw_trigger_init();           //Connect the trigger pin to the ADC
+#endif
 
     // Enter main loop.
     for (;;)
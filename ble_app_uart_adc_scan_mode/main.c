@@ -33,6 +33,8 @@
 #include "nrf_drv_adc.h"
 #include "nrf_drv_ppi.h"
 #include "nrf_drv_timer.h"
+#include "app_scheduler.h"
+#include "fstorage.h"
 
 #define IS_SRVC_CHANGED_CHARACT_PRESENT 0                                           /**< Include the service_changed characteristic. If not enabled, the server's database cannot be changed for the lifetime of the device. */
 
@@ -67,20 +69,370 @@
 #define UART_TX_BUF_SIZE                512                                         /**< UART TX buffer size. */
 #define UART_RX_BUF_SIZE                64                                          /**< UART RX buffer size. */
 
+#define APP_SCHED_MAX_EVT_SIZE          sizeof(app_evt_t)                           /**< Maximum size of scheduler event data. All application events have the same fixed size. */
+#define APP_SCHED_QUEUE_SIZE            10                                          /**< Maximum number of events in the scheduler queue. */
+
+#define ISR_PROFILER_ENABLED            0                                           /**< Set to 1 to measure the latency and duration of the ADC and UART handlers with TIMER1. Press Button 4 to print the results on UART. Keeps HFCLK running. */
+#define ISR_PROFILER_TIMER_FREQ         NRF_TIMER_FREQ_16MHz                        /**< Profiler timer frequency. At 16 MHz one tick is one CPU cycle, and the 16 bit timer measures up to 4 ms. Each halving of the frequency doubles the range. */
+#define ISR_PROFILER_TICKS_TO_NS(TICKS) (((TICKS) * (125UL << ISR_PROFILER_TIMER_FREQ)) / 2) /**< Converts profiler timer ticks to nanoseconds. */
+#define ISR_PROFILER_HISTOGRAM_SIZE     17                                          /**< Histogram buckets, bucket n holds intervals from 2^(n-1) to 2^n - 1 ticks. */
+
 #define ADC_BUFFER_SIZE 6                                                           //Size of buffer for ADC samples. Buffer size should be multiple of number of adc channels located.
 #define ADC_SAMPLE_RATE     		    1000                                        //ADC sampling frequencyng frequency in ms
-
-static nrf_adc_value_t                  adc_buffer[ADC_BUFFER_SIZE];                /**< ADC buffer. */
+#define ADC_SCANS_PER_BUFFER            2                                           /**< Number of scans in an ADC buffer, ADC_BUFFER_SIZE divided by the 3 channels. */
+#define ADC_SEQ_SIZE                    4                                           /**< Size of the scan sequence number in front of the samples of a live NUS packet. */
+
+#define STORE_AND_FORWARD_ENABLED       0                                           /**< Set to 1 to log ADC buffers to flash while they cannot be sent, and drain the log over NUS when a central is connected. Erases flash continuously while no central is connected, see README. */
+#define LOG_FLASH_PAGES                 8                                           /**< Number of flash pages in the log ring, the oldest page is dropped when the ring is full. The flash wear per page is inversely proportional to it. */
+#define LOG_RAM_RECORDS                 4                                           /**< Number of records waiting in RAM for a flash write. */
+#define LOG_RECORD_WORDS                3                                           /**< Words per record: sequence number followed by ADC_BUFFER_SIZE samples packed into 10 bits each. */
+#define LOG_RECORDS_PER_PAGE            ((FS_PAGE_SIZE_WORDS - 1) / LOG_RECORD_WORDS)  /**< Records per page, after the page header word. */
+#define LOG_PACKET_TYPE                 'L'                                         /**< First byte of a NUS packet holding a logged record, live packets hold the samples only. */
+#define LOG_BLANK_WORD                  0xFFFFFFFF                                  /**< Content of an erased flash word. */
+
+#define SPECTRUM_ENABLED                0                                           /**< Set to 1 to analyse SPECTRUM_CHANNEL with Goertzel detectors and an FFT, and send band levels over NUS instead of the samples. Requires STORE_AND_FORWARD_ENABLED set to 0. */
+#define SPECTRUM_SAMPLE_INTERVAL_US     1024                                        /**< Sampling interval while SPECTRUM_ENABLED is set, a multiple of the 32 us timer tick (976.5625 Hz). */
+#define SPECTRUM_CHANNEL                0                                           /**< Analysed ADC channel, AIN2. */
+#define SPECTRUM_FFT_SIZE_LOG2          8                                           /**< log2 of the number of samples per block, 4 to 8. */
+#define SPECTRUM_FFT_SIZE               (1UL << SPECTRUM_FFT_SIZE_LOG2)             /**< Number of samples per block, analysed by the Goertzel detectors and the FFT. */
+#define SPECTRUM_INPUT_SHIFT            4                                           /**< Left shift of the centered 10 bit samples into the 16 bit FFT input. */
+#define SPECTRUM_GOERTZEL_COUNT         4                                           /**< Number of Goertzel detectors, see m_spectrum_goertzel_hz. */
+#define SPECTRUM_BAND_COUNT             7                                           /**< Number of FFT bands, see m_spectrum_band_edges_hz. */
+#define SPECTRUM_GOERTZEL_PACKET_TYPE   'G'                                         /**< First byte of a NUS packet holding the Goertzel detector levels. */
+#define SPECTRUM_BAND_PACKET_TYPE       'F'                                         /**< First byte of a NUS packet holding the FFT band levels. */
+
+#define POWER_METER_ENABLED             0                                           /**< Set to 1 to measure true RMS voltage and current, real and apparent power and power factor over whole mains cycles, and send one report per window over NUS instead of the samples. Requires STORE_AND_FORWARD_ENABLED and SPECTRUM_ENABLED set to 0. */
+#define POWER_SAMPLE_INTERVAL_US        512                                         /**< Sampling interval while POWER_METER_ENABLED is set, a multiple of the 32 us timer tick (1953.125 Hz, 39 scans per 50 Hz cycle). */
+#define POWER_VOLTAGE_CHANNEL           0                                           /**< ADC channel of the voltage input, AIN2. */
+#define POWER_CURRENT_CHANNEL           1                                           /**< ADC channel of the current input, AIN6. */
+#define POWER_VOLTAGE_MV_PER_LSB        715                                         /**< Voltage per ADC code, e.g. 3.52 mV per code with 1/3 prescaling behind a 203:1 divider. */
+#define POWER_CURRENT_MA_PER_LSB        105                                         /**< Current per ADC code, e.g. 3.52 mV per code with 1/3 prescaling from a 30 A/V current clamp. */
+#define POWER_CURRENT_DELAY_US          74                                          /**< Time from the voltage to the current conversion of a scan: 68 us for the 10 bit voltage conversion, plus about 6 us for the driver to start the next channel. Longer when the driver interrupt is held off, e.g. by the SoftDevice around a radio event. */
+#define POWER_CURRENT_FRACTION_BITS     4                                           /**< Fraction bits of the current samples after they are aligned to the voltage samples. */
+#define POWER_ZERO_CROSS_HYSTERESIS_LSB 8                                           /**< Hysteresis of the zero crossing detector on the voltage input, in ADC codes. */
+#define POWER_WINDOW_MS                 1000                                        /**< Minimum length of a measurement window, which is extended to the next rising zero crossing. */
+#define POWER_REPORT_TYPE               'P'                                         /**< First byte of a NUS packet holding a power report. */
+#define POWER_REPORT_SIZE               18                                          /**< Size of a power report packet. */
+
+#define HISTOGRAM_ENABLED               0                                           /**< Set to 1 to collect the distribution of each channel in log-spaced buckets, and send percentiles over NUS once per snapshot period. Works in every mode. */
+#define HISTOGRAM_CHANNEL_COUNT         3                                           /**< Number of channels in the histogram, equal to number_of_adc_channels. */
+#define HISTOGRAM_SUB_BUCKET_BITS       5                                           /**< Resolution of the histogram: codes below 2^n have a bucket each, each octave above has 2^(n-1) buckets. 5 gives 112 buckets per channel, at most 7 (320 buckets per channel, 7.7 kB of RAM) is allowed. */
+#define HISTOGRAM_SNAPSHOT_S            600                                         /**< Snapshot period in seconds, after which the percentiles are sent and the histogram is emptied. */
+#define HISTOGRAM_THRESHOLD_CODE        853                                         /**< ADC code to report the time at or above, 3.0 V with 1/3 prescaling. */
+#define HISTOGRAM_PERCENTILE_COUNT      3                                           /**< Number of reported percentiles, see m_histogram_percentiles. */
+#define HISTOGRAM_REPORT_TYPE           'H'                                         /**< First byte of a NUS packet holding a histogram snapshot of a channel. */
+#define HISTOGRAM_REPORT_SIZE           (13 + 2 * HISTOGRAM_PERCENTILE_COUNT)       /**< Size of a histogram snapshot packet. */
+
+#define ADC_SAMPLES_STREAMED            ((SPECTRUM_ENABLED == 0) && (POWER_METER_ENABLED == 0))  /**< The samples are sent over NUS unless they are analysed on the chip. */
+
+static nrf_adc_value_t                  adc_buffer[2][ADC_BUFFER_SIZE];             /**< ADC buffers, one is filled while the other is processed. */
+static uint8_t                          adc_buffer_index = 0;                       /**< Index of the ADC buffer being filled. */
 static nrf_ppi_channel_t                m_ppi_channel;
 static const nrf_drv_timer_t            m_timer = NRF_DRV_TIMER_INSTANCE(2);
-static uint8_t                          adc_event_counter = 0;
 static uint32_t                         number_of_adc_channels;
+#if ADC_SAMPLES_STREAMED
+static uint32_t                         adc_event_counter = 0;
+static volatile bool                    m_adc_buffer_busy[2];                       /**< True while the main loop processes the buffer, it is not filled again until released. */
+static volatile uint32_t                m_adc_scans_triggered;                      /**< Number of sampling timer events, each starts a scan through PPI. */
+static uint32_t                         m_adc_scan_seq_base;                        /**< Sequence number of the first scan after start, continued from the last record in the flash log if there is one. */
+static uint32_t                         m_adc_scan_next;                            /**< Sequence number expected in the next processed ADC buffer. */
+static uint32_t                         m_adc_scans_not_captured;                   /**< Number of scans missing in the sequence of processed ADC buffers. */
+static uint32_t                         m_adc_scans_not_sent;                       /**< Number of scans neither sent over NUS nor logged. */
+#elif (STORE_AND_FORWARD_ENABLED == 1)
+#error "The spectrum and power reports replace the ADC samples on NUS, set STORE_AND_FORWARD_ENABLED to 0 to use SPECTRUM_ENABLED or POWER_METER_ENABLED."
+#elif (SPECTRUM_ENABLED == 1) && (POWER_METER_ENABLED == 1)
+#error "SPECTRUM_ENABLED and POWER_METER_ENABLED cannot be used together."
+#endif
+#if (SPECTRUM_ENABLED == 1) && (ISR_PROFILER_ENABLED == 1)
+#error "SPECTRUM_ENABLED counts the CPU cycles of the analysis with TIMER1, which ISR_PROFILER_ENABLED uses as well."
+#endif
+STATIC_ASSERT(ADC_SCANS_PER_BUFFER * 3 == ADC_BUFFER_SIZE);
 
 static ble_nus_t                        m_nus;                                      /**< Structure to identify the Nordic UART Service. */
 static uint16_t                         m_conn_handle = BLE_CONN_HANDLE_INVALID;    /**< Handle of the current connection. */
 
 static ble_uuid_t                       m_adv_uuids[] = {{BLE_UUID_NUS_SERVICE, NUS_SERVICE_UUID_TYPE}};  /**< Universally unique service identifier. */
 
+/**@brief Application event types. Events are posted from interrupt context and processed in the main loop. */
+typedef enum
+{
+    APP_EVT_BLE,                                                            /**< SoftDevice events are available. */
+    APP_EVT_UART_RX,                                                        /**< A line was received on UART. */
+    APP_EVT_ADC_DONE,                                                       /**< An ADC buffer is filled. */
+    APP_EVT_ISR_PROFILE_DUMP,                                               /**< Button 4 was pressed, print the interrupt handler profile. */
+    APP_EVT_SPECTRUM_BLOCK,                                                 /**< A block of samples is ready for spectral analysis. */
+    APP_EVT_POWER_WINDOW,                                                   /**< A power measurement window is complete. */
+    APP_EVT_HISTOGRAM_SNAPSHOT,                                             /**< A histogram snapshot period is complete. */
+} app_evt_type_t;
+
+/**@brief Application event priorities. Events of lower priority are deferred while events of higher priority are pending. */
+typedef enum
+{
+    APP_EVT_PRIORITY_HIGH,                                                  /**< Protocol and user input events. */
+    APP_EVT_PRIORITY_LOW,                                                   /**< Measurement processing. */
+    APP_EVT_PRIORITY_COUNT                                                  /**< Number of event priorities. */
+} app_evt_priority_t;
+
+/**@brief Fixed-size application event, copied into the scheduler queue. */
+typedef struct
+{
+    app_evt_type_t type;                                                    /**< Event type. */
+    union
+    {
+        struct
+        {
+            uint8_t data[BLE_NUS_MAX_DATA_LEN];                             /**< Received characters. */
+            uint8_t length;                                                 /**< Number of received characters. */
+        } uart_rx;                                                          /**< Parameters of @ref APP_EVT_UART_RX. */
+        struct
+        {
+            nrf_adc_value_t const * p_buffer;                               /**< Filled ADC buffer. */
+            uint16_t                size;                                   /**< Number of samples in the buffer. */
+            uint32_t                seq;                                    /**< Sequence number of the first scan in the buffer. */
+            uint8_t                 index;                                  /**< Index of the buffer in adc_buffer, released after processing. */
+        } adc_done;                                                         /**< Parameters of @ref APP_EVT_ADC_DONE. */
+        struct
+        {
+            int16_t * p_block;                                              /**< Block of SPECTRUM_FFT_SIZE samples. */
+        } spectrum_block;                                                   /**< Parameters of @ref APP_EVT_SPECTRUM_BLOCK. */
+        struct
+        {
+            uint8_t index;                                                  /**< Index of the window in m_power_window. */
+        } power_window;                                                     /**< Parameters of @ref APP_EVT_POWER_WINDOW. */
+        struct
+        {
+            uint8_t index;                                                  /**< Index of the histogram in m_histogram. */
+        } histogram;                                                        /**< Parameters of @ref APP_EVT_HISTOGRAM_SNAPSHOT. */
+    } params;
+} app_evt_t;
+
+#if (ISR_PROFILER_ENABLED == 1)
+/**@brief Profiled intervals. */
+typedef enum
+{
+    ISR_PROFILE_ADC_LATENCY,                                                /**< ADC END event to adc_event_handler entry. Includes the driver ADC_IRQHandler and preemption by the SoftDevice and higher priority interrupts. */
+    ISR_PROFILE_ADC_HANDLER,                                                /**< Duration of adc_event_handler. */
+    ISR_PROFILE_UART_HANDLER,                                               /**< Duration of uart_event_handle. */
+    ISR_PROFILE_COUNT                                                       /**< Number of profiled intervals. */
+} isr_profile_id_t;
+
+/**@brief Statistics of a profiled interval. */
+typedef struct
+{
+    uint32_t count;                                                         /**< Number of measurements. */
+    uint16_t min;                                                           /**< Shortest interval (ticks). */
+    uint16_t max;                                                           /**< Longest interval (ticks). */
+    uint32_t histogram[ISR_PROFILER_HISTOGRAM_SIZE];                        /**< Number of measurements per power of two bucket. */
+} isr_profile_t;
+#endif
+
+static volatile uint8_t                 m_app_evt_pending[APP_EVT_PRIORITY_COUNT];  /**< Number of queued application events per priority. */
+static uint8_t                          m_app_evt_queue_max;                        /**< High-water mark of the number of queued application events. */
+static uint8_t                          m_app_evt_queue_max_reported;               /**< High-water mark last reported on the log. */
+static volatile uint32_t                m_app_evt_dropped;                          /**< Number of application events dropped because the scheduler queue was full. */
+static uint32_t                         m_app_evt_dropped_reported;                 /**< Number of dropped application events last reported on the log. */
+static volatile bool                    m_softdevice_evt_scheduled;                 /**< True while an @ref APP_EVT_BLE event is queued. */
+
+static void app_evt_handler(void * p_event_data, uint16_t event_size);
+
+
+/**@brief Function for getting the priority of an application event type.
+ */
+static app_evt_priority_t app_evt_priority_get(app_evt_type_t type)
+{
+    return ((type == APP_EVT_ADC_DONE) || (type == APP_EVT_ISR_PROFILE_DUMP) || (type == APP_EVT_SPECTRUM_BLOCK) ||
+            (type == APP_EVT_POWER_WINDOW) || (type == APP_EVT_HISTOGRAM_SNAPSHOT)) ? APP_EVT_PRIORITY_LOW : APP_EVT_PRIORITY_HIGH;
+}
+
+
+/**@brief Function for posting an application event to the scheduler queue.
+ *
+ * @details May be called from interrupt context. The event is copied into the queue.
+ *
+ * @param[in] p_evt  Event to post.
+ *
+ * @return NRF_SUCCESS, or NRF_ERROR_NO_MEM if the scheduler queue is full. The dropped event is
+ *         counted and reported on the log from the main loop.
+ */
+static uint32_t app_evt_put(app_evt_t const * p_evt)
+{
+    uint32_t err_code;
+    uint8_t  queued = 0;
+
+    CRITICAL_REGION_ENTER();
+    err_code = app_sched_event_put(p_evt, sizeof(app_evt_t), app_evt_handler);
+    if (err_code == NRF_SUCCESS)
+    {
+        m_app_evt_pending[app_evt_priority_get(p_evt->type)]++;
+        for (uint32_t i = 0; i < APP_EVT_PRIORITY_COUNT; i++)
+        {
+            queued += m_app_evt_pending[i];
+        }
+        if (queued > m_app_evt_queue_max)
+        {
+            m_app_evt_queue_max = queued;
+        }
+    }
+    else
+    {
+        m_app_evt_dropped++;
+    }
+    CRITICAL_REGION_EXIT();
+
+    return err_code;
+}
+
+
+/**@brief Function for scheduling SoftDevice event processing in the main loop.
+ *
+ * @details Called by the SoftDevice handler from the SoftDevice event interrupt. One queued event
+ *          pulls all pending SoftDevice events, so no further event is queued until it is processed.
+ */
+static uint32_t softdevice_evt_schedule(void)
+{
+    uint32_t  err_code;
+    app_evt_t evt;
+
+    if (m_softdevice_evt_scheduled)
+    {
+        return NRF_SUCCESS;
+    }
+
+    evt.type = APP_EVT_BLE;
+    err_code = app_evt_put(&evt);
+    if (err_code == NRF_SUCCESS)
+    {
+        m_softdevice_evt_scheduled = true;
+    }
+    return err_code;
+}
+
+
+#if (ISR_PROFILER_ENABLED == 1)
+static const nrf_drv_timer_t            m_isr_profiler_timer = NRF_DRV_TIMER_INSTANCE(1); /**< Free running timer. CC[0] captures the ADC END event, CC[1] is used for timestamps. */
+static isr_profile_t                    m_isr_profile[ISR_PROFILE_COUNT];           /**< Statistics per profiled interval. */
+static const char * const               m_isr_profile_names[ISR_PROFILE_COUNT] =    /**< Names of the profiled intervals, indexed by isr_profile_id_t. */
+{
+    "ADC END to adc_event_handler",
+    "adc_event_handler",
+    "uart_event_handle"
+};
+
+/**@brief Function for getting a profiler timestamp. May be called from any interrupt priority. */
+static uint16_t isr_profiler_time_get(void)
+{
+    uint16_t time;
+
+    CRITICAL_REGION_ENTER();
+    time = nrf_drv_timer_capture(&m_isr_profiler_timer, NRF_TIMER_CC_CHANNEL1);
+    CRITICAL_REGION_EXIT();
+    return time;
+}
+
+
+/**@brief Function for adding a measured interval to its statistics.
+ *
+ * @param[in] id     Profiled interval.
+ * @param[in] start  Timestamp at the start of the interval.
+ * @param[in] end    Timestamp at the end of the interval.
+ */
+static void isr_profile_record(isr_profile_id_t id, uint16_t start, uint16_t end)
+{
+    uint16_t        ticks   = end - start;
+    uint8_t         bucket  = 0;
+    isr_profile_t * p_profile = &m_isr_profile[id];
+
+    while ((bucket < ISR_PROFILER_HISTOGRAM_SIZE - 1) && ((ticks >> bucket) != 0))
+    {
+        bucket++;
+    }
+
+    CRITICAL_REGION_ENTER();
+    if ((p_profile->count == 0) || (ticks < p_profile->min))
+    {
+        p_profile->min = ticks;
+    }
+    if (ticks > p_profile->max)
+    {
+        p_profile->max = ticks;
+    }
+    p_profile->count++;
+    p_profile->histogram[bucket]++;
+    CRITICAL_REGION_EXIT();
+}
+
+
+/**@brief Function for printing the profile on UART and starting over. Called in the main context.
+ */
+static void isr_profile_dump(void)
+{
+    isr_profile_t profile;
+
+    printf("\r\nInterrupt handler profile:\r\n");
+    for (uint32_t id = 0; id < ISR_PROFILE_COUNT; id++)
+    {
+        CRITICAL_REGION_ENTER();
+        profile = m_isr_profile[id];
+        memset(&m_isr_profile[id], 0, sizeof(isr_profile_t));
+        CRITICAL_REGION_EXIT();
+
+        printf("%s: %lu samples, min %lu ns, max %lu ns\r\n", m_isr_profile_names[id], (unsigned long)profile.count,
+               (unsigned long)ISR_PROFILER_TICKS_TO_NS(profile.min), (unsigned long)ISR_PROFILER_TICKS_TO_NS(profile.max));
+        for (uint32_t bucket = 1; bucket < ISR_PROFILER_HISTOGRAM_SIZE; bucket++)
+        {
+            if (profile.histogram[bucket] != 0)
+            {
+                printf("    %lu - %lu ns: %lu\r\n", (unsigned long)ISR_PROFILER_TICKS_TO_NS(1UL << (bucket - 1)),
+                       (unsigned long)ISR_PROFILER_TICKS_TO_NS((1UL << bucket) - 1), (unsigned long)profile.histogram[bucket]);
+            }
+        }
+    }
+}
+
+
+/**@brief Profiler timer interrupt handler. */
+static void isr_profiler_timer_handler(nrf_timer_event_t event_type, void * p_context)
+{
+}
+
+
+/**@brief Function for starting the free running profiler timer and capturing the ADC END event in CC[0] through PPI.
+ */
+static void isr_profiler_init(void)
+{
+    ret_code_t        err_code;
+    nrf_ppi_channel_t ppi_channel;
+
+    err_code = nrf_drv_ppi_init();
+    if (err_code != NRF_ERROR_MODULE_ALREADY_INITIALIZED)
+    {
+        APP_ERROR_CHECK(err_code);
+    }
+
+    nrf_drv_timer_config_t timer_cfg = NRF_DRV_TIMER_DEFAULT_CONFIG;
+    timer_cfg.frequency = ISR_PROFILER_TIMER_FREQ;
+    timer_cfg.bit_width = NRF_TIMER_BIT_WIDTH_16;
+    err_code = nrf_drv_timer_init(&m_isr_profiler_timer, &timer_cfg, isr_profiler_timer_handler);
+    APP_ERROR_CHECK(err_code);
+
+    err_code = nrf_drv_ppi_channel_alloc(&ppi_channel);
+    APP_ERROR_CHECK(err_code);
+    err_code = nrf_drv_ppi_channel_assign(ppi_channel, (uint32_t)&NRF_ADC->EVENTS_END,
+                                          nrf_drv_timer_capture_task_address_get(&m_isr_profiler_timer, NRF_TIMER_CC_CHANNEL0));
+    APP_ERROR_CHECK(err_code);
+    err_code = nrf_drv_ppi_channel_enable(ppi_channel);
+    APP_ERROR_CHECK(err_code);
+
+    nrf_drv_timer_enable(&m_isr_profiler_timer);
+}
+
+#define ISR_PROFILE_ENTRY()             uint16_t isr_profile_entry = isr_profiler_time_get()                        /**< Takes the entry timestamp of a profiled handler. */
+#define ISR_PROFILE_EXIT(ID)            isr_profile_record((ID), isr_profile_entry, isr_profiler_time_get())        /**< Records the duration of a profiled handler. */
+#else
+#define ISR_PROFILE_ENTRY()
+#define ISR_PROFILE_EXIT(ID)
+#endif
+
 
 /**@brief Function for assert macro callback.
  *
@@ -267,352 +619,1695 @@ static void on_adv_evt(ble_adv_evt_t ble_adv_evt)
 }
 
 
-/**@brief Function for the application's SoftDevice event handler.
+#if (POWER_METER_ENABLED == 1) || (HISTOGRAM_ENABLED == 1) || ADC_SAMPLES_STREAMED
+/**@brief Function for putting a value into a report, most significant byte first.
  *
- * @param[in] p_ble_evt SoftDevice event.
+ * @return Pointer to the byte after the value.
  */
-static void on_ble_evt(ble_evt_t * p_ble_evt)
+static uint8_t * report_put(uint8_t * p_data, uint32_t value, uint8_t size)
 {
-    uint32_t err_code;
-
-    switch (p_ble_evt->header.evt_id)
+    while (size-- > 0)
     {
-        case BLE_GAP_EVT_CONNECTED:
-            err_code = bsp_indication_set(BSP_INDICATE_CONNECTED);
-            APP_ERROR_CHECK(err_code);
-            m_conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
-            break; // BLE_GAP_EVT_CONNECTED
+        *p_data++ = (uint8_t)(value >> (8 * size));
+    }
+    return p_data;
+}
+#endif
 
-        case BLE_GAP_EVT_DISCONNECTED:
-            err_code = bsp_indication_set(BSP_INDICATE_IDLE);
-            APP_ERROR_CHECK(err_code);
-            m_conn_handle = BLE_CONN_HANDLE_INVALID;
-            break; // BLE_GAP_EVT_DISCONNECTED
 
-        case BLE_GAP_EVT_SEC_PARAMS_REQUEST:
-            // Pairing not supported
-            err_code = sd_ble_gap_sec_params_reply(m_conn_handle, BLE_GAP_SEC_STATUS_PAIRING_NOT_SUPP, NULL, NULL);
-            APP_ERROR_CHECK(err_code);
-            break; // BLE_GAP_EVT_SEC_PARAMS_REQUEST
+/**@brief Function for sending a notification over NUS and keeping track of it until BLE_EVT_TX_COMPLETE.
+ *
+ * @param[in] is_log  True if the packet holds a logged record.
+ */
+static uint32_t nus_packet_send(uint8_t * p_data, uint16_t length, bool is_log);
 
-        case BLE_GATTS_EVT_SYS_ATTR_MISSING:
-            // No system attributes have been stored.
-            err_code = sd_ble_gatts_sys_attr_set(m_conn_handle, NULL, 0, 0);
-            APP_ERROR_CHECK(err_code);
-            break; // BLE_GATTS_EVT_SYS_ATTR_MISSING
+#if (STORE_AND_FORWARD_ENABLED == 1)
+STATIC_ASSERT(ADC_BUFFER_SIZE * 10 <= (LOG_RECORD_WORDS - 1) * 32);
 
-        case BLE_GATTC_EVT_TIMEOUT:
-            // Disconnect on GATT Client timeout event.
-            err_code = sd_ble_gap_disconnect(p_ble_evt->evt.gattc_evt.conn_handle,
-                                             BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
-            APP_ERROR_CHECK(err_code);
-            break; // BLE_GATTC_EVT_TIMEOUT
+/**@brief Position in the log ring. */
+typedef struct
+{
+    uint8_t page;                                                           /**< Page index in the ring. */
+    uint8_t slot;                                                           /**< Record index in the page. */
+} log_pos_t;
 
-        case BLE_GATTS_EVT_TIMEOUT:
-            // Disconnect on GATT Server timeout event.
-            err_code = sd_ble_gap_disconnect(p_ble_evt->evt.gatts_evt.conn_handle,
-                                             BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
-            APP_ERROR_CHECK(err_code);
-            break; // BLE_GATTS_EVT_TIMEOUT
+static void log_fs_evt_handler(fs_evt_t const * const p_evt, fs_ret_t result);
 
-        case BLE_EVT_USER_MEM_REQUEST:
-            err_code = sd_ble_user_mem_reply(p_ble_evt->evt.gattc_evt.conn_handle, NULL);
-            APP_ERROR_CHECK(err_code);
-            break; // BLE_EVT_USER_MEM_REQUEST
+FS_REGISTER_CFG(fs_config_t m_log_fs_config) =
+{
+    .callback  = log_fs_evt_handler,
+    .num_pages = LOG_FLASH_PAGES,
+    .priority  = 0xFE                                                       /**< Placed right below the pages of higher priority users, such as FDS. */
+};
+
+static uint32_t                         m_log_staging[LOG_RAM_RECORDS][LOG_RECORD_WORDS];  /**< Records waiting for a flash write, the source must stay valid until the write completes. */
+static uint8_t                          m_log_staging_tail;                         /**< Index of the oldest record waiting in RAM. */
+static uint8_t                          m_log_staging_count;                        /**< Number of records waiting in RAM. */
+static uint32_t                         m_log_page_header;                          /**< Header of the page being written, a sequence number that orders the pages after a reset. */
+static log_pos_t                        m_log_write;                                /**< Next record to write. */
+static log_pos_t                        m_log_read;                                 /**< Oldest record not yet confirmed by BLE_EVT_TX_COMPLETE. */
+static log_pos_t                        m_log_send;                                 /**< Next record to send, reset to m_log_read when the link drops. */
+static bool                             m_log_write_page_open;                      /**< True when the header of the write page is in flash. */
+static uint32_t                         m_log_erase_pending;                        /**< Bit mask of drained pages to erase. */
+static bool                             m_log_flash_busy;                           /**< True while a flash operation is queued in fstorage. */
+static uint32_t                         m_log_dropped;                              /**< Number of records lost because the log was full. */
+static uint32_t                         m_tx_log_mask;                              /**< Packets in the SoftDevice TX queue, oldest in bit 0. A bit is set for a logged record. */
+static uint8_t                          m_tx_count;                                 /**< Number of packets in the SoftDevice TX queue. */
+
+
+/**@brief Function for getting the address of a page of the log ring. */
+static uint32_t const * log_page_addr(uint8_t page)
+{
+    return m_log_fs_config.p_start_addr + page * FS_PAGE_SIZE_WORDS;
+}
 
-        case BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST:
-        {
-            ble_gatts_evt_rw_authorize_request_t  req;
-            ble_gatts_rw_authorize_reply_params_t auth_reply;
 
-            req = p_ble_evt->evt.gatts_evt.params.authorize_request;
+/**@brief Function for getting the address of a record in flash. */
+static uint32_t const * log_record_addr(log_pos_t pos)
+{
+    return log_page_addr(pos.page) + 1 + pos.slot * LOG_RECORD_WORDS;
+}
 
-            if (req.type != BLE_GATTS_AUTHORIZE_TYPE_INVALID)
-            {
-                if ((req.request.write.op == BLE_GATTS_OP_PREP_WRITE_REQ)     ||
-                    (req.request.write.op == BLE_GATTS_OP_EXEC_WRITE_REQ_NOW) ||
-                    (req.request.write.op == BLE_GATTS_OP_EXEC_WRITE_REQ_CANCEL))
-                {
-                    if (req.type == BLE_GATTS_AUTHORIZE_TYPE_WRITE)
-                    {
-                        auth_reply.type = BLE_GATTS_AUTHORIZE_TYPE_WRITE;
-                    }
-                    else
-                    {
-                        auth_reply.type = BLE_GATTS_AUTHORIZE_TYPE_READ;
-                    }
-                    auth_reply.params.write.gatt_status = APP_FEATURE_NOT_SUPPORTED;
-                    err_code = sd_ble_gatts_rw_authorize_reply(p_ble_evt->evt.gatts_evt.conn_handle,
-                                                               &auth_reply);
-                    APP_ERROR_CHECK(err_code);
-                }
-            }
-        } break; // BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST
 
-#if (NRF_SD_BLE_API_VERSION == 3)
-        case BLE_GATTS_EVT_EXCHANGE_MTU_REQUEST:
-            err_code = sd_ble_gatts_exchange_mtu_reply(p_ble_evt->evt.gatts_evt.conn_handle,
-                                                       NRF_BLE_MAX_MTU_SIZE);
-            APP_ERROR_CHECK(err_code);
-            break; // BLE_GATTS_EVT_EXCHANGE_MTU_REQUEST
-#endif
+/**@brief Function for comparing two log positions. */
+static bool log_pos_equal(log_pos_t a, log_pos_t b)
+{
+    return (a.page == b.page) && (a.slot == b.slot);
+}
 
-        default:
-            // No implementation needed.
-            break;
+
+/**@brief Function for advancing a log position by one record, wrapping to the next page. */
+static void log_pos_next(log_pos_t * p_pos)
+{
+    if (++p_pos->slot == LOG_RECORDS_PER_PAGE)
+    {
+        p_pos->slot = 0;
+        p_pos->page = (p_pos->page + 1) % LOG_FLASH_PAGES;
     }
 }
 
 
-/**@brief Function for dispatching a SoftDevice event to all modules with a SoftDevice
- *        event handler.
- *
- * @details This function is called from the SoftDevice event interrupt handler after a
- *          SoftDevice event has been received.
- *
- * @param[in] p_ble_evt  SoftDevice event.
+/**@brief Function for checking whether all logged records have been sent.
  */
-static void ble_evt_dispatch(ble_evt_t * p_ble_evt)
+static bool log_is_empty(void)
 {
-    ble_conn_params_on_ble_evt(p_ble_evt);
-    ble_nus_on_ble_evt(&m_nus, p_ble_evt);
-    on_ble_evt(p_ble_evt);
-    ble_advertising_on_ble_evt(p_ble_evt);
-    bsp_btn_ble_on_ble_evt(p_ble_evt);
-
+    return log_pos_equal(m_log_send, m_log_write) && (m_log_staging_count == 0);
 }
 
 
-/**@brief Function for the SoftDevice initialization.
- *
- * @details This function initializes the SoftDevice and the BLE event interrupt.
+/**
+ * @brief Function for compressing an ADC buffer into a log record.
+ * The 10 bit samples are packed without gaps after the sequence number, at 1.3 bytes per sample instead of 2.
  */
-static void ble_stack_init(void)
+static void log_record_pack(uint32_t seq, nrf_adc_value_t const * p_buffer, uint16_t size, uint32_t * p_record)
 {
-    uint32_t err_code;
-
-    nrf_clock_lf_cfg_t clock_lf_cfg = NRF_CLOCK_LFCLKSRC;
-
-    // Initialize SoftDevice.
-    SOFTDEVICE_HANDLER_INIT(&clock_lf_cfg, NULL);
-
-    ble_enable_params_t ble_enable_params;
-    err_code = softdevice_enable_get_default_config(CENTRAL_LINK_COUNT,
-                                                    PERIPHERAL_LINK_COUNT,
-                                                    &ble_enable_params);
-    APP_ERROR_CHECK(err_code);
-
-    //Check the ram settings against the used number of links
-    CHECK_RAM_START_ADDR(CENTRAL_LINK_COUNT,PERIPHERAL_LINK_COUNT);
-
-    // Enable BLE stack.
-#if (NRF_SD_BLE_API_VERSION == 3)
-    ble_enable_params.gatt_enable_params.att_mtu = NRF_BLE_MAX_MTU_SIZE;
-#endif
-    err_code = softdevice_enable(&ble_enable_params);
-    APP_ERROR_CHECK(err_code);
+    uint64_t packed = 0;
 
-    // Subscribe for BLE events.
-    err_code = softdevice_ble_evt_handler_set(ble_evt_dispatch);
-    APP_ERROR_CHECK(err_code);
+    for (uint32_t i = 0; i < size; i++)
+    {
+        packed |= (uint64_t)(p_buffer[i] & 0x3FF) << (i * 10);
+    }
+    p_record[0] = seq;
+    p_record[1] = (uint32_t)packed;
+    p_record[2] = (uint32_t)(packed >> 32);
 }
 
 
-/**@brief Function for handling events from the BSP module.
+/**@brief Function for starting the next flash operation of the log.
  *
- * @param[in]   event   Event generated by button press.
+ * @details Drained pages are erased first. A record is written once the write page is erased and
+ *          its header written. Only one operation is queued at a time.
  */
-void bsp_event_handler(bsp_event_t event)
+static void log_flash_next(void)
+{
+    fs_ret_t ret = FS_SUCCESS;
+
+    if (m_log_flash_busy)
+    {
+        return;
+    }
+
+    if ((m_log_staging_count > 0) && !m_log_write_page_open && (*log_page_addr(m_log_write.page) != LOG_BLANK_WORD))
+    {
+        m_log_erase_pending |= 1UL << m_log_write.page;                     //Reused page, erased before its header is written
+    }
+
+    if (m_log_erase_pending != 0)
+    {
+        uint8_t page = 0;
+        while ((m_log_erase_pending & (1UL << page)) == 0)
+        {
+            page++;
+        }
+        ret = fs_erase(&m_log_fs_config, log_page_addr(page), 1, (void *)(uint32_t)page);
+    }
+    else if (m_log_staging_count > 0)
+    {
+        if (!m_log_write_page_open)
+        {
+            ret = fs_store(&m_log_fs_config, log_page_addr(m_log_write.page), &m_log_page_header, 1, NULL);
+        }
+        else
+        {
+            ret = fs_store(&m_log_fs_config, log_record_addr(m_log_write), m_log_staging[m_log_staging_tail], LOG_RECORD_WORDS, NULL);
+        }
+    }
+    else
+    {
+        return;
+    }
+
+    if (ret == FS_SUCCESS)
+    {
+        m_log_flash_busy = true;
+    }
+    else
+    {
+        APP_ERROR_CHECK(ret);
+    }
+}
+
+
+/**@brief Function for moving the write position to the next page.
+ *
+ * @details The oldest page is dropped when the ring is full.
+ */
+static void log_write_page_advance(void)
+{
+    m_log_write.page      = (m_log_write.page + 1) % LOG_FLASH_PAGES;
+    m_log_write.slot      = 0;
+    m_log_write_page_open = false;
+    m_log_page_header++;
+
+    if (m_log_read.page == m_log_write.page)
+    {
+        m_log_dropped      += LOG_RECORDS_PER_PAGE - m_log_read.slot;
+        m_log_read.page     = (m_log_write.page + 1) % LOG_FLASH_PAGES;
+        m_log_read.slot     = 0;
+        m_log_send          = m_log_read;
+        m_tx_log_mask       = 0;                                            //Records in flight are from the dropped page
+        printf("Log full, %d records dropped\r\n", (int)m_log_dropped);
+    }
+}
+
+
+/**@brief Function for sending logged records over NUS.
+ *
+ * @details One record per notification, until the SoftDevice runs out of TX buffers. Draining is
+ *          continued on BLE_EVT_TX_COMPLETE and whenever a record is written. A record counts as
+ *          drained when its notification is completed, so a drain interrupted by a link drop is
+ *          resumed from the first record that did not reach the central.
+ *
+ *          The record is sent most significant byte first, like the live packets: the sequence
+ *          number, then the packed samples as one 64 bit value.
+ */
+static void log_drain(void)
+{
+    uint32_t err_code = NRF_SUCCESS;
+    uint8_t  packet[1 + LOG_RECORD_WORDS * sizeof(uint32_t)];
+
+    while (!log_pos_equal(m_log_send, m_log_write))
+    {
+        uint32_t const * p_record = log_record_addr(m_log_send);
+        uint8_t          * p_data   = &packet[1];
+
+        packet[0] = LOG_PACKET_TYPE;
+        p_data    = report_put(p_data, p_record[0], 4);
+        p_data    = report_put(p_data, p_record[2], 4);                     //High word of the packed samples first
+        (void)report_put(p_data, p_record[1], 4);
+
+        err_code = nus_packet_send(packet, sizeof(packet), true);
+        if (err_code != NRF_SUCCESS)
+        {
+            break;
+        }
+        log_pos_next(&m_log_send);
+    }
+
+    if ((err_code != NRF_SUCCESS) &&
+        (err_code != BLE_ERROR_NO_TX_PACKETS) &&
+        (err_code != NRF_ERROR_INVALID_STATE) &&
+        (err_code != BLE_ERROR_GATTS_SYS_ATTR_MISSING))
+    {
+        APP_ERROR_HANDLER(err_code);
+    }
+}
+
+
+/**@brief Function for handling fstorage events of the log.
+ */
+static void log_fs_evt_handler(fs_evt_t const * const p_evt, fs_ret_t result)
+{
+    m_log_flash_busy = false;
+
+    if (result != FS_SUCCESS)
+    {
+        log_flash_next();                                                   //Flash access timed out next to radio activity, retry
+        return;
+    }
+
+    if (p_evt->id == FS_EVT_ERASE)
+    {
+        m_log_erase_pending &= ~(1UL << (uint32_t)p_evt->p_context);
+    }
+    else if (!m_log_write_page_open)
+    {
+        m_log_write_page_open = true;                                       //Page header written
+    }
+    else
+    {
+        m_log_staging_tail = (m_log_staging_tail + 1) % LOG_RAM_RECORDS;
+        m_log_staging_count--;
+        if (++m_log_write.slot == LOG_RECORDS_PER_PAGE)
+        {
+            log_write_page_advance();
+        }
+    }
+
+    log_flash_next();
+    if (m_conn_handle != BLE_CONN_HANDLE_INVALID)
+    {
+        log_drain();
+    }
+}
+
+
+/**@brief Function for appending an ADC buffer to the log.
+ */
+static void log_append(nrf_adc_value_t const * p_buffer, uint16_t size, uint32_t seq)
+{
+    if (m_log_staging_count == LOG_RAM_RECORDS)
+    {
+        m_log_dropped++;                                                    //Flash writes do not keep up
+        return;
+    }
+    log_record_pack(seq, p_buffer, size, m_log_staging[(m_log_staging_tail + m_log_staging_count) % LOG_RAM_RECORDS]);
+    m_log_staging_count++;
+    log_flash_next();
+}
+
+
+/**@brief Function for marking records as drained when their notifications are completed.
+ *
+ * @details Drained pages are erased, so they are not sent again after a reset.
+ *
+ * @param[in] count  Number of completed notifications.
+ */
+static void log_tx_complete(uint8_t count)
+{
+    while ((count > 0) && (m_tx_count > 0))
+    {
+        if ((m_tx_log_mask & 1) && !log_pos_equal(m_log_read, m_log_send))
+        {
+            uint8_t page = m_log_read.page;
+            log_pos_next(&m_log_read);
+            if (m_log_read.page != page)
+            {
+                m_log_erase_pending |= 1UL << page;
+            }
+        }
+        m_tx_log_mask >>= 1;
+        m_tx_count--;
+        count--;
+    }
+    log_flash_next();
+}
+
+
+/**@brief Function for resuming the drain from the oldest record not confirmed, after a link drop.
+ */
+static void log_link_lost(void)
+{
+    m_log_send    = m_log_read;
+    m_tx_log_mask = 0;
+    m_tx_count    = 0;
+}
+
+
+/**@brief Function for initializing the log and finding the records left in flash before a reset.
+ *
+ * @details The pages holding records form a contiguous segment of the ring. The page with the
+ *          lowest header is the oldest one, writing is continued in the page with the highest header.
+ *          Scan numbering continues after the last record in flash. That is the last record of the
+ *          previous page when the write page was opened just before the reset, and numbering only
+ *          restarts at 0 when no record is left.
+ */
+static void log_init(void)
+{
+    bool     found = false;
+    uint32_t header_min = 0;
+    uint32_t header_max = 0;
+
+    APP_ERROR_CHECK(fs_init());
+
+    for (uint8_t page = 0; page < LOG_FLASH_PAGES; page++)
+    {
+        uint32_t header = *log_page_addr(page);
+
+        if (header == LOG_BLANK_WORD)
+        {
+            continue;
+        }
+        if (!found || (header < header_min))
+        {
+            header_min        = header;
+            m_log_read.page   = page;
+        }
+        if (!found || (header > header_max))
+        {
+            header_max        = header;
+            m_log_write.page  = page;
+        }
+        found = true;
+    }
+
+    if (found)
+    {
+        m_log_page_header     = header_max;
+        m_log_write_page_open = true;
+        while ((m_log_write.slot < LOG_RECORDS_PER_PAGE) && (*log_record_addr(m_log_write) != LOG_BLANK_WORD))
+        {
+            m_adc_scan_seq_base = *log_record_addr(m_log_write) + ADC_SCANS_PER_BUFFER;
+            m_log_write.slot++;
+        }
+        if ((m_log_write.slot == 0) && (header_max > header_min))
+        {
+            log_pos_t last;
+
+            last.page = (m_log_write.page + LOG_FLASH_PAGES - 1) % LOG_FLASH_PAGES;   //The write page has no record yet, continue after the previous page
+            for (last.slot = 0; (last.slot < LOG_RECORDS_PER_PAGE) && (*log_record_addr(last) != LOG_BLANK_WORD); last.slot++)
+            {
+                m_adc_scan_seq_base = *log_record_addr(last) + ADC_SCANS_PER_BUFFER;
+            }
+        }
+        if (m_log_write.slot == LOG_RECORDS_PER_PAGE)
+        {
+            log_write_page_advance();
+        }
+    }
+    m_log_send = m_log_read;
+
+    m_adc_scan_next = m_adc_scan_seq_base;
+    printf("Log: pages %d to %d, next scan %lu\r\n", m_log_read.page, m_log_write.page, (unsigned long)m_adc_scan_seq_base);
+}
+#endif
+
+
+/**@brief Function for the application's SoftDevice event handler.
+ *
+ * @param[in] p_ble_evt SoftDevice event.
+ */
+static void on_ble_evt(ble_evt_t * p_ble_evt)
 {
     uint32_t err_code;
-    switch (event)
+
+    switch (p_ble_evt->header.evt_id)
+    {
+        case BLE_GAP_EVT_CONNECTED:
+            err_code = bsp_indication_set(BSP_INDICATE_CONNECTED);
+            APP_ERROR_CHECK(err_code);
+            m_conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+            break; // BLE_GAP_EVT_CONNECTED
+
+        case BLE_GAP_EVT_DISCONNECTED:
+            err_code = bsp_indication_set(BSP_INDICATE_IDLE);
+            APP_ERROR_CHECK(err_code);
+            m_conn_handle = BLE_CONN_HANDLE_INVALID;
+#if (STORE_AND_FORWARD_ENABLED == 1)
+            log_link_lost();
+#endif
+            break; // BLE_GAP_EVT_DISCONNECTED
+
+        case BLE_GAP_EVT_SEC_PARAMS_REQUEST:
+            // Pairing not supported
+            err_code = sd_ble_gap_sec_params_reply(m_conn_handle, BLE_GAP_SEC_STATUS_PAIRING_NOT_SUPP, NULL, NULL);
+            APP_ERROR_CHECK(err_code);
+            break; // BLE_GAP_EVT_SEC_PARAMS_REQUEST
+
+        case BLE_GATTS_EVT_SYS_ATTR_MISSING:
+            // No system attributes have been stored.
+            err_code = sd_ble_gatts_sys_attr_set(m_conn_handle, NULL, 0, 0);
+            APP_ERROR_CHECK(err_code);
+            break; // BLE_GATTS_EVT_SYS_ATTR_MISSING
+
+        case BLE_GATTC_EVT_TIMEOUT:
+            // Disconnect on GATT Client timeout event.
+            err_code = sd_ble_gap_disconnect(p_ble_evt->evt.gattc_evt.conn_handle,
+                                             BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+            APP_ERROR_CHECK(err_code);
+            break; // BLE_GATTC_EVT_TIMEOUT
+
+        case BLE_GATTS_EVT_TIMEOUT:
+            // Disconnect on GATT Server timeout event.
+            err_code = sd_ble_gap_disconnect(p_ble_evt->evt.gatts_evt.conn_handle,
+                                             BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+            APP_ERROR_CHECK(err_code);
+            break; // BLE_GATTS_EVT_TIMEOUT
+
+        case BLE_EVT_USER_MEM_REQUEST:
+            err_code = sd_ble_user_mem_reply(p_ble_evt->evt.gattc_evt.conn_handle, NULL);
+            APP_ERROR_CHECK(err_code);
+            break; // BLE_EVT_USER_MEM_REQUEST
+
+        case BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST:
+        {
+            ble_gatts_evt_rw_authorize_request_t  req;
+            ble_gatts_rw_authorize_reply_params_t auth_reply;
+
+            req = p_ble_evt->evt.gatts_evt.params.authorize_request;
+
+            if (req.type != BLE_GATTS_AUTHORIZE_TYPE_INVALID)
+            {
+                if ((req.request.write.op == BLE_GATTS_OP_PREP_WRITE_REQ)     ||
+                    (req.request.write.op == BLE_GATTS_OP_EXEC_WRITE_REQ_NOW) ||
+                    (req.request.write.op == BLE_GATTS_OP_EXEC_WRITE_REQ_CANCEL))
+                {
+                    if (req.type == BLE_GATTS_AUTHORIZE_TYPE_WRITE)
+                    {
+                        auth_reply.type = BLE_GATTS_AUTHORIZE_TYPE_WRITE;
+                    }
+                    else
+                    {
+                        auth_reply.type = BLE_GATTS_AUTHORIZE_TYPE_READ;
+                    }
+                    auth_reply.params.write.gatt_status = APP_FEATURE_NOT_SUPPORTED;
+                    err_code = sd_ble_gatts_rw_authorize_reply(p_ble_evt->evt.gatts_evt.conn_handle,
+                                                               &auth_reply);
+                    APP_ERROR_CHECK(err_code);
+                }
+            }
+        } break; // BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST
+
+#if (STORE_AND_FORWARD_ENABLED == 1)
+        case BLE_EVT_TX_COMPLETE:
+            log_tx_complete(p_ble_evt->evt.common_evt.params.tx_complete.count);
+            log_drain();                                                    //Continue draining the log
+            break; // BLE_EVT_TX_COMPLETE
+
+        case BLE_GATTS_EVT_WRITE:
+            log_drain();                                                    //Start draining once the central enables notifications
+            break; // BLE_GATTS_EVT_WRITE
+#endif
+
+#if (NRF_SD_BLE_API_VERSION == 3)
+        case BLE_GATTS_EVT_EXCHANGE_MTU_REQUEST:
+            err_code = sd_ble_gatts_exchange_mtu_reply(p_ble_evt->evt.gatts_evt.conn_handle,
+                                                       NRF_BLE_MAX_MTU_SIZE);
+            APP_ERROR_CHECK(err_code);
+            break; // BLE_GATTS_EVT_EXCHANGE_MTU_REQUEST
+#endif
+
+        default:
+            // No implementation needed.
+            break;
+    }
+}
+
+
+/**@brief Function for dispatching a SoftDevice event to all modules with a SoftDevice
+ *        event handler.
+ *
+ * @details This function is called from the SoftDevice event interrupt handler after a
+ *          SoftDevice event has been received.
+ *
+ * @param[in] p_ble_evt  SoftDevice event.
+ */
+static void ble_evt_dispatch(ble_evt_t * p_ble_evt)
+{
+    ble_conn_params_on_ble_evt(p_ble_evt);
+    ble_nus_on_ble_evt(&m_nus, p_ble_evt);
+    on_ble_evt(p_ble_evt);
+    ble_advertising_on_ble_evt(p_ble_evt);
+    bsp_btn_ble_on_ble_evt(p_ble_evt);
+
+}
+
+
+/**@brief Function for dispatching a system event to interested modules.
+ *
+ * @details This function is called from the System event interrupt handler after a system
+ *          event has been received.
+ *
+ * @param[in] sys_evt  System stack event.
+ */
+static void sys_evt_dispatch(uint32_t sys_evt)
+{
+    // Dispatch the system event to the fstorage module, which writes the ADC log to flash.
+    fs_sys_event_handler(sys_evt);
+
+    // Dispatch to the Advertising module last, since it will check if there are any
+    // pending flash operations in fstorage.
+    ble_advertising_on_sys_evt(sys_evt);
+}
+
+
+/**@brief Function for the SoftDevice initialization.
+ *
+ * @details This function initializes the SoftDevice and the BLE event interrupt.
+ */
+static void ble_stack_init(void)
+{
+    uint32_t err_code;
+
+    nrf_clock_lf_cfg_t clock_lf_cfg = NRF_CLOCK_LFCLKSRC;
+
+    // Initialize SoftDevice.
+    SOFTDEVICE_HANDLER_INIT(&clock_lf_cfg, softdevice_evt_schedule);       //SoftDevice events are processed in the main loop
+
+    ble_enable_params_t ble_enable_params;
+    err_code = softdevice_enable_get_default_config(CENTRAL_LINK_COUNT,
+                                                    PERIPHERAL_LINK_COUNT,
+                                                    &ble_enable_params);
+    APP_ERROR_CHECK(err_code);
+
+    //Check the ram settings against the used number of links
+    CHECK_RAM_START_ADDR(CENTRAL_LINK_COUNT,PERIPHERAL_LINK_COUNT);
+
+    // Enable BLE stack.
+#if (NRF_SD_BLE_API_VERSION == 3)
+    ble_enable_params.gatt_enable_params.att_mtu = NRF_BLE_MAX_MTU_SIZE;
+#endif
+    err_code = softdevice_enable(&ble_enable_params);
+    APP_ERROR_CHECK(err_code);
+
+    // Subscribe for BLE events.
+    err_code = softdevice_ble_evt_handler_set(ble_evt_dispatch);
+    APP_ERROR_CHECK(err_code);
+
+    // Subscribe for system events.
+    err_code = softdevice_sys_evt_handler_set(sys_evt_dispatch);
+    APP_ERROR_CHECK(err_code);
+}
+
+
+/**@brief Function for handling events from the BSP module.
+ *
+ * @param[in]   event   Event generated by button press.
+ */
+void bsp_event_handler(bsp_event_t event)
+{
+    uint32_t  err_code;
+    app_evt_t evt;
+    switch (event)
+    {
+        case BSP_EVENT_SLEEP:
+            sleep_mode_enter();
+            break;
+
+        case BSP_EVENT_DISCONNECT:
+            err_code = sd_ble_gap_disconnect(m_conn_handle, BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+            if (err_code != NRF_ERROR_INVALID_STATE)
+            {
+                APP_ERROR_CHECK(err_code);
+            }
+            break;
+
+        case BSP_EVENT_WHITELIST_OFF:
+            if (m_conn_handle == BLE_CONN_HANDLE_INVALID)
+            {
+                err_code = ble_advertising_restart_without_whitelist();
+                if (err_code != NRF_ERROR_INVALID_STATE)
+                {
+                    APP_ERROR_CHECK(err_code);
+                }
+            }
+            break;
+
+        case BSP_EVENT_KEY_3:
+            evt.type = APP_EVT_ISR_PROFILE_DUMP;                            //Print the profile from the main loop
+            (void)app_evt_put(&evt);                                           //The press is dropped and counted when the scheduler queue is full
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+/**@brief   Function for handling app_uart events.
+ *
+ * @details This function will receive a single character from the app_uart module and append it to
+ *          a string. The string will be be sent over BLE when the last character received was a
+ *          'new line' i.e '\r\n' (hex 0x0D) or if the string has reached a length of
+ *          @ref NUS_MAX_DATA_LENGTH.
+ */
+/**@snippet [Handling the data received over UART] */
+void uart_event_handle(app_uart_evt_t * p_event)
+{
+    static uint8_t data_array[BLE_NUS_MAX_DATA_LEN];
+    static uint8_t index = 0;
+    ISR_PROFILE_ENTRY();
+
+    switch (p_event->evt_type)
+    {
+        case APP_UART_DATA_READY:
+            UNUSED_VARIABLE(app_uart_get(&data_array[index]));
+            index++;
+
+            if ((data_array[index - 1] == '\n') || (index >= (BLE_NUS_MAX_DATA_LEN)))
+            {
+                app_evt_t evt;
+
+                evt.type = APP_EVT_UART_RX;                                 //Send the line over BLE from the main loop
+                memcpy(evt.params.uart_rx.data, data_array, index);
+                evt.params.uart_rx.length = index;
+                (void)app_evt_put(&evt);                                    //The line is dropped and counted when the scheduler queue is full
+
+                index = 0;
+            }
+            break;
+
+        case APP_UART_COMMUNICATION_ERROR:
+            APP_ERROR_HANDLER(p_event->data.error_communication);
+            break;
+
+        case APP_UART_FIFO_ERROR:
+            APP_ERROR_HANDLER(p_event->data.error_code);
+            break;
+
+        default:
+            break;
+    }
+    ISR_PROFILE_EXIT(ISR_PROFILE_UART_HANDLER);
+}
+/**@snippet [Handling the data received over UART] */
+
+
+/**@brief  Function for initializing the UART module.
+ */
+/**@snippet [UART Initialization] */
+static void uart_init(void)
+{
+    uint32_t                     err_code;
+    const app_uart_comm_params_t comm_params =
+    {
+        RX_PIN_NUMBER,
+        TX_PIN_NUMBER,
+        RTS_PIN_NUMBER,
+        CTS_PIN_NUMBER,
+        APP_UART_FLOW_CONTROL_DISABLED,
+        false,
+        UART_BAUDRATE_BAUDRATE_Baud115200
+    };
+
+    APP_UART_FIFO_INIT( &comm_params,
+                       UART_RX_BUF_SIZE,
+                       UART_TX_BUF_SIZE,
+                       uart_event_handle,
+                       APP_IRQ_PRIORITY_LOWEST,
+                       err_code);
+    APP_ERROR_CHECK(err_code);
+}
+/**@snippet [UART Initialization] */
+
+
+/**@brief Function for initializing the Advertising functionality.
+ */
+static void advertising_init(void)
+{
+    uint32_t               err_code;
+    ble_advdata_t          advdata;
+    ble_advdata_t          scanrsp;
+    ble_adv_modes_config_t options;
+
+    // Build advertising data struct to pass into @ref ble_advertising_init.
+    memset(&advdata, 0, sizeof(advdata));
+    advdata.name_type          = BLE_ADVDATA_FULL_NAME;
+    advdata.include_appearance = false;
+    advdata.flags              = BLE_GAP_ADV_FLAGS_LE_ONLY_LIMITED_DISC_MODE;
+
+    memset(&scanrsp, 0, sizeof(scanrsp));
+    scanrsp.uuids_complete.uuid_cnt = sizeof(m_adv_uuids) / sizeof(m_adv_uuids[0]);
+    scanrsp.uuids_complete.p_uuids  = m_adv_uuids;
+
+    memset(&options, 0, sizeof(options));
+    options.ble_adv_fast_enabled  = true;
+    options.ble_adv_fast_interval = APP_ADV_INTERVAL;
+    options.ble_adv_fast_timeout  = APP_ADV_TIMEOUT_IN_SECONDS;
+
+    err_code = ble_advertising_init(&advdata, &scanrsp, &options, on_adv_evt, NULL);
+    APP_ERROR_CHECK(err_code);
+}
+
+
+/**@brief Function for initializing buttons and leds.
+ *
+ * @param[out] p_erase_bonds  Will be true if the clear bonding button was pressed to wake the application up.
+ */
+static void buttons_leds_init(bool * p_erase_bonds)
+{
+    bsp_event_t startup_event;
+
+    uint32_t err_code = bsp_init(BSP_INIT_LED | BSP_INIT_BUTTONS,
+                                 APP_TIMER_TICKS(100, APP_TIMER_PRESCALER),
+                                 bsp_event_handler);
+    APP_ERROR_CHECK(err_code);
+
+    err_code = bsp_btn_ble_init(NULL, &startup_event);
+    APP_ERROR_CHECK(err_code);
+
+    *p_erase_bonds = (startup_event == BSP_EVENT_CLEAR_BONDING_DATA);
+}
+
+
+/**@brief Function for placing the application in low power state while waiting for events.
+ */
+static void power_manage(void)
+{
+    uint32_t err_code = sd_app_evt_wait();
+    APP_ERROR_CHECK(err_code);
+}
+
+/**@brief Function for sending a notification over NUS, see the declaration above.
+ */
+static uint32_t nus_packet_send(uint8_t * p_data, uint16_t length, bool is_log)
+{
+    uint32_t err_code = ble_nus_string_send(&m_nus, p_data, length);
+
+#if (STORE_AND_FORWARD_ENABLED == 1)
+    if ((err_code == NRF_SUCCESS) && (m_tx_count < 32))
+    {
+        m_tx_log_mask |= (uint32_t)is_log << m_tx_count;
+        m_tx_count++;
+    }
+#else
+    UNUSED_PARAMETER(is_log);
+#endif
+    return err_code;
+}
+
+/**@brief Function for sending a line received on UART over BLE.
+ */
+static void nus_string_send(uint8_t const * p_data, uint8_t length)
+{
+    uint32_t err_code = nus_packet_send((uint8_t *)p_data, length, false);
+    if (err_code != NRF_ERROR_INVALID_STATE)
+    {
+        APP_ERROR_CHECK(err_code);
+    }
+}
+
+
+#if (SPECTRUM_ENABLED == 1)
+STATIC_ASSERT((SPECTRUM_FFT_SIZE_LOG2 >= 4) && (SPECTRUM_FFT_SIZE_LOG2 <= 8));
+STATIC_ASSERT((SPECTRUM_SAMPLE_INTERVAL_US % 32) == 0);
+STATIC_ASSERT(SPECTRUM_GOERTZEL_COUNT + 2 <= BLE_NUS_MAX_DATA_LEN);
+STATIC_ASSERT(SPECTRUM_BAND_COUNT + 2 <= BLE_NUS_MAX_DATA_LEN);
+
+#define SPECTRUM_HALF_DB_PER_LOG2_Q8    1541                                        /**< Half decibels per 1/256 doubling of energy (6.0206 / 256), scaled by 2^16. */
+#define SPECTRUM_GOERTZEL_REF_LOG2_Q8   ((2 * SPECTRUM_INPUT_SHIFT - 4 + 2 * SPECTRUM_FFT_SIZE_LOG2) * 256)  /**< log2 of the Goertzel energy of a 1 LSB amplitude sine, (2^SPECTRUM_INPUT_SHIFT * N / 4)^2 after the Hann window, with 8 fraction bits. */
+#define SPECTRUM_BAND_REF_LOG2_Q8       ((2 * SPECTRUM_INPUT_SHIFT - 2) * 256 + 150)  /**< log2 of the FFT band energy of a 1 LSB amplitude sine, (2^SPECTRUM_INPUT_SHIFT / 2)^2 in the peak bin times 1.5 for the Hann window side bins, with 8 fraction bits. */
+#define SPECTRUM_CYCLES_PER_US          16                                          /**< CPU cycles, and TIMER1 ticks at 16 MHz, per microsecond. */
+
+static const int16_t                    m_spectrum_sin_q15[65] =                    /**< Sine over a quarter cycle in 64 steps, Q15. */
+{
+        0,   804,  1608,  2411,  3212,  4011,  4808,  5602,  6393,  7180,  7962,  8740,  9512,
+    10279, 11039, 11793, 12540, 13279, 14010, 14733, 15447, 16151, 16846, 17531, 18205, 18868,
+    19520, 20160, 20788, 21403, 22006, 22595, 23170, 23732, 24279, 24812, 25330, 25833, 26320,
+    26791, 27246, 27684, 28106, 28511, 28899, 29269, 29622, 29957, 30274, 30572, 30853, 31114,
+    31357, 31581, 31786, 31972, 32138, 32286, 32413, 32522, 32610, 32679, 32729, 32758, 32767
+};
+static const uint16_t                   m_spectrum_goertzel_hz[SPECTRUM_GOERTZEL_COUNT] = {50, 100, 150, 200};               /**< Goertzel detector frequencies. */
+static const uint16_t                   m_spectrum_band_edges_hz[SPECTRUM_BAND_COUNT + 1] = {4, 8, 16, 32, 64, 128, 256, 488}; /**< FFT band edges, band n is from edge n up to edge n + 1. */
+static int16_t                          m_spectrum_block[2][SPECTRUM_FFT_SIZE];     /**< Sample blocks, one is filled by the ADC handler while the other is analysed. */
+static uint8_t                          m_spectrum_block_index;                     /**< Index of the block being filled. */
+static uint16_t                         m_spectrum_block_fill;                      /**< Number of samples in the block being filled. */
+static volatile bool                    m_spectrum_block_busy;                      /**< True while the other block is analysed in the main loop. */
+static uint32_t                         m_spectrum_blocks_dropped;                  /**< Number of blocks dropped because the previous block was still analysed or the scheduler queue was full. */
+static uint32_t                         m_spectrum_packets_not_sent;                /**< Number of report packets not sent, because no central had notifications enabled or the SoftDevice TX queue was full. */
+static uint8_t                          m_spectrum_report_seq;                      /**< Sequence number of the next report. */
+
+
+/**@brief Function for getting the sine of a phase, interpolated from the quarter cycle table.
+ *
+ * @param[in] phase  Phase as a fraction of a cycle, with 16 fraction bits.
+ *
+ * @return Sine in Q15.
+ */
+static int32_t spectrum_sin_q15(uint16_t phase)
+{
+    uint16_t quadrant = phase >> 14;
+    uint16_t offset   = phase & 0x3FFF;
+    int32_t  value;
+
+    if (quadrant & 1)
+    {
+        offset = 0x4000 - offset;                                           //Falling quarter, mirrored
+    }
+    value = m_spectrum_sin_q15[offset >> 8];
+    if ((offset & 0xFF) != 0)
+    {
+        value += ((m_spectrum_sin_q15[(offset >> 8) + 1] - value) * (offset & 0xFF)) >> 8;
+    }
+    return (quadrant & 2) ? -value : value;
+}
+
+
+/**@brief Function for getting the cosine of a phase, see @ref spectrum_sin_q15. */
+static int32_t spectrum_cos_q15(uint16_t phase)
+{
+    return spectrum_sin_q15(phase + 0x4000);
+}
+
+
+/**@brief Function for converting a frequency to the phase step per sample, with 16 fraction bits of a cycle. */
+static uint16_t spectrum_hz_to_phase(uint16_t hz)
+{
+    return (uint16_t)(((uint64_t)hz * 65536 * SPECTRUM_SAMPLE_INTERVAL_US + 500000) / 1000000);
+}
+
+
+/**@brief Function for converting a frequency to the nearest FFT bin, at most the Nyquist bin. */
+static uint16_t spectrum_hz_to_bin(uint16_t hz)
+{
+    uint32_t bin = (uint32_t)(((uint64_t)hz * SPECTRUM_FFT_SIZE * SPECTRUM_SAMPLE_INTERVAL_US + 500000) / 1000000);
+
+    return (bin < SPECTRUM_FFT_SIZE / 2) ? bin : SPECTRUM_FFT_SIZE / 2;
+}
+
+
+/**@brief Function for calculating log2 of an energy, with 8 fraction bits.
+ *
+ * @details The fraction is the 8 bits below the most significant bit, a linear approximation that
+ *          is at most 0.086 too low (0.26 dB).
+ */
+static int32_t spectrum_log2_q8(uint64_t value)
+{
+    int32_t exponent = 0;
+
+    while ((value >> exponent) > 1)
+    {
+        exponent++;
+    }
+    if (exponent >= 8)
+    {
+        return (exponent << 8) + (int32_t)((value >> (exponent - 8)) & 0xFF);
+    }
+    return (exponent << 8) + (int32_t)((value << (8 - exponent)) & 0xFF);
+}
+
+
+/**@brief Function for converting an energy into a level in half decibels above a reference.
+ *
+ * @param[in] energy    Energy.
+ * @param[in] ref_log2  log2 of the energy at 0 dB, with 8 fraction bits.
+ *
+ * @return Level in half decibels, rounded and limited to 0 to 255.
+ */
+static uint8_t spectrum_level_get(uint64_t energy, int32_t ref_log2)
+{
+    int32_t level;
+
+    if (energy == 0)
+    {
+        return 0;
+    }
+    level = ((spectrum_log2_q8(energy) - ref_log2) * SPECTRUM_HALF_DB_PER_LOG2_Q8 + (1 << 15)) >> 16;
+    return (level < 0) ? 0 : ((level > 255) ? 255 : (uint8_t)level);
+}
+
+
+/**@brief Function for removing the mean of a block and applying the Hann window.
+ *
+ * @details The samples are scaled up by SPECTRUM_INPUT_SHIFT bits, so that the FFT keeps fraction
+ *          bits while it halves its data in every stage.
+ */
+static void spectrum_block_window(int16_t * p_block)
+{
+    int32_t sum = 0;
+    int32_t mean;
+
+    for (uint32_t i = 0; i < SPECTRUM_FFT_SIZE; i++)
+    {
+        sum += p_block[i];
+    }
+    mean = sum / (int32_t)SPECTRUM_FFT_SIZE;
+    for (uint32_t i = 0; i < SPECTRUM_FFT_SIZE; i++)
+    {
+        int32_t window = (32768 - spectrum_cos_q15((uint16_t)((i << 16) / SPECTRUM_FFT_SIZE))) / 2;
+        p_block[i] = (int16_t)(((p_block[i] - mean) * window) >> (15 - SPECTRUM_INPUT_SHIFT));
+    }
+}
+
+
+/**@brief Function for calculating the energy of a block at one frequency with the Goertzel algorithm.
+ *
+ * @details The filter runs on 32 bit states with the coefficient 2 cos(w) in Q14, and the energy is
+ *          |X(w)|^2 = s1^2 + s2^2 - 2 cos(w) s1 s2 of the last two states.
+ *
+ * @param[in] p_block  Windowed block.
+ * @param[in] phase    Phase step per sample, with 16 fraction bits of a cycle.
+ */
+static uint64_t spectrum_goertzel_energy(int16_t const * p_block, uint16_t phase)
+{
+    int32_t coeff = spectrum_cos_q15(phase);                                //2 cos(w) in Q14
+    int32_t s1    = 0;
+    int32_t s2    = 0;
+    int64_t energy;
+
+    for (uint32_t i = 0; i < SPECTRUM_FFT_SIZE; i++)
+    {
+        int32_t s0 = p_block[i] + (int32_t)(((int64_t)coeff * s1) >> 14) - s2;
+        s2 = s1;
+        s1 = s0;
+    }
+    energy = (int64_t)s1 * s1 + (int64_t)s2 * s2 - (((int64_t)coeff * s1) >> 14) * s2;
+    return (energy > 0) ? (uint64_t)energy : 0;
+}
+
+
+/**@brief Function for calculating the radix-2 FFT of a real block in place.
+ *
+ * @details The N real samples are treated as N/2 complex samples, even samples in the real and odd
+ *          samples in the imaginary part, and transformed with a decimation in time complex FFT.
+ *          Every stage halves its outputs, so the result is scaled by 2/N and cannot overflow.
+ *          @ref spectrum_fft_band_energy separates the spectrum of the real block.
+ */
+static void spectrum_fft(int16_t * p_block)
+{
+    uint32_t const n = SPECTRUM_FFT_SIZE / 2;
+    uint32_t       j = 0;
+
+    for (uint32_t i = 1; i < n; i++)                                        //Bit reversed order
+    {
+        uint32_t bit = n >> 1;
+
+        for (; j & bit; bit >>= 1)
+        {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j)
+        {
+            int16_t re = p_block[2 * i];
+            int16_t im = p_block[2 * i + 1];
+
+            p_block[2 * i]     = p_block[2 * j];
+            p_block[2 * i + 1] = p_block[2 * j + 1];
+            p_block[2 * j]     = re;
+            p_block[2 * j + 1] = im;
+        }
+    }
+
+    for (uint32_t half = 1; half < n; half <<= 1)
+    {
+        for (uint32_t k = 0; k < half; k++)
+        {
+            uint16_t phase = (uint16_t)((k << 15) / half);                  //k / (2 half) of a cycle
+            int32_t  wr    = spectrum_cos_q15(phase);
+            int32_t  wi    = -spectrum_sin_q15(phase);
+
+            for (uint32_t a = 2 * k; a < 2 * n; a += 4 * half)
+            {
+                uint32_t b  = a + 2 * half;
+                int32_t  tr = (p_block[b] * wr - p_block[b + 1] * wi) >> 15;
+                int32_t  ti = (p_block[b] * wi + p_block[b + 1] * wr) >> 15;
+
+                p_block[b]     = (int16_t)((p_block[a] - tr) >> 1);
+                p_block[b + 1] = (int16_t)((p_block[a + 1] - ti) >> 1);
+                p_block[a]     = (int16_t)((p_block[a] + tr) >> 1);
+                p_block[a + 1] = (int16_t)((p_block[a + 1] + ti) >> 1);
+            }
+        }
+    }
+}
+
+
+/**@brief Function for summing the energy of the real FFT bins first to end - 1.
+ *
+ * @details Bin k of the real block is X[k] = E[k] + W^k O[k], with the spectra of the even and odd
+ *          samples E[k] = (Z[k] + Z*[N/2-k]) / 2 and O[k] = -j (Z[k] - Z*[N/2-k]) / 2 from the
+ *          complex FFT Z, and W = e^(-j 2 pi / N). Only bins 1 to N/2 - 1 are used.
+ */
+static uint64_t spectrum_fft_band_energy(int16_t const * p_block, uint16_t first, uint16_t end)
+{
+    uint64_t energy = 0;
+
+    for (uint32_t k = (first > 0) ? first : 1; (k < end) && (k < SPECTRUM_FFT_SIZE / 2); k++)
+    {
+        uint32_t m  = SPECTRUM_FFT_SIZE / 2 - k;
+        int32_t  even_re = (p_block[2 * k] + p_block[2 * m]) >> 1;
+        int32_t  even_im = (p_block[2 * k + 1] - p_block[2 * m + 1]) >> 1;
+        int32_t  odd_re = (p_block[2 * k + 1] + p_block[2 * m + 1]) >> 1;
+        int32_t  odd_im = (p_block[2 * m] - p_block[2 * k]) >> 1;
+        uint16_t phase = (uint16_t)((k << 16) / SPECTRUM_FFT_SIZE);
+        int32_t  wr = spectrum_cos_q15(phase);
+        int32_t  wi = -spectrum_sin_q15(phase);
+        int32_t  xr = even_re + ((odd_re * wr - odd_im * wi) >> 15);
+        int32_t  xi = even_im + ((odd_re * wi + odd_im * wr) >> 15);
+
+        energy += (uint64_t)((int64_t)xr * xr + (int64_t)xi * xi);
+    }
+    return energy;
+}
+
+
+/**@brief Function for adding the samples of SPECTRUM_CHANNEL in an ADC buffer to the block being filled.
+ *
+ * @details Called from the ADC handler. A full block is handed over to the main loop, unless the
+ *          previous block is still analysed or the scheduler queue is full, in which case the full
+ *          block is dropped.
+ */
+static void spectrum_adc_samples_add(nrf_adc_value_t const * p_buffer, uint16_t size)
+{
+    for (uint32_t i = SPECTRUM_CHANNEL; i < size; i += number_of_adc_channels)
+    {
+        m_spectrum_block[m_spectrum_block_index][m_spectrum_block_fill++] = p_buffer[i];
+        if (m_spectrum_block_fill == SPECTRUM_FFT_SIZE)
+        {
+            app_evt_t evt;
+
+            m_spectrum_block_fill               = 0;
+            evt.type                            = APP_EVT_SPECTRUM_BLOCK;
+            evt.params.spectrum_block.p_block   = m_spectrum_block[m_spectrum_block_index];
+            if (m_spectrum_block_busy || (app_evt_put(&evt) != NRF_SUCCESS))
+            {
+                m_spectrum_blocks_dropped++;
+                continue;
+            }
+            m_spectrum_block_busy   = true;
+            m_spectrum_block_index ^= 1;
+        }
+    }
+}
+
+
+/**@brief Function for analysing a block in the main loop, and sending the levels over NUS.
+ *
+ * @details Sends a SPECTRUM_GOERTZEL_PACKET_TYPE packet with the level of each Goertzel detector and
+ *          a SPECTRUM_BAND_PACKET_TYPE packet with the level of each FFT band, each after the type and
+ *          a sequence number byte. Levels are in half decibels above a sine of 1 LSB amplitude. The
+ *          levels and the CPU cycles taken by the detectors and the FFT are printed on UART. The
+ *          cycles include the interrupts and SoftDevice events that preempt the main loop meanwhile.
+ */
+static void spectrum_block_process(int16_t * p_block)
+{
+    uint8_t  goertzel_report[SPECTRUM_GOERTZEL_COUNT + 2];
+    uint8_t  band_report[SPECTRUM_BAND_COUNT + 2];
+    uint32_t goertzel_cycles;
+    uint32_t fft_cycles;
+
+    //TIMER1 counts CPU cycles, one capture after each stage
+    NRF_TIMER1->MODE        = TIMER_MODE_MODE_Timer;
+    NRF_TIMER1->BITMODE     = TIMER_BITMODE_BITMODE_32Bit;
+    NRF_TIMER1->PRESCALER   = 0;
+    NRF_TIMER1->TASKS_CLEAR = 1;
+    NRF_TIMER1->TASKS_START = 1;
+    spectrum_block_window(p_block);
+    goertzel_report[0] = SPECTRUM_GOERTZEL_PACKET_TYPE;
+    goertzel_report[1] = m_spectrum_report_seq;
+    for (uint32_t i = 0; i < SPECTRUM_GOERTZEL_COUNT; i++)
+    {
+        goertzel_report[i + 2] = spectrum_level_get(spectrum_goertzel_energy(p_block, spectrum_hz_to_phase(m_spectrum_goertzel_hz[i])),
+                                                    SPECTRUM_GOERTZEL_REF_LOG2_Q8);
+    }
+    NRF_TIMER1->TASKS_CAPTURE[0] = 1;
+
+    spectrum_fft(p_block);
+    band_report[0] = SPECTRUM_BAND_PACKET_TYPE;
+    band_report[1] = m_spectrum_report_seq;
+    for (uint32_t i = 0; i < SPECTRUM_BAND_COUNT; i++)
+    {
+        band_report[i + 2] = spectrum_level_get(spectrum_fft_band_energy(p_block, spectrum_hz_to_bin(m_spectrum_band_edges_hz[i]),
+                                                                         spectrum_hz_to_bin(m_spectrum_band_edges_hz[i + 1])),
+                                                SPECTRUM_BAND_REF_LOG2_Q8);
+    }
+    NRF_TIMER1->TASKS_CAPTURE[1] = 1;
+    NRF_TIMER1->TASKS_STOP       = 1;
+    goertzel_cycles = NRF_TIMER1->CC[0];
+    fft_cycles      = NRF_TIMER1->CC[1] - NRF_TIMER1->CC[0];
+    m_spectrum_block_busy = false;
+
+    if (nus_packet_send(goertzel_report, sizeof(goertzel_report), false) != NRF_SUCCESS)
+    {
+        m_spectrum_packets_not_sent++;
+    }
+    if (nus_packet_send(band_report, sizeof(band_report), false) != NRF_SUCCESS)
+    {
+        m_spectrum_packets_not_sent++;
+    }
+    m_spectrum_report_seq++;
+
+    printf("Spectrum %d, window and Goertzel %lu cycles (%lu us), FFT and bands %lu cycles (%lu us)\r\n", goertzel_report[1],
+           (unsigned long)goertzel_cycles, (unsigned long)(goertzel_cycles / SPECTRUM_CYCLES_PER_US),
+           (unsigned long)fft_cycles, (unsigned long)(fft_cycles / SPECTRUM_CYCLES_PER_US));
+    printf("    %lu blocks dropped, %lu packets not sent\r\n", (unsigned long)m_spectrum_blocks_dropped, (unsigned long)m_spectrum_packets_not_sent);
+    for (uint32_t i = 0; i < SPECTRUM_GOERTZEL_COUNT; i++)
+    {
+        printf("    %d Hz: %d.%d dB\r\n", m_spectrum_goertzel_hz[i], goertzel_report[i + 2] / 2, (goertzel_report[i + 2] & 1) * 5);
+    }
+    for (uint32_t i = 0; i < SPECTRUM_BAND_COUNT; i++)
+    {
+        printf("    %d - %d Hz: %d.%d dB\r\n", m_spectrum_band_edges_hz[i], m_spectrum_band_edges_hz[i + 1],
+               band_report[i + 2] / 2, (band_report[i + 2] & 1) * 5);
+    }
+}
+#endif
+
+
+#if (POWER_METER_ENABLED == 1)
+STATIC_ASSERT((POWER_SAMPLE_INTERVAL_US % 32) == 0);
+STATIC_ASSERT(POWER_REPORT_SIZE <= BLE_NUS_MAX_DATA_LEN);
+
+#define POWER_WINDOW_SAMPLES            ((POWER_WINDOW_MS * 1000UL) / POWER_SAMPLE_INTERVAL_US)  /**< Minimum number of samples in a window. */
+#define POWER_CURRENT_WEIGHT_Q16        ((POWER_CURRENT_DELAY_US << 16) / POWER_SAMPLE_INTERVAL_US)  /**< POWER_CURRENT_DELAY_US as a fraction of the sampling interval, with 16 fraction bits. */
+
+/**@brief Sums over a measurement window. */
+typedef struct
+{
+    uint32_t samples;                                                       /**< Number of scans. */
+    uint32_t cycles;                                                        /**< Number of whole voltage cycles, 0 if the window was closed without a zero crossing. */
+    int32_t  sum[2];                                                        /**< Sum of the voltage and current samples, the current with POWER_CURRENT_FRACTION_BITS. */
+    uint64_t sum_squares[2];                                                /**< Sum of the squared voltage and current samples. */
+    int64_t  sum_products;                                                  /**< Sum of the voltage times current samples. */
+} power_window_t;
+
+static power_window_t                   m_power_window[2];                          /**< Windows, one is summed by the ADC handler while the other is reported. */
+static uint8_t                          m_power_window_index;                       /**< Index of the window being summed. */
+static bool                             m_power_window_aligned;                     /**< True when the window being summed started at a rising zero crossing. */
+static volatile bool                    m_power_window_busy;                        /**< True while the other window is reported in the main loop. */
+static uint32_t                         m_power_windows_dropped;                    /**< Number of windows dropped because the previous window was still reported or the scheduler queue was full. */
+static uint32_t                         m_power_reports_not_sent;                   /**< Number of reports not sent, because no central had notifications enabled or the SoftDevice TX queue was full. */
+static int32_t                          m_power_voltage_mid = 512;                  /**< Zero crossing level, the mean voltage sample of the last window. */
+static bool                             m_power_voltage_high;                       /**< Voltage state of the zero crossing detector. */
+static int32_t                          m_power_current_previous;                   /**< Current sample of the previous scan. */
+static bool                             m_power_current_previous_valid;             /**< True once a scan has been added. */
+static uint8_t                          m_power_report_seq;                         /**< Sequence number of the next report. */
+
+
+/**@brief Function for calculating the integer square root of a 64 bit value, rounded down. */
+static uint32_t power_isqrt(uint64_t value)
+{
+    uint64_t root = 0;
+    uint64_t bit  = 1ULL << 62;
+
+    while (bit > value)
+    {
+        bit >>= 2;
+    }
+    while (bit != 0)
+    {
+        if (value >= root + bit)
+        {
+            value -= root + bit;
+            root   = (root >> 1) + bit;
+        }
+        else
+        {
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (uint32_t)root;
+}
+
+
+/**@brief Function for handing the window being summed over to the main loop and starting the next one.
+ *
+ * @details The window is dropped if the previous window is still reported or the scheduler queue is
+ *          full. The mean voltage of the window becomes the zero crossing level, which follows the bias
+ *          of the voltage input.
+ */
+static void power_window_close(void)
+{
+    power_window_t * p_window = &m_power_window[m_power_window_index];
+    app_evt_t        evt;
+
+    m_power_voltage_mid           = p_window->sum[0] / (int32_t)p_window->samples;
+    evt.type                      = APP_EVT_POWER_WINDOW;
+    evt.params.power_window.index = m_power_window_index;
+    if (m_power_window_busy || (app_evt_put(&evt) != NRF_SUCCESS))
+    {
+        m_power_windows_dropped++;
+    }
+    else
+    {
+        m_power_window_busy   = true;
+        m_power_window_index ^= 1;
+    }
+    memset(&m_power_window[m_power_window_index], 0, sizeof(power_window_t));
+}
+
+
+/**@brief Function for adding the scans in an ADC buffer to the window being summed.
+ *
+ * @details Called from the ADC handler. A rising zero crossing is detected when the voltage goes
+ *          above the zero crossing level plus POWER_ZERO_CROSS_HYSTERESIS_LSB, after it was below the
+ *          level minus the hysteresis. The first rising crossing restarts the window, so that it starts
+ *          at a crossing, and the window is closed at the first rising crossing after
+ *          POWER_WINDOW_SAMPLES, so that it holds whole cycles. Without crossings, the window is closed
+ *          after twice POWER_WINDOW_SAMPLES.
+ *
+ *          The current is converted POWER_CURRENT_DELAY_US after the voltage, 1.3 degrees of a 50 Hz
+ *          cycle. It is aligned to the voltage by linear interpolation with the current of the previous
+ *          scan, and kept with POWER_CURRENT_FRACTION_BITS. The delay is not fixed: the driver starts
+ *          the current conversion from its interrupt, which the SoftDevice and higher priority
+ *          interrupts can hold off. Every 100 us of extra delay leaves 1.8 degrees of phase error at
+ *          50 Hz on that scan, so the error grows while the radio is active.
+ */
+static void power_adc_samples_add(nrf_adc_value_t const * p_buffer, uint16_t size)
+{
+    for (uint32_t i = 0; i + number_of_adc_channels <= size; i += number_of_adc_channels)
     {
-        case BSP_EVENT_SLEEP:
-            sleep_mode_enter();
-            break;
+        int32_t          voltage  = p_buffer[i + POWER_VOLTAGE_CHANNEL];
+        int32_t          current  = p_buffer[i + POWER_CURRENT_CHANNEL] << POWER_CURRENT_FRACTION_BITS;
+        power_window_t * p_window = &m_power_window[m_power_window_index];
 
-        case BSP_EVENT_DISCONNECT:
-            err_code = sd_ble_gap_disconnect(m_conn_handle, BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
-            if (err_code != NRF_ERROR_INVALID_STATE)
+        if (m_power_current_previous_valid)
+        {
+            int32_t step = (p_buffer[i + POWER_CURRENT_CHANNEL] - m_power_current_previous) * POWER_CURRENT_WEIGHT_Q16;
+
+            current -= (step + (1 << (15 - POWER_CURRENT_FRACTION_BITS))) >> (16 - POWER_CURRENT_FRACTION_BITS);
+        }
+        m_power_current_previous       = p_buffer[i + POWER_CURRENT_CHANNEL];
+        m_power_current_previous_valid = true;
+
+        if (!m_power_voltage_high && (voltage > m_power_voltage_mid + POWER_ZERO_CROSS_HYSTERESIS_LSB))
+        {
+            m_power_voltage_high = true;
+            if (!m_power_window_aligned)
             {
-                APP_ERROR_CHECK(err_code);
+                memset(p_window, 0, sizeof(power_window_t));
+                m_power_window_aligned = true;
             }
-            break;
-
-        case BSP_EVENT_WHITELIST_OFF:
-            if (m_conn_handle == BLE_CONN_HANDLE_INVALID)
+            else
             {
-                err_code = ble_advertising_restart_without_whitelist();
-                if (err_code != NRF_ERROR_INVALID_STATE)
+                p_window->cycles++;
+                if (p_window->samples >= POWER_WINDOW_SAMPLES)
                 {
-                    APP_ERROR_CHECK(err_code);
+                    power_window_close();                                   //The crossing starts the next window
+                    p_window = &m_power_window[m_power_window_index];
                 }
             }
-            break;
+        }
+        else if (m_power_voltage_high && (voltage < m_power_voltage_mid - POWER_ZERO_CROSS_HYSTERESIS_LSB))
+        {
+            m_power_voltage_high = false;
+        }
 
-        default:
-            break;
+        p_window->samples++;
+        p_window->sum[0]         += voltage;
+        p_window->sum[1]         += current;
+        p_window->sum_squares[0] += (uint32_t)(voltage * voltage);
+        p_window->sum_squares[1] += (uint32_t)(current * current);
+        p_window->sum_products   += voltage * current;
+
+        if (p_window->samples >= 2 * POWER_WINDOW_SAMPLES)
+        {
+            p_window->cycles = 0;                                           //No mains cycles, report the samples as they are
+            power_window_close();
+            m_power_window_aligned = false;
+        }
     }
 }
 
 
-/**@brief   Function for handling app_uart events.
+/**@brief Function for reporting a window in the main loop.
  *
- * @details This function will receive a single character from the app_uart module and append it to
- *          a string. The string will be be sent over BLE when the last character received was a
- *          'new line' i.e '\r\n' (hex 0x0D) or if the string has reached a length of
- *          @ref NUS_MAX_DATA_LENGTH.
+ * @details The RMS values are sqrt(n sum(x^2) - sum(x)^2) / n, which leaves out the mean, calculated
+ *          with 8 fraction bits. The current sums carry POWER_CURRENT_FRACTION_BITS, which are
+ *          removed in the results. The real power is (n sum(v i) - sum(v) sum(i)) / n^2, the apparent
+ *          power is Vrms Irms and the power factor is their ratio. A POWER_REPORT_TYPE packet is sent
+ *          over NUS: the type, a sequence number byte, Vrms (mV), Irms (mA), real power (mW, signed),
+ *          all 32 bit, then the power factor (1/1000, signed) and the frequency (mHz), 16 bit each.
+ *          Values are most significant byte first. All values, the means and the apparent power are
+ *          printed on UART.
  */
-/**@snippet [Handling the data received over UART] */
-void uart_event_handle(app_uart_evt_t * p_event)
+static void power_window_report(power_window_t const * p_window)
 {
-    static uint8_t data_array[BLE_NUS_MAX_DATA_LEN];
-    static uint8_t index = 0;
-    uint32_t       err_code;
+    uint8_t   report[POWER_REPORT_SIZE];
+    uint8_t * p_report = report;
+    uint64_t  n        = p_window->samples;
+    uint32_t  rms_q8[2];
+    int32_t   mean[2];
+    int64_t   power_n2;
+    int32_t   power_mw;
+    uint32_t  apparent_mw;
+    int32_t   power_factor = 0;
+    uint32_t  frequency_mhz = 0;
+    uint32_t  voltage_mv;
+    uint32_t  current_ma;
+
+    for (uint32_t channel = 0; channel < 2; channel++)
+    {
+        uint32_t fraction_bits = (channel == 0) ? 0 : POWER_CURRENT_FRACTION_BITS;
+        int64_t  variance_n2   = (int64_t)(n * p_window->sum_squares[channel]) - (int64_t)p_window->sum[channel] * p_window->sum[channel];
 
-    switch (p_event->evt_type)
+        rms_q8[channel]  = (variance_n2 > 0) ? power_isqrt((uint64_t)variance_n2 << (16 - 2 * fraction_bits)) / (uint32_t)n : 0;
+        mean[channel]    = (int32_t)((((int64_t)p_window->sum[channel] * ((channel == 0) ? POWER_VOLTAGE_MV_PER_LSB : POWER_CURRENT_MA_PER_LSB)) >> fraction_bits) / (int64_t)n);
+    }
+    voltage_mv = (uint32_t)(((uint64_t)rms_q8[0] * POWER_VOLTAGE_MV_PER_LSB) >> 8);
+    current_ma = (uint32_t)(((uint64_t)rms_q8[1] * POWER_CURRENT_MA_PER_LSB) >> 8);
+
+    power_n2    = (int64_t)n * p_window->sum_products - (int64_t)p_window->sum[0] * p_window->sum[1];
+    power_mw    = (int32_t)(((power_n2 >> POWER_CURRENT_FRACTION_BITS) * (POWER_VOLTAGE_MV_PER_LSB * POWER_CURRENT_MA_PER_LSB) / 1000) / (int64_t)(n * n));
+    apparent_mw = (uint32_t)(((uint64_t)voltage_mv * current_ma) / 1000);
+    if (apparent_mw > 0)
     {
-        case APP_UART_DATA_READY:
-            UNUSED_VARIABLE(app_uart_get(&data_array[index]));
-            index++;
+        power_factor = (int32_t)(((int64_t)power_mw * 1000) / apparent_mw);
+    }
+    if (p_window->cycles > 0)
+    {
+        frequency_mhz = (uint32_t)(((uint64_t)p_window->cycles * 1000000000) / (n * POWER_SAMPLE_INTERVAL_US));
+    }
 
-            if ((data_array[index - 1] == '\n') || (index >= (BLE_NUS_MAX_DATA_LEN)))
-            {
-                err_code = ble_nus_string_send(&m_nus, data_array, index);
-                if (err_code != NRF_ERROR_INVALID_STATE)
-                {
-                    APP_ERROR_CHECK(err_code);
-                }
+    *p_report++ = POWER_REPORT_TYPE;
+    *p_report++ = m_power_report_seq++;
+    p_report    = report_put(p_report, voltage_mv, 4);
+    p_report    = report_put(p_report, current_ma, 4);
+    p_report    = report_put(p_report, (uint32_t)power_mw, 4);
+    p_report    = report_put(p_report, (uint32_t)power_factor, 2);
+    p_report    = report_put(p_report, frequency_mhz, 2);
+    if (nus_packet_send(report, sizeof(report), false) != NRF_SUCCESS)
+    {
+        m_power_reports_not_sent++;
+    }
 
-                index = 0;
-            }
-            break;
+    printf("Power %d: %lu cycles, %lu.%03lu Hz, %lu windows dropped, %lu reports not sent\r\n", report[1], (unsigned long)p_window->cycles,
+           (unsigned long)(frequency_mhz / 1000), (unsigned long)(frequency_mhz % 1000), (unsigned long)m_power_windows_dropped,
+           (unsigned long)m_power_reports_not_sent);
+    printf("    V: %lu mV rms, mean %ld mV\r\n", (unsigned long)voltage_mv, (long)mean[0]);
+    printf("    I: %lu mA rms, mean %ld mA\r\n", (unsigned long)current_ma, (long)mean[1]);
+    printf("    P: %ld mW, S: %lu mVA, PF: %ld/1000\r\n", (long)power_mw, (unsigned long)apparent_mw, (long)power_factor);
+    m_power_window_busy = false;                                            //The window is no longer read
+}
+#endif
 
-        case APP_UART_COMMUNICATION_ERROR:
-            APP_ERROR_HANDLER(p_event->data.error_communication);
-            break;
 
-        case APP_UART_FIFO_ERROR:
-            APP_ERROR_HANDLER(p_event->data.error_code);
-            break;
+#if (HISTOGRAM_ENABLED == 1)
+STATIC_ASSERT((HISTOGRAM_SUB_BUCKET_BITS >= 1) && (HISTOGRAM_SUB_BUCKET_BITS <= 7));
+STATIC_ASSERT(HISTOGRAM_REPORT_SIZE <= BLE_NUS_MAX_DATA_LEN);
 
-        default:
-            break;
+#define HISTOGRAM_BUCKET_COUNT          ((1UL << HISTOGRAM_SUB_BUCKET_BITS) + (10 - HISTOGRAM_SUB_BUCKET_BITS) * (1UL << (HISTOGRAM_SUB_BUCKET_BITS - 1)))  /**< Number of buckets for the 10 bit ADC codes, 320 with HISTOGRAM_SUB_BUCKET_BITS set to 7. */
+#if (SPECTRUM_ENABLED == 1)
+#define HISTOGRAM_SAMPLE_INTERVAL_US    SPECTRUM_SAMPLE_INTERVAL_US                 /**< Time between two scans. */
+#elif (POWER_METER_ENABLED == 1)
+#define HISTOGRAM_SAMPLE_INTERVAL_US    POWER_SAMPLE_INTERVAL_US                    /**< Time between two scans. */
+#else
+#define HISTOGRAM_SAMPLE_INTERVAL_US    (ADC_SAMPLE_RATE * 1000UL)                  /**< Time between two scans. */
+#endif
+#define HISTOGRAM_SNAPSHOT_SCANS        ((HISTOGRAM_SNAPSHOT_S * 1000000UL) / HISTOGRAM_SAMPLE_INTERVAL_US)  /**< Minimum number of scans per snapshot. */
+
+/**@brief Distribution of the ADC codes of each channel over a snapshot period. */
+typedef struct
+{
+    uint32_t        scans;                                                  /**< Number of scans. */
+    uint32_t        counts[HISTOGRAM_CHANNEL_COUNT][HISTOGRAM_BUCKET_COUNT]; /**< Number of samples per bucket and channel. */
+    nrf_adc_value_t min[HISTOGRAM_CHANNEL_COUNT];                           /**< Lowest code of each channel. */
+    nrf_adc_value_t max[HISTOGRAM_CHANNEL_COUNT];                           /**< Highest code of each channel. */
+    uint32_t        above[HISTOGRAM_CHANNEL_COUNT];                         /**< Number of samples at or above HISTOGRAM_THRESHOLD_CODE per channel, counted exactly rather than from the buckets. */
+} histogram_t;
+
+static const uint16_t                   m_histogram_percentiles[HISTOGRAM_PERCENTILE_COUNT] = {500, 950, 990};  /**< Reported percentiles, in 1/1000. */
+static histogram_t                      m_histogram[2];                             /**< Histograms, one is updated by the ADC handler while the other is reported. */
+static uint8_t                          m_histogram_index;                          /**< Index of the histogram being updated. */
+static volatile bool                    m_histogram_busy;                           /**< True while the other histogram is reported in the main loop. */
+static uint8_t                          m_histogram_report_seq;                     /**< Sequence number of the next snapshot. */
+static uint32_t                         m_histogram_packets_not_sent;               /**< Number of report packets not sent, because no central had notifications enabled or the SoftDevice TX queue was full. */
+
+
+/**@brief Function for emptying a histogram. */
+static void histogram_reset(histogram_t * p_histogram)
+{
+    memset(p_histogram, 0, sizeof(histogram_t));
+    for (uint32_t channel = 0; channel < HISTOGRAM_CHANNEL_COUNT; channel++)
+    {
+        p_histogram->min[channel] = 1023;
     }
 }
-/**@snippet [Handling the data received over UART] */
 
 
-/**@brief  Function for initializing the UART module.
+/**@brief Function for finding the bucket of an ADC code.
+ *
+ * @details Codes below 2^HISTOGRAM_SUB_BUCKET_BITS have a bucket each. Above, each octave is split
+ *          into 2^(HISTOGRAM_SUB_BUCKET_BITS - 1) buckets, so the width of a bucket is at most
+ *          1/2^(HISTOGRAM_SUB_BUCKET_BITS - 1) of its lower bound.
  */
-/**@snippet [UART Initialization] */
-static void uart_init(void)
+static uint16_t histogram_bucket_get(nrf_adc_value_t code)
 {
-    uint32_t                     err_code;
-    const app_uart_comm_params_t comm_params =
+    uint32_t shift = 0;
+
+    while ((code >> shift) >= (1UL << HISTOGRAM_SUB_BUCKET_BITS))
     {
-        RX_PIN_NUMBER,
-        TX_PIN_NUMBER,
-        RTS_PIN_NUMBER,
-        CTS_PIN_NUMBER,
-        APP_UART_FLOW_CONTROL_DISABLED,
-        false,
-        UART_BAUDRATE_BAUDRATE_Baud115200
-    };
+        shift++;
+    }
+    return (shift << (HISTOGRAM_SUB_BUCKET_BITS - 1)) + (code >> shift);
+}
 
-    APP_UART_FIFO_INIT( &comm_params,
-                       UART_RX_BUF_SIZE,
-                       UART_TX_BUF_SIZE,
-                       uart_event_handle,
-                       APP_IRQ_PRIORITY_LOWEST,
-                       err_code);
-    APP_ERROR_CHECK(err_code);
+
+/**@brief Function for getting the lowest ADC code of a bucket.
+ *
+ * @param[in]  bucket   Bucket.
+ * @param[out] p_width  Number of codes in the bucket.
+ */
+static uint16_t histogram_bucket_lower_get(uint16_t bucket, uint16_t * p_width)
+{
+    uint32_t shift = 0;
+
+    if (bucket >= (1UL << HISTOGRAM_SUB_BUCKET_BITS))
+    {
+        shift   = (bucket >> (HISTOGRAM_SUB_BUCKET_BITS - 1)) - 1;
+        bucket -= shift << (HISTOGRAM_SUB_BUCKET_BITS - 1);
+    }
+    *p_width = 1 << shift;
+    return bucket << shift;
 }
-/**@snippet [UART Initialization] */
 
 
-/**@brief Function for initializing the Advertising functionality.
+/**@brief Function for adding the scans in an ADC buffer to the histogram being updated.
+ *
+ * @details Called from the ADC handler, in every mode. After HISTOGRAM_SNAPSHOT_SCANS, the histogram
+ *          is handed over to the main loop and the other histogram is updated. If the previous
+ *          snapshot is still reported, or the scheduler queue is full, the histogram keeps being
+ *          updated and the hand over is tried again after the next scan.
  */
-static void advertising_init(void)
+static void histogram_adc_samples_add(nrf_adc_value_t const * p_buffer, uint16_t size)
 {
-    uint32_t               err_code;
-    ble_advdata_t          advdata;
-    ble_advdata_t          scanrsp;
-    ble_adv_modes_config_t options;
+    for (uint32_t i = 0; i + HISTOGRAM_CHANNEL_COUNT <= size; i += HISTOGRAM_CHANNEL_COUNT)
+    {
+        histogram_t * p_histogram = &m_histogram[m_histogram_index];
 
-    // Build advertising data struct to pass into @ref ble_advertising_init.
-    memset(&advdata, 0, sizeof(advdata));
-    advdata.name_type          = BLE_ADVDATA_FULL_NAME;
-    advdata.include_appearance = false;
-    advdata.flags              = BLE_GAP_ADV_FLAGS_LE_ONLY_LIMITED_DISC_MODE;
+        for (uint32_t channel = 0; channel < HISTOGRAM_CHANNEL_COUNT; channel++)
+        {
+            nrf_adc_value_t code = MIN(MAX(p_buffer[i + channel], 0), 1023);
 
-    memset(&scanrsp, 0, sizeof(scanrsp));
-    scanrsp.uuids_complete.uuid_cnt = sizeof(m_adv_uuids) / sizeof(m_adv_uuids[0]);
-    scanrsp.uuids_complete.p_uuids  = m_adv_uuids;
+            p_histogram->counts[channel][histogram_bucket_get(code)]++;
+            p_histogram->min[channel] = MIN(p_histogram->min[channel], code);
+            p_histogram->max[channel] = MAX(p_histogram->max[channel], code);
+            if (code >= HISTOGRAM_THRESHOLD_CODE)
+            {
+                p_histogram->above[channel]++;
+            }
+        }
 
-    memset(&options, 0, sizeof(options));
-    options.ble_adv_fast_enabled  = true;
-    options.ble_adv_fast_interval = APP_ADV_INTERVAL;
-    options.ble_adv_fast_timeout  = APP_ADV_TIMEOUT_IN_SECONDS;
+        if ((++p_histogram->scans >= HISTOGRAM_SNAPSHOT_SCANS) && !m_histogram_busy)
+        {
+            app_evt_t evt;
 
-    err_code = ble_advertising_init(&advdata, &scanrsp, &options, on_adv_evt, NULL);
-    APP_ERROR_CHECK(err_code);
+            evt.type                   = APP_EVT_HISTOGRAM_SNAPSHOT;
+            evt.params.histogram.index = m_histogram_index;
+            if (app_evt_put(&evt) == NRF_SUCCESS)
+            {
+                m_histogram_busy   = true;
+                m_histogram_index ^= 1;
+            }
+        }
+    }
 }
 
 
-/**@brief Function for initializing buttons and leds.
+/**@brief Function for getting a percentile of a channel.
  *
- * @param[out] p_erase_bonds  Will be true if the clear bonding button was pressed to wake the application up.
+ * @details The nearest-rank percentile, returned as the middle of its bucket, so the error is at most
+ *          half a bucket width.
+ *
+ * @param[in] p_histogram  Histogram.
+ * @param[in] channel      Channel.
+ * @param[in] per_mille    Percentile in 1/1000.
+ *
+ * @return ADC code, 0 if the histogram is empty.
  */
-static void buttons_leds_init(bool * p_erase_bonds)
+static uint16_t histogram_percentile_get(histogram_t const * p_histogram, uint8_t channel, uint16_t per_mille)
 {
-    bsp_event_t startup_event;
+    uint32_t rank = (uint32_t)(((uint64_t)p_histogram->scans * per_mille + 999) / 1000);
+    uint32_t sum  = 0;
+    uint16_t width;
 
-    uint32_t err_code = bsp_init(BSP_INIT_LED | BSP_INIT_BUTTONS,
-                                 APP_TIMER_TICKS(100, APP_TIMER_PRESCALER),
-                                 bsp_event_handler);
-    APP_ERROR_CHECK(err_code);
+    for (uint16_t bucket = 0; bucket < HISTOGRAM_BUCKET_COUNT; bucket++)
+    {
+        sum += p_histogram->counts[channel][bucket];
+        if ((sum >= rank) && (sum > 0))
+        {
+            uint16_t lower = histogram_bucket_lower_get(bucket, &width);
+            return lower + (width - 1) / 2;
+        }
+    }
+    return 0;
+}
 
-    err_code = bsp_btn_ble_init(NULL, &startup_event);
-    APP_ERROR_CHECK(err_code);
 
-    *p_erase_bonds = (startup_event == BSP_EVENT_CLEAR_BONDING_DATA);
+/**@brief Function for reporting a snapshot in the main loop, and emptying it.
+ *
+ * @details Sends a HISTOGRAM_REPORT_TYPE packet per channel over NUS: the type, a sequence number byte,
+ *          the channel and the number of scans (32 bit), then the lowest code, the percentiles in
+ *          m_histogram_percentiles and the highest code, 16 bit each, and the part of the samples at or
+ *          above HISTOGRAM_THRESHOLD_CODE in 1/1000. Values are most significant byte first. The same
+ *          values and the time above the threshold are printed on UART.
+ */
+static void histogram_report(histogram_t * p_histogram)
+{
+    uint32_t scans = MAX(p_histogram->scans, 1);
+
+    printf("Histogram %d: %lu scans, %lu packets not sent\r\n", m_histogram_report_seq, (unsigned long)p_histogram->scans,
+           (unsigned long)m_histogram_packets_not_sent);
+    for (uint8_t channel = 0; channel < HISTOGRAM_CHANNEL_COUNT; channel++)
+    {
+        uint8_t   report[HISTOGRAM_REPORT_SIZE];
+        uint8_t * p_report = report;
+        uint16_t  percentiles[HISTOGRAM_PERCENTILE_COUNT];
+        uint32_t  above    = p_histogram->above[channel];
+
+        *p_report++ = HISTOGRAM_REPORT_TYPE;
+        *p_report++ = m_histogram_report_seq;
+        *p_report++ = channel;
+        p_report    = report_put(p_report, p_histogram->scans, 4);
+        p_report    = report_put(p_report, p_histogram->min[channel], 2);
+        for (uint32_t i = 0; i < HISTOGRAM_PERCENTILE_COUNT; i++)
+        {
+            percentiles[i] = histogram_percentile_get(p_histogram, channel, m_histogram_percentiles[i]);
+            p_report       = report_put(p_report, percentiles[i], 2);
+        }
+        p_report    = report_put(p_report, p_histogram->max[channel], 2);
+        p_report    = report_put(p_report, (uint32_t)(((uint64_t)above * 1000) / scans), 2);
+        if (nus_packet_send(report, sizeof(report), false) != NRF_SUCCESS)
+        {
+            m_histogram_packets_not_sent++;
+        }
+
+        printf("    Channel %d: min %d, max %d\r\n", channel, p_histogram->min[channel], p_histogram->max[channel]);
+        for (uint32_t i = 0; i < HISTOGRAM_PERCENTILE_COUNT; i++)
+        {
+            printf("        p%d.%d: %d\r\n", m_histogram_percentiles[i] / 10, m_histogram_percentiles[i] % 10, percentiles[i]);
+        }
+        printf("        %lu ms at or above %d\r\n", (unsigned long)(((uint64_t)above * HISTOGRAM_SAMPLE_INTERVAL_US) / 1000), HISTOGRAM_THRESHOLD_CODE);
+    }
+    m_histogram_report_seq++;
+    histogram_reset(p_histogram);
+    m_histogram_busy = false;
 }
+#endif
 
 
-/**@brief Function for placing the application in low power state while waiting for events.
+#if ADC_SAMPLES_STREAMED
+/**
+ * @brief Function for packing ADC samples into a NUS payload, two bytes per sample, most significant byte first.
+ *
+ * @return Number of bytes written to p_data.
  */
-static void power_manage(void)
+static uint16_t adc_samples_pack(nrf_adc_value_t const * p_buffer, uint16_t size, uint8_t * p_data)
 {
-    uint32_t err_code = sd_app_evt_wait();
-    APP_ERROR_CHECK(err_code);
+    for (uint32_t i = 0; i < size; i++)
+    {
+        p_data[(i*2)]   = p_buffer[i] >> 8;
+        p_data[(i*2)+1] = p_buffer[i];
+    }
+    return size * 2;
 }
 
 /**
- * @brief ADC interrupt handler.
+ * @brief Function for processing a filled ADC buffer in the main loop.
  * Prints ADC results on hardware UART and over BLE via the NUS service.
+ *
+ * Live packets hold the sequence number of the first scan, most significant byte first, followed by
+ * the samples. The sequence numbers of consecutive buffers differ by ADC_SCANS_PER_BUFFER, a larger
+ * step is a gap of scans that were not captured. Scans that are neither sent nor logged are counted
+ * as not sent, and leave the same gap on the central.
  */
-static void adc_event_handler(nrf_drv_adc_evt_t const * p_event)
+static void adc_buffer_process(nrf_adc_value_t const * p_buffer, uint16_t size, uint32_t seq)
 {
-    uint8_t adc_result[ADC_BUFFER_SIZE*2];
+    uint8_t  adc_result[ADC_SEQ_SIZE + ADC_BUFFER_SIZE*2];
+    uint16_t length;
+    uint32_t scans_lost;
 	
+    adc_event_counter++;
+    if (seq > m_adc_scan_next)
+    {
+        printf("Gap: scans %lu to %lu not captured\r\n", (unsigned long)m_adc_scan_next, (unsigned long)(seq - 1));
+        m_adc_scans_not_captured += seq - m_adc_scan_next;
+    }
+    else if (seq < m_adc_scan_next)
+    {
+        printf("Scan %lu out of order, expected %lu\r\n", (unsigned long)seq, (unsigned long)m_adc_scan_next);
+    }
+    m_adc_scan_next = seq + size / number_of_adc_channels;
+#if (STORE_AND_FORWARD_ENABLED == 1)
+    m_adc_scans_not_sent = m_log_dropped * ADC_SCANS_PER_BUFFER;
+#endif
+    scans_lost = m_adc_scans_not_captured + m_adc_scans_not_sent;
+    printf("  adc event counter: %lu, scans %lu to %lu, %lu lost (%lu ppm)\r\n", (unsigned long)adc_event_counter, (unsigned long)seq,
+           (unsigned long)(m_adc_scan_next - 1), (unsigned long)scans_lost, (unsigned long)(((uint64_t)scans_lost * 1000000) / (m_adc_scan_next - m_adc_scan_seq_base)));
+    for (uint32_t i = 0; i < size; i++)
+    {
+        printf("ADC value channel %d: %d\r\n", (int)(i % number_of_adc_channels), p_buffer[i]);
+    }
+    (void)report_put(adc_result, seq, ADC_SEQ_SIZE);
+    length = ADC_SEQ_SIZE + adc_samples_pack(p_buffer, size, &adc_result[ADC_SEQ_SIZE]);
+#if (STORE_AND_FORWARD_ENABLED == 1)
+    if (!log_is_empty() || (nus_packet_send(adc_result, length, false) != NRF_SUCCESS))
+    {
+        log_append(p_buffer, size, seq);                                    //Not sent, or older records are still waiting to be sent
+    }
+#else
+    if ((length > BLE_NUS_MAX_DATA_LEN) || (nus_packet_send(&adc_result[0], length, false) != NRF_SUCCESS))
+    {
+        m_adc_scans_not_sent += size / number_of_adc_channels;
+    }
+#endif
+    LEDS_INVERT(BSP_LED_3_MASK);
+}
+#endif
+
+/**
+ * @brief ADC interrupt handler.
+ * Hands the filled buffer over to the main loop and continues sampling into the other buffer. If the
+ * main loop still processes the other buffer, or the scheduler queue is full, the filled buffer is
+ * dropped and sampled into again.
+ */
+static void adc_event_handler(nrf_drv_adc_evt_t const * p_event)
+{
+    ISR_PROFILE_ENTRY();
+
+#if (ISR_PROFILER_ENABLED == 1)
+    isr_profile_record(ISR_PROFILE_ADC_LATENCY, nrf_drv_timer_capture_get(&m_isr_profiler_timer, NRF_TIMER_CC_CHANNEL0), isr_profile_entry);
+#endif
+
     if (p_event->type == NRF_DRV_ADC_EVT_DONE)
     {
-        adc_event_counter++;
-        printf("  adc event counter: %d\r\n", adc_event_counter);
-        for (uint32_t i = 0; i < p_event->data.done.size; i++)
-        {
-            printf("ADC value channel %d: %d\r\n", (int)(i % number_of_adc_channels), p_event->data.done.p_buffer[i]);
-            adc_result[(i*2)] = p_event->data.done.p_buffer[i] >> 8;
-            adc_result[(i*2)+1] = p_event->data.done.p_buffer[i];
-        }
-        if(ADC_BUFFER_SIZE <= 10)
+#if (HISTOGRAM_ENABLED == 1)
+        histogram_adc_samples_add(p_event->data.done.p_buffer, p_event->data.done.size);
+#endif
+#if (SPECTRUM_ENABLED == 1)
+        spectrum_adc_samples_add(p_event->data.done.p_buffer, p_event->data.done.size);
+#elif (POWER_METER_ENABLED == 1)
+        power_adc_samples_add(p_event->data.done.p_buffer, p_event->data.done.size);
+#else
+        app_evt_t evt;
+
+        evt.type                     = APP_EVT_ADC_DONE;
+        evt.params.adc_done.p_buffer = p_event->data.done.p_buffer;
+        evt.params.adc_done.size     = p_event->data.done.size;
+        evt.params.adc_done.seq      = m_adc_scan_seq_base + m_adc_scans_triggered - p_event->data.done.size / number_of_adc_channels;
+        evt.params.adc_done.index    = adc_buffer_index;
+        if (!m_adc_buffer_busy[adc_buffer_index ^ 1] && (app_evt_put(&evt) == NRF_SUCCESS))
         {
-            ble_nus_string_send(&m_nus, &adc_result[0], ADC_BUFFER_SIZE*2);
-        }	
-        APP_ERROR_CHECK(nrf_drv_adc_buffer_convert(adc_buffer,ADC_BUFFER_SIZE));
-        LEDS_INVERT(BSP_LED_3_MASK);
+            m_adc_buffer_busy[adc_buffer_index] = true;
+            adc_buffer_index ^= 1;
+        }                                                                   //Else the buffer is filled again, and its scans are a gap in the numbering
+#endif
+
+        APP_ERROR_CHECK(nrf_drv_adc_buffer_convert(adc_buffer[adc_buffer_index],ADC_BUFFER_SIZE));
     }
+    ISR_PROFILE_EXIT(ISR_PROFILE_ADC_HANDLER);
 }
 
 /**
@@ -620,6 +2315,9 @@ static void adc_event_handler(nrf_drv_adc_evt_t const * p_event)
  */
 void timer_handler(nrf_timer_event_t event_type, void* p_context)
 {
+#if ADC_SAMPLES_STREAMED
+    m_adc_scans_triggered++;                                                //Scans are numbered by trigger, so a lost conversion leaves a gap
+#endif
 }
 
 void adc_sampling_event_enable(void)
@@ -672,7 +2370,13 @@ void adc_sampling_event_init(void)
     APP_ERROR_CHECK(err_code);
 
     /* setup m_timer for compare event */
+#if (SPECTRUM_ENABLED == 1)
+    uint32_t time_ticks = nrf_drv_timer_us_to_ticks(&m_timer, SPECTRUM_SAMPLE_INTERVAL_US);
+#elif (POWER_METER_ENABLED == 1)
+    uint32_t time_ticks = nrf_drv_timer_us_to_ticks(&m_timer, POWER_SAMPLE_INTERVAL_US);
+#else
     uint32_t time_ticks = nrf_drv_timer_ms_to_ticks(&m_timer, ADC_SAMPLE_RATE);
+#endif
     nrf_drv_timer_extended_compare(&m_timer, NRF_TIMER_CC_CHANNEL0, time_ticks, NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK, true);
     nrf_drv_timer_enable(&m_timer);
 
@@ -687,6 +2391,84 @@ void adc_sampling_event_init(void)
     APP_ERROR_CHECK(err_code);
 }
 
+/**@brief Function for processing application events in the main loop.
+ *
+ * @details An event of low priority is put back at the end of the scheduler queue while events of
+ *          high priority are pending, unless the queue is full.
+ */
+static void app_evt_handler(void * p_event_data, uint16_t event_size)
+{
+    app_evt_t const  * p_evt    = (app_evt_t const *)p_event_data;
+    app_evt_priority_t priority = app_evt_priority_get(p_evt->type);
+
+    UNUSED_PARAMETER(event_size);
+
+    if ((priority == APP_EVT_PRIORITY_LOW) && (m_app_evt_pending[APP_EVT_PRIORITY_HIGH] > 0))
+    {
+        if (app_sched_event_put(p_evt, sizeof(app_evt_t), app_evt_handler) == NRF_SUCCESS)
+        {
+            return;                                                         //Deferred, still counted as pending
+        }
+    }
+
+    CRITICAL_REGION_ENTER();
+    m_app_evt_pending[priority]--;
+    CRITICAL_REGION_EXIT();
+
+    switch (p_evt->type)
+    {
+        case APP_EVT_BLE:
+            m_softdevice_evt_scheduled = false;
+            intern_softdevice_events_execute();                             //Pull and dispatch all pending SoftDevice events
+            break;
+
+        case APP_EVT_UART_RX:
+            nus_string_send(p_evt->params.uart_rx.data, p_evt->params.uart_rx.length);
+            break;
+
+#if (SPECTRUM_ENABLED == 1)
+        case APP_EVT_SPECTRUM_BLOCK:
+            spectrum_block_process(p_evt->params.spectrum_block.p_block);
+            break;
+#elif (POWER_METER_ENABLED == 1)
+        case APP_EVT_POWER_WINDOW:
+            power_window_report(&m_power_window[p_evt->params.power_window.index]);
+            break;
+#else
+        case APP_EVT_ADC_DONE:
+            adc_buffer_process(p_evt->params.adc_done.p_buffer, p_evt->params.adc_done.size, p_evt->params.adc_done.seq);
+            m_adc_buffer_busy[p_evt->params.adc_done.index] = false;
+            break;
+#endif
+
+#if (HISTOGRAM_ENABLED == 1)
+        case APP_EVT_HISTOGRAM_SNAPSHOT:
+            histogram_report(&m_histogram[p_evt->params.histogram.index]);
+            break;
+#endif
+
+#if (ISR_PROFILER_ENABLED == 1)
+        case APP_EVT_ISR_PROFILE_DUMP:
+            isr_profile_dump();
+            break;
+#endif
+
+        default:
+            break;
+    }
+
+    if (m_app_evt_queue_max != m_app_evt_queue_max_reported)
+    {
+        m_app_evt_queue_max_reported = m_app_evt_queue_max;
+        printf("Scheduler queue high-water mark: %d of %d events\r\n", m_app_evt_queue_max_reported, APP_SCHED_QUEUE_SIZE);
+    }
+    if (m_app_evt_dropped != m_app_evt_dropped_reported)
+    {
+        m_app_evt_dropped_reported = m_app_evt_dropped;
+        printf("Events dropped, scheduler queue full: %lu\r\n", (unsigned long)m_app_evt_dropped_reported);
+    }
+}
+
 /**@brief Application main function.
  */
 int main(void)
@@ -695,19 +2477,30 @@ int main(void)
     bool erase_bonds;
 
     // Initialize.
+    APP_SCHED_INIT(APP_SCHED_MAX_EVT_SIZE, APP_SCHED_QUEUE_SIZE);            //Initialize scheduler
     APP_TIMER_INIT(APP_TIMER_PRESCALER, APP_TIMER_OP_QUEUE_SIZE, false);
     uart_init();
 
     buttons_leds_init(&erase_bonds);
     ble_stack_init();
+#if (STORE_AND_FORWARD_ENABLED == 1)
+    log_init();
+#endif
     gap_params_init();
     services_init();
     advertising_init();
     conn_params_init();
 
     adc_sampling_event_init();
+#if (ISR_PROFILER_ENABLED == 1)
+    isr_profiler_init();
+#endif
     adc_config();
-    APP_ERROR_CHECK(nrf_drv_adc_buffer_convert(adc_buffer,ADC_BUFFER_SIZE));
+#if (HISTOGRAM_ENABLED == 1)
+    histogram_reset(&m_histogram[0]);
+    histogram_reset(&m_histogram[1]);
+#endif
+    APP_ERROR_CHECK(nrf_drv_adc_buffer_convert(adc_buffer[adc_buffer_index],ADC_BUFFER_SIZE));
     adc_sampling_event_enable();
 	
     printf("\r\nUART Start - with ADC !\r\n");
@@ -717,6 +2510,7 @@ int main(void)
     // Enter main loop.
     for (;;)
     {
+        app_sched_execute();     //Process the application events in the scheduler queue
         power_manage();
     }
 }
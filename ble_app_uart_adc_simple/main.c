@@ -38,7 +38,9 @@
 #include "bsp.h"
 #include "bsp_btn_ble.h"
 #include "nrf_drv_adc.h"
-#include "nrf_delay.h"
+#include "nrf_drv_ppi.h"
+#include "nrf_drv_timer.h"
+#include "app_scheduler.h"
 
 #define IS_SRVC_CHANGED_CHARACT_PRESENT 0                                           /**< Include the service_changed characteristic. If not enabled, the server's database cannot be changed for the lifetime of the device. */
 
@@ -73,10 +75,22 @@
 #define UART_TX_BUF_SIZE                256                                         /**< UART TX buffer size. */
 #define UART_RX_BUF_SIZE                256                                         /**< UART RX buffer size. */
 
+#define APP_SCHED_MAX_EVT_SIZE          sizeof(app_evt_t)                           /**< Maximum size of scheduler event data. All application events have the same fixed size. */
+#define APP_SCHED_QUEUE_SIZE            10                                          /**< Maximum number of events in the scheduler queue. */
+
+#define ISR_PROFILER_ENABLED            0                                           /**< Set to 1 to measure the latency and duration of the ADC and UART handlers with TIMER1. Press Button 4 to print the results on UART. Keeps HFCLK running. */
+#define ISR_PROFILER_TIMER_FREQ         NRF_TIMER_FREQ_16MHz                        /**< Profiler timer frequency. At 16 MHz one tick is one CPU cycle, and the 16 bit timer measures up to 4 ms. Each halving of the frequency doubles the range. */
+#define ISR_PROFILER_TICKS_TO_NS(TICKS) (((TICKS) * (125UL << ISR_PROFILER_TIMER_FREQ)) / 2) /**< Converts profiler timer ticks to nanoseconds. */
+#define ISR_PROFILER_HISTOGRAM_SIZE     17                                          /**< Histogram buckets, bucket n holds intervals from 2^(n-1) to 2^n - 1 ticks. */
+
+#define ADC_SAMPLE_INTERVAL             APP_TIMER_TICKS(250, APP_TIMER_PRESCALER)   /**< Interval between two ADC samples (ticks). */
 #define ADC_BUFFER_SIZE 4                                                           /**< Size of buffer for ADC samples.  */
-static nrf_adc_value_t                  adc_buffer[ADC_BUFFER_SIZE];                /**< ADC buffer. */
+static nrf_adc_value_t                  adc_buffer[2][ADC_BUFFER_SIZE];             /**< ADC buffers, one is filled while the other is processed. */
+static uint8_t                          adc_buffer_index = 0;                       /**< Index of the ADC buffer being filled. */
 static nrf_drv_adc_channel_t            m_channel_config = NRF_DRV_ADC_DEFAULT_CHANNEL(NRF_ADC_CONFIG_INPUT_2); /**< Channel instance. Default configuration used. */
-static uint8_t                          adc_event_counter = 0;
+static uint32_t                         adc_event_counter = 0;
+static volatile bool                    m_adc_buffer_busy[2];                       /**< True while the main loop processes the buffer, it is not filled again until released. */
+static volatile uint32_t                m_adc_buffers_dropped;                      /**< Number of filled buffers dropped because the other buffer was still processed or the scheduler queue was full. */
 
 
 static ble_nus_t                        m_nus;                                      /**< Structure to identify the Nordic UART Service. */
@@ -84,6 +98,271 @@ static uint16_t                         m_conn_handle = BLE_CONN_HANDLE_INVALID;
 
 static ble_uuid_t                       m_adv_uuids[] = {{BLE_UUID_NUS_SERVICE, NUS_SERVICE_UUID_TYPE}};  /**< Universally unique service identifier. */
 
+APP_TIMER_DEF(m_adc_sample_timer_id);                                               /**< ADC sample timer. */
+
+/**@brief Application event types. Events are posted from interrupt context and processed in the main loop. */
+typedef enum
+{
+    APP_EVT_BLE,                                                            /**< SoftDevice events are available. */
+    APP_EVT_UART_RX,                                                        /**< A line was received on UART. */
+    APP_EVT_ADC_DONE,                                                       /**< An ADC buffer is filled. */
+    APP_EVT_ISR_PROFILE_DUMP,                                               /**< Button 4 was pressed, print the interrupt handler profile. */
+} app_evt_type_t;
+
+/**@brief Application event priorities. Events of lower priority are deferred while events of higher priority are pending. */
+typedef enum
+{
+    APP_EVT_PRIORITY_HIGH,                                                  /**< Protocol and user input events. */
+    APP_EVT_PRIORITY_LOW,                                                   /**< Measurement processing. */
+    APP_EVT_PRIORITY_COUNT                                                  /**< Number of event priorities. */
+} app_evt_priority_t;
+
+/**@brief Fixed-size application event, copied into the scheduler queue. */
+typedef struct
+{
+    app_evt_type_t type;                                                    /**< Event type. */
+    union
+    {
+        struct
+        {
+            uint8_t data[BLE_NUS_MAX_DATA_LEN];                             /**< Received characters. */
+            uint8_t length;                                                 /**< Number of received characters. */
+        } uart_rx;                                                          /**< Parameters of @ref APP_EVT_UART_RX. */
+        struct
+        {
+            nrf_adc_value_t const * p_buffer;                               /**< Filled ADC buffer. */
+            uint16_t                size;                                   /**< Number of samples in the buffer. */
+            uint8_t                 index;                                  /**< Index of the buffer in adc_buffer, released after processing. */
+        } adc_done;                                                         /**< Parameters of @ref APP_EVT_ADC_DONE. */
+    } params;
+} app_evt_t;
+
+#if (ISR_PROFILER_ENABLED == 1)
+/**@brief Profiled intervals. */
+typedef enum
+{
+    ISR_PROFILE_ADC_LATENCY,                                                /**< ADC END event to adc_event_handler entry. Includes the driver ADC_IRQHandler and preemption by the SoftDevice and higher priority interrupts. */
+    ISR_PROFILE_ADC_HANDLER,                                                /**< Duration of adc_event_handler. */
+    ISR_PROFILE_UART_HANDLER,                                               /**< Duration of uart_event_handle. */
+    ISR_PROFILE_COUNT                                                       /**< Number of profiled intervals. */
+} isr_profile_id_t;
+
+/**@brief Statistics of a profiled interval. */
+typedef struct
+{
+    uint32_t count;                                                         /**< Number of measurements. */
+    uint16_t min;                                                           /**< Shortest interval (ticks). */
+    uint16_t max;                                                           /**< Longest interval (ticks). */
+    uint32_t histogram[ISR_PROFILER_HISTOGRAM_SIZE];                        /**< Number of measurements per power of two bucket. */
+} isr_profile_t;
+#endif
+
+static volatile uint8_t                 m_app_evt_pending[APP_EVT_PRIORITY_COUNT];  /**< Number of queued application events per priority. */
+static uint8_t                          m_app_evt_queue_max;                        /**< High-water mark of the number of queued application events. */
+static uint8_t                          m_app_evt_queue_max_reported;               /**< High-water mark last reported on the log. */
+static volatile uint32_t                m_app_evt_dropped;                          /**< Number of application events dropped because the scheduler queue was full. */
+static uint32_t                         m_app_evt_dropped_reported;                 /**< Number of dropped application events last reported on the log. */
+static volatile bool                    m_softdevice_evt_scheduled;                 /**< True while an @ref APP_EVT_BLE event is queued. */
+
+static void app_evt_handler(void * p_event_data, uint16_t event_size);
+
+
+/**@brief Function for getting the priority of an application event type.
+ */
+static app_evt_priority_t app_evt_priority_get(app_evt_type_t type)
+{
+    return ((type == APP_EVT_ADC_DONE) || (type == APP_EVT_ISR_PROFILE_DUMP)) ? APP_EVT_PRIORITY_LOW : APP_EVT_PRIORITY_HIGH;
+}
+
+
+/**@brief Function for posting an application event to the scheduler queue.
+ *
+ * @details May be called from interrupt context. The event is copied into the queue.
+ *
+ * @param[in] p_evt  Event to post.
+ *
+ * @return NRF_SUCCESS, or NRF_ERROR_NO_MEM if the scheduler queue is full. The dropped event is
+ *         counted and reported on the log from the main loop.
+ */
+static uint32_t app_evt_put(app_evt_t const * p_evt)
+{
+    uint32_t err_code;
+    uint8_t  queued = 0;
+
+    CRITICAL_REGION_ENTER();
+    err_code = app_sched_event_put(p_evt, sizeof(app_evt_t), app_evt_handler);
+    if (err_code == NRF_SUCCESS)
+    {
+        m_app_evt_pending[app_evt_priority_get(p_evt->type)]++;
+        for (uint32_t i = 0; i < APP_EVT_PRIORITY_COUNT; i++)
+        {
+            queued += m_app_evt_pending[i];
+        }
+        if (queued > m_app_evt_queue_max)
+        {
+            m_app_evt_queue_max = queued;
+        }
+    }
+    else
+    {
+        m_app_evt_dropped++;
+    }
+    CRITICAL_REGION_EXIT();
+
+    return err_code;
+}
+
+
+/**@brief Function for scheduling SoftDevice event processing in the main loop.
+ *
+ * @details Called by the SoftDevice handler from the SoftDevice event interrupt. One queued event
+ *          pulls all pending SoftDevice events, so no further event is queued until it is processed.
+ */
+static uint32_t softdevice_evt_schedule(void)
+{
+    uint32_t  err_code;
+    app_evt_t evt;
+
+    if (m_softdevice_evt_scheduled)
+    {
+        return NRF_SUCCESS;
+    }
+
+    evt.type = APP_EVT_BLE;
+    err_code = app_evt_put(&evt);
+    if (err_code == NRF_SUCCESS)
+    {
+        m_softdevice_evt_scheduled = true;
+    }
+    return err_code;
+}
+
+
+#if (ISR_PROFILER_ENABLED == 1)
+static const nrf_drv_timer_t            m_isr_profiler_timer = NRF_DRV_TIMER_INSTANCE(1); /**< Free running timer. CC[0] captures the ADC END event, CC[1] is used for timestamps. */
+static isr_profile_t                    m_isr_profile[ISR_PROFILE_COUNT];           /**< Statistics per profiled interval. */
+static const char * const               m_isr_profile_names[ISR_PROFILE_COUNT] =    /**< Names of the profiled intervals, indexed by isr_profile_id_t. */
+{
+    "ADC END to adc_event_handler",
+    "adc_event_handler",
+    "uart_event_handle"
+};
+
+/**@brief Function for getting a profiler timestamp. May be called from any interrupt priority. */
+static uint16_t isr_profiler_time_get(void)
+{
+    uint16_t time;
+
+    CRITICAL_REGION_ENTER();
+    time = nrf_drv_timer_capture(&m_isr_profiler_timer, NRF_TIMER_CC_CHANNEL1);
+    CRITICAL_REGION_EXIT();
+    return time;
+}
+
+
+/**@brief Function for adding a measured interval to its statistics.
+ *
+ * @param[in] id     Profiled interval.
+ * @param[in] start  Timestamp at the start of the interval.
+ * @param[in] end    Timestamp at the end of the interval.
+ */
+static void isr_profile_record(isr_profile_id_t id, uint16_t start, uint16_t end)
+{
+    uint16_t        ticks   = end - start;
+    uint8_t         bucket  = 0;
+    isr_profile_t * p_profile = &m_isr_profile[id];
+
+    while ((bucket < ISR_PROFILER_HISTOGRAM_SIZE - 1) && ((ticks >> bucket) != 0))
+    {
+        bucket++;
+    }
+
+    CRITICAL_REGION_ENTER();
+    if ((p_profile->count == 0) || (ticks < p_profile->min))
+    {
+        p_profile->min = ticks;
+    }
+    if (ticks > p_profile->max)
+    {
+        p_profile->max = ticks;
+    }
+    p_profile->count++;
+    p_profile->histogram[bucket]++;
+    CRITICAL_REGION_EXIT();
+}
+
+
+/**@brief Function for printing the profile on UART and starting over. Called in the main context.
+ */
+static void isr_profile_dump(void)
+{
+    isr_profile_t profile;
+
+    printf("\r\nInterrupt handler profile:\r\n");
+    for (uint32_t id = 0; id < ISR_PROFILE_COUNT; id++)
+    {
+        CRITICAL_REGION_ENTER();
+        profile = m_isr_profile[id];
+        memset(&m_isr_profile[id], 0, sizeof(isr_profile_t));
+        CRITICAL_REGION_EXIT();
+
+        printf("%s: %lu samples, min %lu ns, max %lu ns\r\n", m_isr_profile_names[id], (unsigned long)profile.count,
+               (unsigned long)ISR_PROFILER_TICKS_TO_NS(profile.min), (unsigned long)ISR_PROFILER_TICKS_TO_NS(profile.max));
+        for (uint32_t bucket = 1; bucket < ISR_PROFILER_HISTOGRAM_SIZE; bucket++)
+        {
+            if (profile.histogram[bucket] != 0)
+            {
+                printf("    %lu - %lu ns: %lu\r\n", (unsigned long)ISR_PROFILER_TICKS_TO_NS(1UL << (bucket - 1)),
+                       (unsigned long)ISR_PROFILER_TICKS_TO_NS((1UL << bucket) - 1), (unsigned long)profile.histogram[bucket]);
+            }
+        }
+    }
+}
+
+
+/**@brief Profiler timer interrupt handler. */
+static void isr_profiler_timer_handler(nrf_timer_event_t event_type, void * p_context)
+{
+}
+
+
+/**@brief Function for starting the free running profiler timer and capturing the ADC END event in CC[0] through PPI.
+ */
+static void isr_profiler_init(void)
+{
+    ret_code_t        err_code;
+    nrf_ppi_channel_t ppi_channel;
+
+    err_code = nrf_drv_ppi_init();
+    if (err_code != NRF_ERROR_MODULE_ALREADY_INITIALIZED)
+    {
+        APP_ERROR_CHECK(err_code);
+    }
+
+    nrf_drv_timer_config_t timer_cfg = NRF_DRV_TIMER_DEFAULT_CONFIG;
+    timer_cfg.frequency = ISR_PROFILER_TIMER_FREQ;
+    timer_cfg.bit_width = NRF_TIMER_BIT_WIDTH_16;
+    err_code = nrf_drv_timer_init(&m_isr_profiler_timer, &timer_cfg, isr_profiler_timer_handler);
+    APP_ERROR_CHECK(err_code);
+
+    err_code = nrf_drv_ppi_channel_alloc(&ppi_channel);
+    APP_ERROR_CHECK(err_code);
+    err_code = nrf_drv_ppi_channel_assign(ppi_channel, (uint32_t)&NRF_ADC->EVENTS_END,
+                                          nrf_drv_timer_capture_task_address_get(&m_isr_profiler_timer, NRF_TIMER_CC_CHANNEL0));
+    APP_ERROR_CHECK(err_code);
+    err_code = nrf_drv_ppi_channel_enable(ppi_channel);
+    APP_ERROR_CHECK(err_code);
+
+    nrf_drv_timer_enable(&m_isr_profiler_timer);
+}
+
+#define ISR_PROFILE_ENTRY()             uint16_t isr_profile_entry = isr_profiler_time_get()                        /**< Takes the entry timestamp of a profiled handler. */
+#define ISR_PROFILE_EXIT(ID)            isr_profile_record((ID), isr_profile_entry, isr_profiler_time_get())        /**< Records the duration of a profiled handler. */
+#else
+#define ISR_PROFILE_ENTRY()
+#define ISR_PROFILE_EXIT(ID)
+#endif
+
 
 /**@brief Function for assert macro callback.
  *
@@ -397,7 +676,7 @@ static void ble_stack_init(void)
     nrf_clock_lf_cfg_t clock_lf_cfg = NRF_CLOCK_LFCLKSRC;
 
     // Initialize SoftDevice.
-    SOFTDEVICE_HANDLER_INIT(&clock_lf_cfg, NULL);
+    SOFTDEVICE_HANDLER_INIT(&clock_lf_cfg, softdevice_evt_schedule);       //SoftDevice events are processed in the main loop
 
     ble_enable_params_t ble_enable_params;
     err_code = softdevice_enable_get_default_config(CENTRAL_LINK_COUNT,
@@ -427,7 +706,8 @@ static void ble_stack_init(void)
  */
 void bsp_event_handler(bsp_event_t event)
 {
-    uint32_t err_code;
+    uint32_t  err_code;
+    app_evt_t evt;
     switch (event)
     {
         case BSP_EVENT_SLEEP:
@@ -460,6 +740,11 @@ void bsp_event_handler(bsp_event_t event)
         case BSP_EVENT_KEY_1:
                 LEDS_OFF(BSP_LED_1_MASK);
             break;
+
+        case BSP_EVENT_KEY_3:
+            evt.type = APP_EVT_ISR_PROFILE_DUMP;                            //Print the profile from the main loop
+            (void)app_evt_put(&evt);                                           //The press is dropped and counted when the scheduler queue is full
+            break;
         
         default:
             break;
@@ -479,7 +764,7 @@ void uart_event_handle(app_uart_evt_t * p_event)
 {
     static uint8_t data_array[BLE_NUS_MAX_DATA_LEN];
     static uint8_t index = 0;
-    uint32_t       err_code;
+    ISR_PROFILE_ENTRY();
 
     switch (p_event->evt_type)
     {
@@ -489,11 +774,12 @@ void uart_event_handle(app_uart_evt_t * p_event)
 
             if ((data_array[index - 1] == '\n') || (index >= (BLE_NUS_MAX_DATA_LEN)))
             {
-                err_code = ble_nus_string_send(&m_nus, data_array, index);
-                if (err_code != NRF_ERROR_INVALID_STATE)
-                {
-                    APP_ERROR_CHECK(err_code);
-                }
+                app_evt_t evt;
+
+                evt.type = APP_EVT_UART_RX;                                 //Send the line over BLE from the main loop
+                memcpy(evt.params.uart_rx.data, data_array, index);
+                evt.params.uart_rx.length = index;
+                (void)app_evt_put(&evt);                                    //The line is dropped and counted when the scheduler queue is full
 
                 index = 0;
             }
@@ -510,6 +796,7 @@ void uart_event_handle(app_uart_evt_t * p_event)
         default:
             break;
     }
+    ISR_PROFILE_EXIT(ISR_PROFILE_UART_HANDLER);
 }
 /**@snippet [Handling the data received over UART] */
 
@@ -599,31 +886,103 @@ static void power_manage(void)
     APP_ERROR_CHECK(err_code);
 }
 
+/**@brief Function for sending a line received on UART over BLE.
+ */
+static void nus_string_send(uint8_t const * p_data, uint8_t length)
+{
+    uint32_t err_code = ble_nus_string_send(&m_nus, (uint8_t *)p_data, length);
+    if (err_code != NRF_ERROR_INVALID_STATE)
+    {
+        APP_ERROR_CHECK(err_code);
+    }
+}
+
+
 /**
- * @brief ADC interrupt handler.
+ * @brief Function for packing ADC samples into a NUS payload, two bytes per sample, most significant byte first.
+ *
+ * @return Number of bytes written to p_data.
+ */
+static uint16_t adc_samples_pack(nrf_adc_value_t const * p_buffer, uint16_t size, uint8_t * p_data)
+{
+    for (uint32_t i = 0; i < size; i++)
+    {
+        p_data[(i*2)]   = p_buffer[i] >> 8;
+        p_data[(i*2)+1] = p_buffer[i];
+    }
+    return size * 2;
+}
+
+
+/**
+ * @brief Function for processing a filled ADC buffer in the main loop.
  * Prints ADC results on hardware UART and over BLE via the NUS service.
  */
-static void adc_event_handler(nrf_drv_adc_evt_t const * p_event)
+static void adc_buffer_process(nrf_adc_value_t const * p_buffer, uint16_t size)
 {
-    uint8_t adc_result[ADC_BUFFER_SIZE*2];
+    uint8_t  adc_result[ADC_BUFFER_SIZE*2];
+    uint16_t length;
 	
+    adc_event_counter++;
+    printf("    ADC event counter: %lu, %lu buffers dropped\r\n", (unsigned long)adc_event_counter, (unsigned long)m_adc_buffers_dropped);			
+    uint32_t i;
+    for (i = 0; i < size; i++)
+    {
+        printf("Sample value %d: %d\r\n", (unsigned int)i+1, p_buffer[i]);   //Print ADC result on hardware UART
+    }
+    length = adc_samples_pack(p_buffer, size, adc_result);
+    if(length <= BLE_NUS_MAX_DATA_LEN)
+    {
+        ble_nus_string_send(&m_nus, &adc_result[0], length);                     //Send ADC result over BLE via NUS service
+    }		
+    LEDS_INVERT(BSP_LED_3_MASK);				                                          //Indicate sampling complete on LED 4
+}
+
+/**
+ * @brief ADC interrupt handler.
+ * Hands the filled buffer over to the main loop and allocates the other buffer for the next samples. If
+ * the main loop still processes the other buffer, or the scheduler queue is full, the filled buffer is
+ * dropped and allocated again.
+ */
+static void adc_event_handler(nrf_drv_adc_evt_t const * p_event)
+{
+    ISR_PROFILE_ENTRY();
+
+#if (ISR_PROFILER_ENABLED == 1)
+    isr_profile_record(ISR_PROFILE_ADC_LATENCY, nrf_drv_timer_capture_get(&m_isr_profiler_timer, NRF_TIMER_CC_CHANNEL0), isr_profile_entry);
+#endif
+
     if (p_event->type == NRF_DRV_ADC_EVT_DONE)
     {
-        adc_event_counter++;
-        printf("    ADC event counter: %d\r\n", adc_event_counter);			
-        uint32_t i;
-        for (i = 0; i < p_event->data.done.size; i++)
+        app_evt_t evt;
+
+        evt.type                     = APP_EVT_ADC_DONE;
+        evt.params.adc_done.p_buffer = p_event->data.done.p_buffer;
+        evt.params.adc_done.size     = p_event->data.done.size;
+        evt.params.adc_done.index    = adc_buffer_index;
+        if (!m_adc_buffer_busy[adc_buffer_index ^ 1] && (app_evt_put(&evt) == NRF_SUCCESS))
         {
-            printf("Sample value %d: %d\r\n", (unsigned int)i+1, p_event->data.done.p_buffer[i]);   //Print ADC result on hardware UART
-            adc_result[(i*2)] = p_event->data.done.p_buffer[i] >> 8;
-            adc_result[(i*2)+1] = p_event->data.done.p_buffer[i];					
+            m_adc_buffer_busy[adc_buffer_index] = true;
+            adc_buffer_index ^= 1;
         }
-        if(ADC_BUFFER_SIZE <= 10)
+        else
         {
-            ble_nus_string_send(&m_nus, &adc_result[0], ADC_BUFFER_SIZE*2);           //Send ADC result over BLE via NUS service
-        }		
-        LEDS_INVERT(BSP_LED_3_MASK);				                                          //Indicate sampling complete on LED 4
+            m_adc_buffers_dropped++;
+        }
+        APP_ERROR_CHECK(nrf_drv_adc_buffer_convert(adc_buffer[adc_buffer_index],ADC_BUFFER_SIZE));   //Allocate buffer for ADC
     }
+    ISR_PROFILE_EXIT(ISR_PROFILE_ADC_HANDLER);
+}
+
+/**
+ * @brief ADC sample timer handler. Triggers one ADC conversion.
+ */
+static void adc_sample_timeout_handler(void * p_context)
+{
+    UNUSED_PARAMETER(p_context);
+
+    nrf_drv_adc_sample();           // manually trigger ADC conversion
+    LEDS_INVERT(BSP_LED_1_MASK);    // Indicate sampling
 }
 
 /**
@@ -638,6 +997,75 @@ static void adc_config(void)
     APP_ERROR_CHECK(ret_code);
 
     nrf_drv_adc_channel_enable(&m_channel_config);
+    APP_ERROR_CHECK(nrf_drv_adc_buffer_convert(adc_buffer[adc_buffer_index],ADC_BUFFER_SIZE));   //Allocate buffer for ADC
+
+    //Sample every ADC_SAMPLE_INTERVAL, the CPU sleeps in between
+    ret_code = app_timer_create(&m_adc_sample_timer_id, APP_TIMER_MODE_REPEATED, adc_sample_timeout_handler);
+    APP_ERROR_CHECK(ret_code);
+    ret_code = app_timer_start(m_adc_sample_timer_id, ADC_SAMPLE_INTERVAL, NULL);
+    APP_ERROR_CHECK(ret_code);
+}
+
+/**@brief Function for processing application events in the main loop.
+ *
+ * @details An event of low priority is put back at the end of the scheduler queue while events of
+ *          high priority are pending, unless the queue is full.
+ */
+static void app_evt_handler(void * p_event_data, uint16_t event_size)
+{
+    app_evt_t const  * p_evt    = (app_evt_t const *)p_event_data;
+    app_evt_priority_t priority = app_evt_priority_get(p_evt->type);
+
+    UNUSED_PARAMETER(event_size);
+
+    if ((priority == APP_EVT_PRIORITY_LOW) && (m_app_evt_pending[APP_EVT_PRIORITY_HIGH] > 0))
+    {
+        if (app_sched_event_put(p_evt, sizeof(app_evt_t), app_evt_handler) == NRF_SUCCESS)
+        {
+            return;                                                         //Deferred, still counted as pending
+        }
+    }
+
+    CRITICAL_REGION_ENTER();
+    m_app_evt_pending[priority]--;
+    CRITICAL_REGION_EXIT();
+
+    switch (p_evt->type)
+    {
+        case APP_EVT_BLE:
+            m_softdevice_evt_scheduled = false;
+            intern_softdevice_events_execute();                             //Pull and dispatch all pending SoftDevice events
+            break;
+
+        case APP_EVT_UART_RX:
+            nus_string_send(p_evt->params.uart_rx.data, p_evt->params.uart_rx.length);
+            break;
+
+        case APP_EVT_ADC_DONE:
+            adc_buffer_process(p_evt->params.adc_done.p_buffer, p_evt->params.adc_done.size);
+            m_adc_buffer_busy[p_evt->params.adc_done.index] = false;
+            break;
+
+#if (ISR_PROFILER_ENABLED == 1)
+        case APP_EVT_ISR_PROFILE_DUMP:
+            isr_profile_dump();
+            break;
+#endif
+
+        default:
+            break;
+    }
+
+    if (m_app_evt_queue_max != m_app_evt_queue_max_reported)
+    {
+        m_app_evt_queue_max_reported = m_app_evt_queue_max;
+        printf("Scheduler queue high-water mark: %d of %d events\r\n", m_app_evt_queue_max_reported, APP_SCHED_QUEUE_SIZE);
+    }
+    if (m_app_evt_dropped != m_app_evt_dropped_reported)
+    {
+        m_app_evt_dropped_reported = m_app_evt_dropped;
+        printf("Events dropped, scheduler queue full: %lu\r\n", (unsigned long)m_app_evt_dropped_reported);
+    }
 }
 
 /**@brief Application main function.
@@ -648,6 +1076,7 @@ int main(void)
     bool erase_bonds;
 
     // Initialize.
+    APP_SCHED_INIT(APP_SCHED_MAX_EVT_SIZE, APP_SCHED_QUEUE_SIZE);            //Initialize scheduler
     APP_TIMER_INIT(APP_TIMER_PRESCALER, APP_TIMER_OP_QUEUE_SIZE, false);
     uart_init();
 
@@ -662,19 +1091,16 @@ int main(void)
     err_code = ble_advertising_start(BLE_ADV_MODE_FAST);
     APP_ERROR_CHECK(err_code);
     
+#if (ISR_PROFILER_ENABLED == 1)
+    isr_profiler_init();
+#endif
     adc_config();
 
     // Enter main loop.
     for (;;)
     {
-        APP_ERROR_CHECK(nrf_drv_adc_buffer_convert(adc_buffer,ADC_BUFFER_SIZE));   //Allocate buffer for ADC
-        for (uint32_t i = 0; i < ADC_BUFFER_SIZE; i++)
-        {
-            nrf_drv_adc_sample();           // manually trigger ADC conversion
-            power_manage();                 // CPU enter sleep mode during sampling. CPU will be enabled again when ADC interrupt occurs and adc_event_handler is called
-            LEDS_INVERT(BSP_LED_1_MASK);    // Indicate sampling complete
-            nrf_delay_ms(250);              // Slow down sampling frequency with 250ms blocking delay
-        }
+        app_sched_execute();     //Process the application events in the scheduler queue
+        power_manage();          //CPU enter sleep mode until the next event
     }
 }
 